@@ -5,16 +5,27 @@ include $(call all-named-subdir-makefiles, parsers)
 LOCAL_PATH := $(TOP_LOCAL_PATH)
 
 include $(CLEAR_VARS)
-LOCAL_MODULE := stm32flash
+LOCAL_MODULE := libstm32flash
 LOCAL_SRC_FILES :=	\
+	crc.c		\
 	dev_table.c	\
 	i2c.c		\
 	init.c		\
-	main.c		\
+	libstm32flash.c	\
 	port.c		\
+	profile.c	\
 	serial_common.c	\
 	serial_platform.c	\
+	sim.c		\
+	spsc.c		\
 	stm32.c		\
+	trace.c		\
 	utils.c
 LOCAL_STATIC_LIBRARIES := libparsers
+include $(BUILD_STATIC_LIBRARY)
+
+include $(CLEAR_VARS)
+LOCAL_MODULE := stm32flash
+LOCAL_SRC_FILES := main.c server.c
+LOCAL_STATIC_LIBRARIES := libstm32flash libparsers
 include $(BUILD_EXECUTABLE)
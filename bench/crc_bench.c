@@ -0,0 +1,116 @@
+/*
+  stm32flash - Open Source ST STM32 flash program for *nix
+  Copyright (C) 2026 The stm32flash contributors
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+ * Throughput of the host side STM32 CRC, compared with the original
+ * bit-at-a-time implementation.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../crc.h"
+#include "../stm32.h"
+
+#define BUF_SIZE	(4 * 1024 * 1024)
+
+/* the bit-at-a-time implementation, used as reference */
+static uint32_t crc_bitwise(uint32_t crc, const uint8_t *buf, unsigned int len)
+{
+	uint32_t data;
+	int i;
+
+	while (len) {
+		data = *buf++;
+		data |= *buf++ << 8;
+		data |= *buf++ << 16;
+		data |= (uint32_t)*buf++ << 24;
+		len -= 4;
+
+		crc ^= data;
+		for (i = 0; i < 32; i++)
+			if (crc & 0x80000000)
+				crc = (crc << 1) ^ 0x04c11db7;
+			else
+				crc = (crc << 1);
+	}
+	return crc;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double bench(uint32_t (*f)(uint32_t, const uint8_t *, unsigned int),
+		    const uint8_t *buf, unsigned int len, int loops,
+		    uint32_t *crc)
+{
+	double t0, t;
+	int i;
+
+	t0 = now();
+	for (i = 0; i < loops; i++)
+		*crc = f(STM32_CRC_INIT, buf, len);
+	t = now() - t0;
+	return (double)len * loops / t / 1e9;
+}
+
+int main(void)
+{
+	uint8_t *buf;
+	uint32_t crc_ref, crc_new, crc_a, crc_b;
+	unsigned int i, split;
+	double gbs_ref, gbs_new;
+
+	buf = malloc(BUF_SIZE);
+	if (!buf) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	srand(1);
+	for (i = 0; i < BUF_SIZE; i++)
+		buf[i] = rand();
+
+	gbs_ref = bench(crc_bitwise, buf, BUF_SIZE, 2, &crc_ref);
+	gbs_new = bench(crc_stm32, buf, BUF_SIZE, 50, &crc_new);
+	if (crc_ref != crc_new) {
+		fprintf(stderr, "CRC mismatch: 0x%08x != 0x%08x\n",
+			crc_new, crc_ref);
+		return 1;
+	}
+
+	split = BUF_SIZE / 3 & ~3;
+	crc_a = crc_stm32(STM32_CRC_INIT, buf, split);
+	crc_b = crc_stm32(STM32_CRC_INIT, buf + split, BUF_SIZE - split);
+	if (crc_stm32_combine(crc_a, crc_b, BUF_SIZE - split) != crc_ref) {
+		fprintf(stderr, "CRC combine mismatch\n");
+		return 1;
+	}
+
+	printf("crc bitwise : %6.3f GB/s\n", gbs_ref);
+	printf("crc table   : %6.3f GB/s (x%.1f)\n", gbs_new, gbs_new / gbs_ref);
+	free(buf);
+	return 0;
+}
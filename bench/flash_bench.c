@@ -0,0 +1,478 @@
+/*
+  stm32flash - Open Source ST STM32 flash program for *nix
+  Copyright (C) 2026 The stm32flash contributors
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+ * End-to-end benchmark: run the stm32flash binary against the bootloader
+ * simulator, sweeping operation, image size, sparsity, baud rate and frame
+ * size, and print one JSON report.
+ * Throughput and wire utilisation are computed on the virtual time of the
+ * simulator, so they are reproducible on any host; wall time and the
+ * read/write syscalls of stm32flash are reported too.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "../stm32.h"
+
+#define MAX_LIST	16
+#define MAX_ARGS	32
+#define TAIL_SIZE	8192
+
+extern const stm32_dev_t devices[];
+
+static const char *flash_bin = "./stm32flash";
+static const char *sim_bin = "./stm32sim";
+static const char *dev_cfg = "0x414,crc";
+static const stm32_dev_t *dev;
+static int use_pty;
+static char tmpdir[] = "/tmp/flash_bench.XXXXXX";
+
+static const char *ops[MAX_LIST] = { "write", "verify", "read", "erase", "crc" };
+static const char *sizes[MAX_LIST] = { "16", "64", "256" };
+static const char *sparsity[MAX_LIST] = { "0", "50" };
+static const char *bauds[MAX_LIST] = { "115200", "460800" };
+static const char *frames[MAX_LIST] = { "0" };
+
+struct result {
+	int status;
+	uint64_t wall_us, user_us, sys_us;
+	unsigned long long syscalls;
+	char report[TAIL_SIZE];
+};
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void split_list(char *str, const char **list)
+{
+	int i = 0;
+
+	for (str = strtok(str, ","); str && i < MAX_LIST - 1; str = strtok(NULL, ","))
+		list[i++] = str;
+	list[i] = NULL;
+}
+
+/* value of "key" in the flat JSON object "json", 0 if missing */
+static unsigned long long json_get(const char *json, const char *key)
+{
+	char pattern[64];
+	const char *p;
+
+	snprintf(pattern, sizeof(pattern), "\"%s\": ", key);
+	p = strstr(json, pattern);
+	return p ? strtoull(p + strlen(pattern), NULL, 0) : 0;
+}
+
+/* image with "sparse" percent of 256 bytes blocks left erased */
+static int make_image(const char *name, unsigned int size, unsigned int sparse)
+{
+	uint32_t seed = 1;
+	uint8_t block[256];
+	unsigned int i, len;
+	FILE *f;
+
+	f = fopen(name, "wb");
+	if (!f) {
+		perror(name);
+		return -1;
+	}
+	while (size) {
+		len = size < sizeof(block) ? size : sizeof(block);
+		seed = seed * 1103515245 + 12345;
+		if ((seed >> 16) % 100 < sparse) {
+			memset(block, 0xff, len);
+		} else {
+			for (i = 0; i < len; i++) {
+				seed = seed * 1103515245 + 12345;
+				block[i] = seed >> 16;
+			}
+		}
+		fwrite(block, 1, len, f);
+		size -= len;
+	}
+	if (fclose(f)) {
+		perror(name);
+		return -1;
+	}
+	return 0;
+}
+
+/* keep the last part, at least TAIL_SIZE / 2 bytes, read from "fd" */
+static void read_tail(int fd, char *tail)
+{
+	size_t len = 0;
+	ssize_t r;
+
+	while ((r = read(fd, tail + len, TAIL_SIZE - 1 - len)) != 0) {
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		len += r;
+		if (len == TAIL_SIZE - 1) {
+			memmove(tail, tail + len - TAIL_SIZE / 2, TAIL_SIZE / 2);
+			len = TAIL_SIZE / 2;
+		}
+	}
+	tail[len] = '\0';
+}
+
+/* last report of the simulator in "text" */
+static void last_report(const char *text, char *json, size_t size)
+{
+	const char *p, *start = NULL;
+
+	for (p = text; (p = strstr(p, "{\"sim_time_us\"")); p++)
+		start = p;
+	json[0] = '\0';
+	if (start) {
+		snprintf(json, size, "%s", start);
+		json[strcspn(json, "}") + 1] = '\0';
+	}
+}
+
+/* last flat JSON object "key" in "text", as "null" if missing */
+static void last_object(const char *text, const char *key, char *json,
+			size_t size)
+{
+	char pattern[64];
+	const char *p, *start = NULL;
+
+	snprintf(pattern, sizeof(pattern), "\"%s\": {", key);
+	for (p = text; (p = strstr(p, pattern)); p++)
+		start = p + strlen(pattern) - 1;
+	snprintf(json, size, "%s", start ? start : "null");
+	if (start)
+		json[strcspn(json, "}") + 1] = '\0';
+}
+
+/* start "argv" with stdout and stderr on a pipe */
+static pid_t spawn(char **argv, int *fd)
+{
+	int p[2];
+	pid_t pid;
+
+	if (pipe(p))
+		return -1;
+	pid = fork();
+	if (pid == 0) {
+		dup2(p[1], STDOUT_FILENO);
+		dup2(p[1], STDERR_FILENO);
+		close(p[0]);
+		close(p[1]);
+		execv(argv[0], argv);
+		perror(argv[0]);
+		_exit(127);
+	}
+	close(p[1]);
+	*fd = p[0];
+	return pid;
+}
+
+/* read and write syscalls of a terminated, not yet reaped, process */
+static unsigned long long proc_syscalls(pid_t pid)
+{
+	unsigned long long n, total = 0;
+	char name[64], line[128];
+	FILE *f;
+
+	snprintf(name, sizeof(name), "/proc/%d/io", (int)pid);
+	f = fopen(name, "r");
+	if (!f)
+		return 0;
+	while (fgets(line, sizeof(line), f))
+		if (sscanf(line, "syscr: %llu", &n) == 1
+		    || sscanf(line, "syscw: %llu", &n) == 1)
+			total += n;
+	fclose(f);
+	return total;
+}
+
+static int run(char **argv, struct result *res, char *tail)
+{
+	struct rusage ru;
+	siginfo_t si;
+	uint64_t t0;
+	int fd, status;
+	pid_t pid;
+
+	t0 = now_us();
+	pid = spawn(argv, &fd);
+	if (pid < 0)
+		return -1;
+	read_tail(fd, tail);
+	close(fd);
+
+	if (waitid(P_PID, pid, &si, WEXITED | WNOWAIT) == 0)
+		res->syscalls = proc_syscalls(pid);
+	wait4(pid, &status, 0, &ru);
+	res->wall_us = now_us() - t0;
+	res->user_us = ru.ru_utime.tv_sec * 1000000ULL + ru.ru_utime.tv_usec;
+	res->sys_us = ru.ru_stime.tv_sec * 1000000ULL + ru.ru_stime.tv_usec;
+	res->status = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+	return 0;
+}
+
+/* start stm32sim and return the name of its pty in "pty" */
+static pid_t start_sim(const char *cfg, int *fd, char *pty, size_t size)
+{
+	char *argv[] = { (char *)sim_bin, (char *)cfg, NULL };
+	size_t len = 0;
+	pid_t pid;
+
+	pid = spawn(argv, fd);
+	if (pid < 0)
+		return -1;
+	while (len < size - 1 && read(*fd, pty + len, 1) == 1 && pty[len] != '\n')
+		len++;
+	pty[len] = '\0';
+	if (strncmp(pty, "/dev/", 5)) {
+		kill(pid, SIGTERM);
+		waitpid(pid, NULL, 0);
+		close(*fd);
+		return -1;
+	}
+	return pid;
+}
+
+static int bench_one(const char *op, unsigned int size, unsigned int sparse,
+		     const char *baud, const char *frame, int first)
+{
+	char image[64], readout[64], cfg[512], device[520], range[64];
+	char tail[TAIL_SIZE], pty[64], phases[256];
+	char *argv[MAX_ARGS];
+	struct result res;
+	unsigned long long sim_us, wire_us, bytes;
+	double kib = size / 1024.0, bps;
+	int argc = 0, sim_fd = -1;
+	pid_t sim_pid = 0;
+
+	snprintf(image, sizeof(image), "%s/image.bin", tmpdir);
+	snprintf(readout, sizeof(readout), "%s/readout.bin", tmpdir);
+	if (make_image(image, size, sparse))
+		return -1;
+
+	/* flash content before the run, so read and crc have data */
+	snprintf(cfg, sizeof(cfg), "%s,baud=%s,report%s%s", dev_cfg, baud,
+		 strcmp(op, "write") && strcmp(op, "verify") ? ",load=" : "",
+		 strcmp(op, "write") && strcmp(op, "verify") ? image : "");
+	snprintf(range, sizeof(range), "0x%08x:%u", dev->fl_start, size);
+
+	memset(&res, 0, sizeof(res));
+	if (use_pty) {
+		sim_pid = start_sim(cfg, &sim_fd, pty, sizeof(pty));
+		if (sim_pid < 0) {
+			fprintf(stderr, "Cannot start %s\n", sim_bin);
+			return -1;
+		}
+		snprintf(device, sizeof(device), "%s", pty);
+	} else {
+		snprintf(device, sizeof(device), "sim:%s", cfg);
+	}
+
+	argv[argc++] = (char *)flash_bin;
+	argv[argc++] = "-b";
+	argv[argc++] = (char *)baud;
+	/* wall time of the phases of the operation */
+	argv[argc++] = "-X";
+	argv[argc++] = "json";
+	if (use_pty) {
+		argv[argc++] = "-m";
+		argv[argc++] = "8n1";
+	}
+	if (strcmp(frame, "0")) {
+		argv[argc++] = "-F";
+		argv[argc++] = (char *)frame;
+	}
+	if (!strcmp(op, "write") || !strcmp(op, "verify")) {
+		argv[argc++] = "-w";
+		argv[argc++] = image;
+		if (!strcmp(op, "verify"))
+			argv[argc++] = "-v";
+	} else if (!strcmp(op, "read")) {
+		argv[argc++] = "-r";
+		argv[argc++] = readout;
+		argv[argc++] = "-S";
+		argv[argc++] = range;
+	} else if (!strcmp(op, "erase")) {
+		argv[argc++] = "-o";
+		argv[argc++] = "-S";
+		argv[argc++] = range;
+	} else if (!strcmp(op, "crc")) {
+		argv[argc++] = "-C";
+		argv[argc++] = "-S";
+		argv[argc++] = range;
+	} else {
+		fprintf(stderr, "Unknown operation \"%s\"\n", op);
+		return -1;
+	}
+	argv[argc++] = device;
+	argv[argc] = NULL;
+
+	if (run(argv, &res, tail))
+		return -1;
+	last_object(tail, "phases_us", phases, sizeof(phases));
+	if (use_pty) {
+		kill(sim_pid, SIGTERM);
+		read_tail(sim_fd, tail);
+		close(sim_fd);
+		waitpid(sim_pid, NULL, 0);
+	}
+	last_report(tail, res.report, sizeof(res.report));
+
+	sim_us = json_get(res.report, "sim_time_us");
+	wire_us = json_get(res.report, "wire_time_us");
+	bytes = json_get(res.report, "host_to_dev_bytes")
+		+ json_get(res.report, "dev_to_host_bytes");
+
+	printf("%s\n    {\"op\": \"%s\", \"size\": %u, \"sparsity\": %u, "
+	       "\"baud\": %s, \"frame\": \"%s\", \"status\": %d,\n",
+	       first ? "" : ",", op, size, sparse, baud, frame, res.status);
+	printf("     \"wall_us\": %llu, \"user_us\": %llu, \"sys_us\": %llu, "
+	       "\"syscalls\": %llu, \"syscalls_per_kib\": %.2f,\n",
+	       (unsigned long long)res.wall_us,
+	       (unsigned long long)res.user_us,
+	       (unsigned long long)res.sys_us,
+	       res.syscalls, res.syscalls / kib);
+	bps = sim_us ? size * 1e6 / sim_us : 0.0;
+	printf("     \"phases_us\": %s,\n", phases);
+	printf("     \"throughput_Bps\": %.0f, \"wire_bytes\": %llu, "
+	       "\"wire_utilisation\": %.3f",
+	       bps, bytes, sim_us ? (double)wire_us / sim_us : 0.0);
+	/* erase and crc do not move the image on the line */
+	if (strcmp(op, "erase") && strcmp(op, "crc"))
+		printf(", \"baud_efficiency\": %.3f",
+		       bps / (strtoul(baud, NULL, 0) / 11.0));
+	printf(",\n     \"sim\": %s}", res.report[0] ? res.report : "null");
+	fflush(stdout);
+	return res.status;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [-t] [-x stm32flash] [-y stm32sim] [-d config]\n"
+		"	[-o ops] [-s sizes] [-p sparsity] [-b bauds] [-F frames]\n"
+		"	-t		Use stm32sim on a pty instead of device \"sim:\"\n"
+		"	-x path		stm32flash binary (default %s)\n"
+		"	-y path		stm32sim binary (default %s)\n"
+		"	-d config	Simulator configuration (default %s)\n"
+		"	-o ops		Comma separated: write,verify,read,erase,crc\n"
+		"	-s sizes	Image sizes in KiB\n"
+		"	-p sparsity	Percent of 256 bytes blocks left erased\n"
+		"	-b bauds	Baud rates\n"
+		"	-F frames	Values of stm32flash option -F, 0 for default\n",
+		name, flash_bin, sim_bin, dev_cfg);
+}
+
+int main(int argc, char *argv[])
+{
+	const char **op, **size, **sp, **baud, **frame;
+	unsigned long pid;
+	int c, first = 1, failed = 0;
+	char image[64];
+
+	while ((c = getopt(argc, argv, "tx:y:d:o:s:p:b:F:h")) != -1) {
+		switch (c) {
+		case 't':
+			use_pty = 1;
+			break;
+		case 'x':
+			flash_bin = optarg;
+			break;
+		case 'y':
+			sim_bin = optarg;
+			break;
+		case 'd':
+			dev_cfg = optarg;
+			break;
+		case 'o':
+			split_list(optarg, ops);
+			break;
+		case 's':
+			split_list(optarg, sizes);
+			break;
+		case 'p':
+			split_list(optarg, sparsity);
+			break;
+		case 'b':
+			split_list(optarg, bauds);
+			break;
+		case 'F':
+			split_list(optarg, frames);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	pid = strtoul(dev_cfg, NULL, 0);
+	for (dev = devices; dev->id; dev++)
+		if (dev->id == pid)
+			break;
+	if (!dev->id) {
+		fprintf(stderr, "Unknown device in \"%s\"\n", dev_cfg);
+		return 1;
+	}
+	if (!mkdtemp(tmpdir)) {
+		perror(tmpdir);
+		return 1;
+	}
+
+	printf("{\"bench\": \"flash\", \"mode\": \"%s\", \"device\": \"%s\", "
+	       "\"runs\": [", use_pty ? "pty" : "sim", dev_cfg);
+	for (op = ops; *op; op++)
+		for (size = sizes; *size; size++)
+			for (sp = sparsity; *sp; sp++)
+				for (baud = bauds; *baud; baud++)
+					for (frame = frames; *frame; frame++) {
+						if (bench_one(*op, strtoul(*size, NULL, 0) * 1024,
+							      strtoul(*sp, NULL, 0),
+							      *baud, *frame, first))
+							failed++;
+						first = 0;
+					}
+	printf("\n], \"failed\": %d}\n", failed);
+
+	snprintf(image, sizeof(image), "%s/image.bin", tmpdir);
+	unlink(image);
+	snprintf(image, sizeof(image), "%s/readout.bin", tmpdir);
+	unlink(image);
+	rmdir(tmpdir);
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,303 @@
+/*
+  stm32flash - Open Source ST STM32 flash program for *nix
+  Copyright (C) 2026 The stm32flash contributors
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+ * Throughput of the Intel HEX parser, compared with the original one
+ * reading the file with a syscall per field and decoding with sscanf().
+ * Usage: hex_bench [image size in KiB]
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../parsers/hex.h"
+
+#define DEF_SIZE_KB	1024
+
+/* the original parser, used as reference */
+struct hex_ref {
+	size_t		data_len;
+	uint8_t		*data;
+	uint32_t	base;
+};
+
+static parser_err_t hex_open_ref(struct hex_ref *ref, const char *filename)
+{
+	char mark;
+	int fd;
+	uint8_t checksum;
+	unsigned int c, i;
+	uint32_t base = 0;
+	unsigned int last_address = 0x0;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return PARSER_ERR_SYSTEM;
+
+	/* read in the file */
+
+	while(read(fd, &mark, 1) != 0) {
+		if (mark == '\n' || mark == '\r') continue;
+		if (mark != ':')
+			return PARSER_ERR_INVALID_FILE;
+
+		char buffer[9];
+		unsigned int reclen, address, type;
+		uint8_t *record = NULL;
+
+		/* get the reclen, address, and type */
+		buffer[8] = 0;
+		if (read(fd, &buffer, 8) != 8) return PARSER_ERR_INVALID_FILE;
+		if (sscanf(buffer, "%2x%4x%2x", &reclen, &address, &type) != 3) {
+			close(fd);
+			return PARSER_ERR_INVALID_FILE;
+		}
+
+		/* setup the checksum */
+		checksum =
+			reclen +
+			((address & 0xFF00) >> 8) +
+			((address & 0x00FF) >> 0) +
+			type;
+
+		switch(type) {
+			/* data record */
+			case 0:
+				c = address - last_address;
+				ref->data = realloc(ref->data, ref->data_len + c + reclen);
+
+				/* if there is a gap, set it to 0xff and increment the length */
+				if (c > 0) {
+					memset(&ref->data[ref->data_len], 0xff, c);
+					ref->data_len += c;
+				}
+
+				last_address = address + reclen;
+				record = &ref->data[ref->data_len];
+				ref->data_len += reclen;
+				break;
+
+			/* extended segment address record */
+			case 2:
+				base = 0;
+				break;
+
+			/* extended linear address record */
+			case 4:
+				base = 0;
+				break;
+		}
+
+		buffer[2] = 0;
+		for(i = 0; i < reclen; ++i) {
+			if (read(fd, &buffer, 2) != 2 || sscanf(buffer, "%2x", &c) != 1) {
+				close(fd);
+				return PARSER_ERR_INVALID_FILE;
+			}
+
+			/* add the byte to the checksum */
+			checksum += c;
+
+			switch(type) {
+				case 0:
+					if (record != NULL) {
+						record[i] = c;
+					} else {
+						return PARSER_ERR_INVALID_FILE;
+					}
+					break;
+
+				case 2:
+				case 4:
+					base = (base << 8) | c;
+					break;
+			}
+		}
+
+		/* read, scan, and verify the checksum */
+		if (
+			read(fd, &buffer, 2 ) != 2 ||
+			sscanf(buffer, "%2x", &c) != 1 ||
+			(uint8_t)(checksum + c) != 0x00
+		) {
+			close(fd);
+			return PARSER_ERR_INVALID_FILE;
+		}
+
+		switch(type) {
+			/* EOF */
+			case 1:
+				close(fd);
+				return PARSER_ERR_OK;
+
+			/* address record */
+			case 4:	base = base << 12;
+				/* fall-through */
+			case 2: base = base << 4;
+				/* Reset last_address since our base changed */
+				last_address = 0;
+
+				/* Only assign the program's base address once, and only
+				 * do so if we haven't seen any data records yet.
+				 * If there are any data records before address records,
+				 * the program's base address must be zero.
+				 */
+				if (ref->base == 0 && ref->data_len == 0) {
+					ref->base = base;
+					break;
+				}
+
+				/* we cant cope with files out of order */
+				if (base < ref->base) {
+					close(fd);
+					return PARSER_ERR_INVALID_FILE;
+				}
+
+				/* if there is a gap, enlarge and fill with 0xff */
+				unsigned int len = base - ref->base;
+				if (len > ref->data_len) {
+					ref->data = realloc(ref->data, len);
+					memset(&ref->data[ref->data_len], 0xff, len - ref->data_len);
+					ref->data_len = len;
+				}
+				break;
+		}
+	}
+
+	close(fd);
+	return PARSER_ERR_OK;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* image of "size" bytes at 0x08000000, in records of 32 bytes */
+static int make_hex(const char *name, unsigned int size)
+{
+	uint32_t seed = 1, addr;
+	uint8_t rec[32], sum;
+	unsigned int i, len;
+	FILE *f;
+
+	f = fopen(name, "w");
+	if (!f) {
+		perror(name);
+		return -1;
+	}
+	for (addr = 0; addr < size; addr += len) {
+		if ((addr & 0xffff) == 0)
+			fprintf(f, ":02000004%04X%02X\n", 0x0800 + (addr >> 16),
+				(uint8_t)-(2 + 4 + 0x08 + (addr >> 16)));
+		len = size - addr < sizeof(rec) ? size - addr : sizeof(rec);
+		sum = len + (addr >> 8) + addr;
+		fprintf(f, ":%02X%04X00", len, addr & 0xffff);
+		for (i = 0; i < len; i++) {
+			seed = seed * 1103515245 + 12345;
+			rec[i] = seed >> 16;
+			sum += rec[i];
+			fprintf(f, "%02X", rec[i]);
+		}
+		fprintf(f, "%02X\n", (uint8_t)-sum);
+	}
+	fprintf(f, ":00000001FF\n");
+	if (fclose(f)) {
+		perror(name);
+		return -1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	char name[] = "/tmp/hex_bench.XXXXXX";
+	struct hex_ref ref = { 0 };
+	struct stat sb;
+	unsigned int size_kb, size, len, i, loops;
+	uint8_t *data;
+	void *st;
+	double t, mbs_ref, mbs_new, text;
+	int fd, ret = 1;
+
+	size_kb = argc > 1 ? strtoul(argv[1], NULL, 0) : DEF_SIZE_KB;
+	size = size_kb * 1024;
+	fd = mkstemp(name);
+	if (fd < 0) {
+		perror(name);
+		return 1;
+	}
+	close(fd);
+	if (make_hex(name, size) || stat(name, &sb))
+		goto out;
+
+	t = now();
+	if (hex_open_ref(&ref, name) != PARSER_ERR_OK) {
+		fprintf(stderr, "Reference parser failed\n");
+		goto out;
+	}
+	t = now() - t;
+	text = (double)sb.st_size / 1e6;
+	mbs_ref = text / t;
+
+	loops = 10;
+	t = now();
+	for (i = 0; i < loops; i++) {
+		st = PARSER_HEX.init();
+		if (PARSER_HEX.open(st, name, 0) != PARSER_ERR_OK) {
+			fprintf(stderr, "Parser failed\n");
+			goto out;
+		}
+		if (i < loops - 1)
+			PARSER_HEX.close(st);
+	}
+	t = now() - t;
+	mbs_new = text * loops / t;
+
+	len = PARSER_HEX.size(st);
+	data = malloc(len + 1);
+	if (!data || PARSER_HEX.read(st, data, &len) != PARSER_ERR_OK
+	    || len != ref.data_len || memcmp(data, ref.data, len)) {
+		fprintf(stderr, "Parsed data mismatch\n");
+		free(data);
+		PARSER_HEX.close(st);
+		goto out;
+	}
+	free(data);
+	PARSER_HEX.close(st);
+
+	printf("hex %u KiB image, %.1f MB of text\n", size_kb, text);
+	printf("hex syscall+sscanf : %8.1f MB/s\n", mbs_ref);
+	printf("hex mmap+table     : %8.1f MB/s (x%.1f)\n", mbs_new, mbs_new / mbs_ref);
+	ret = 0;
+out:
+	free(ref.data);
+	unlink(name);
+	return ret;
+}
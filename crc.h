@@ -0,0 +1,40 @@
+/*
+  stm32flash - Open Source ST STM32 flash program for *nix
+  Copyright (C) 2026 The stm32flash contributors
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+
+#ifndef _H_CRC
+#define _H_CRC
+
+#include <stdint.h>
+
+/*
+ * CRC as computed by the STM32 CRC peripheral and by the bootloader
+ * command CRC: CRC-32/MPEG-2 applied on 32 bit little-endian words.
+ * "len" must be a multiple of 4; trailing bytes are ignored.
+ */
+uint32_t crc_stm32(uint32_t crc, const uint8_t *buf, unsigned int len);
+
+/*
+ * Given crc1 of block A and crc2 of block B, both computed starting from
+ * STM32_CRC_INIT, return the CRC of A followed by B.
+ * "len2" is the length of B in bytes.
+ */
+uint32_t crc_stm32_combine(uint32_t crc1, uint32_t crc2, unsigned int len2);
+
+#endif
@@ -63,6 +63,7 @@ struct port_interface port_i2c = {
 struct i2c_priv {
 	int fd;
 	int addr;
+	char cfg_str[11];
 };
 
 static port_err_t i2c_open(struct port_interface *port,
@@ -180,13 +181,12 @@ static port_err_t i2c_gpio(struct port_interface __unused *port,
 static const char *i2c_get_cfg_str(struct port_interface *port)
 {
 	struct i2c_priv *h;
-	static char str[11];
 
 	h = (struct i2c_priv *)port->private;
 	if (h == NULL)
 		return "INVALID";
-	snprintf(str, sizeof(str), "addr 0x%2x", h->addr);
-	return str;
+	snprintf(h->cfg_str, sizeof(h->cfg_str), "addr 0x%2x", h->addr);
+	return h->cfg_str;
 }
 
 static struct varlen_cmd i2c_cmd_get_reply[] = {
@@ -22,6 +22,7 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -36,7 +37,20 @@
 #include "port.h"
 #include "utils.h"
 
-extern FILE *diag;
+/* trace of the GPIO sequences, none if "trace" is NULL */
+#if defined(__GNUC__)
+__attribute__ ((format (printf, 2, 3)))
+#endif
+static void gpio_diag(FILE *trace, const char *fmt, ...)
+{
+	va_list ap;
+
+	if (!trace)
+		return;
+	va_start(ap, fmt);
+	vfprintf(trace, fmt, ap);
+	va_end(ap);
+}
 
 struct gpio_list {
 	struct gpio_list *next;
@@ -166,7 +180,8 @@ static int drive_gpio(int __unused n, int __unused level,
 }
 #endif
 
-static int gpio_sequence(struct port_interface *port, const char *seq, size_t len_seq)
+static int gpio_sequence(struct port_interface *port, const char *seq, size_t len_seq,
+			 FILE *trace)
 {
 	struct gpio_list *gpio_to_release = NULL;
 #if defined(__linux__)
@@ -179,7 +194,7 @@ static int gpio_sequence(struct port_interface *port, const char *seq, size_t le
 	const char *s = seq;
 	size_t l = len_seq;
 
-	fprintf(diag, "\nGPIO sequence start\n");
+	gpio_diag(trace, "\nGPIO sequence start\n");
 	while (ret == 0 && *s && l > 0) {
 		sig_str = NULL;
 		sleep_time = 0;
@@ -246,18 +261,20 @@ static int gpio_sequence(struct port_interface *port, const char *seq, size_t le
 		if (!delimiter) { /* actual gpio/port signal driving */
 			if (gpio < 0) {
 				gpio = -gpio;
-				fprintf(diag, " setting port signal %.3s to %i... ", sig_str, level);
+				gpio_diag(trace, " setting port signal %.3s to %i... ", sig_str, level);
 				ret = (port->gpio(port, gpio, level) != PORT_ERR_OK);
-				printStatus(diag, ret);
+				if (trace)
+					printStatus(trace, ret);
 			} else {
-				fprintf(diag, " setting gpio %i to %i... ", gpio, level);
+				gpio_diag(trace, " setting gpio %i to %i... ", gpio, level);
 				ret = (drive_gpio(gpio, level, &gpio_to_release) != 1);
-				printStatus(diag, ret);
+				if (trace)
+					printStatus(trace, ret);
 			}
 		}
 
 		if (sleep_time) {
-			fprintf(diag, " delay %i us\n", sleep_time);
+			gpio_diag(trace, " delay %i us\n", sleep_time);
 			usleep(sleep_time);
 		}
 	}
@@ -269,11 +286,12 @@ static int gpio_sequence(struct port_interface *port, const char *seq, size_t le
 		free(to_free);
 	}
 #endif
-	fprintf(diag, "GPIO sequence end\n\n");
+	gpio_diag(trace, "GPIO sequence end\n\n");
 	return ret;
 }
 
-static int gpio_bl_entry(struct port_interface *port, const char *seq)
+static int gpio_bl_entry(struct port_interface *port, const char *seq,
+			 FILE *trace)
 {
 	char *s;
 
@@ -282,12 +300,12 @@ static int gpio_bl_entry(struct port_interface *port, const char *seq)
 
 	s = strchr(seq, ':');
 	if (s == NULL)
-		return gpio_sequence(port, seq, strlen(seq));
+		return gpio_sequence(port, seq, strlen(seq), trace);
 
-	return gpio_sequence(port, seq, s - seq);
+	return gpio_sequence(port, seq, s - seq, trace);
 }
 
-int gpio_bl_exit(struct port_interface *port, const char *seq)
+int gpio_bl_exit(struct port_interface *port, const char *seq, FILE *trace)
 {
 	char *s;
 
@@ -298,21 +316,22 @@ int gpio_bl_exit(struct port_interface *port, const char *seq)
 	if (s == NULL || s[1] == '\0')
 		return 1;
 
-	return gpio_sequence(port, s + 1, strlen(s + 1));
+	return gpio_sequence(port, s + 1, strlen(s + 1), trace);
 }
 
-int init_bl_entry(struct port_interface *port, const char *seq)
+int init_bl_entry(struct port_interface *port, const char *seq, FILE *trace)
 {
 	if (seq)
-		return gpio_bl_entry(port, seq);
+		return gpio_bl_entry(port, seq, trace);
 
 	return 0;
 }
 
-int init_bl_exit(stm32_t *stm, struct port_interface *port, const char *seq)
+int init_bl_exit(stm32_t *stm, struct port_interface *port, const char *seq,
+		 FILE *trace)
 {
 	if (seq && strchr(seq, ':'))
-		return gpio_bl_exit(port, seq);
+		return gpio_bl_exit(port, seq, trace);
 
 	return stm32_reset_device(stm);
 }
@@ -22,11 +22,15 @@
 #ifndef _INIT_H
 #define _INIT_H
 
+#include <stdio.h>
+
 #include "stm32.h"
 #include "port.h"
 
-int init_bl_entry(struct port_interface *port, const char *seq);
-int init_bl_exit(stm32_t *stm, struct port_interface *port, const char *seq);
-int gpio_bl_exit(struct port_interface *port, const char *seq);
+/* the GPIO sequences are traced on "trace", if not NULL */
+int init_bl_entry(struct port_interface *port, const char *seq, FILE *trace);
+int init_bl_exit(stm32_t *stm, struct port_interface *port, const char *seq,
+		 FILE *trace);
+int gpio_bl_exit(struct port_interface *port, const char *seq, FILE *trace);
 
 #endif
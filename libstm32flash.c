@@ -0,0 +1,1672 @@
+/*
+  stm32flash - Open Source ST STM32 flash program for *nix
+  Copyright 2010 Geoffrey McRae <geoff@spacevs.com>
+  Copyright 2011 Steve Markgraf <steve@steve-m.de>
+  Copyright 2012-2016 Tormod Volden <debian.tormod@gmail.com>
+  Copyright 2013-2016 Antonio Borneo <borneo.antonio@gmail.com>
+  Copyright (C) 2026 The stm32flash contributors
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifndef __WIN32__
+#include <poll.h>
+#include <pthread.h>
+#endif
+
+#include "init.h"
+#include "libstm32flash.h"
+#include "serial.h"
+#include "stm32.h"
+#include "port.h"
+#include "profile.h"
+#include "spsc.h"
+#include "trace.h"
+#include "parsers/parser.h"
+#include "parsers/binary.h"
+#include "parsers/elf.h"
+#include "parsers/hex.h"
+#include "parsers/srec.h"
+
+/*
+ * An image is a list of segments sorted by address, from the parser or
+ * of its own data; the gaps between them read as 0xFF. The image is
+ * written from its first byte of data, "base", at the start of the range.
+ * The parser is left open for the life of the image.
+ */
+struct stm32flash_image {
+	const struct parser_segment	*seg;
+	unsigned int		nseg;
+	uint32_t		base;
+	unsigned int		size;		/* up to the end of the last data */
+	int			addressed;	/* base is from the file */
+	struct parser_segment	own;		/* of "data" */
+	uint8_t			*data;		/* owned, or flattened on request */
+	parser_t		*parser;
+	void			*p_st;
+	const char		*format;
+	struct image_stream	*stream;	/* HEX from a pipe, see below */
+};
+
+#ifndef __WIN32__
+/*
+ * An Intel HEX stream on stdin is decoded by a reader thread and written
+ * while it is received. The data reaches the writer through a ring, in
+ * blocks of one aligned window of STREAM_BLOCK bytes, gaps as 0xFF; the
+ * records must come in increasing address order.
+ */
+#define STREAM_BLOCK	256
+#define STREAM_SLOTS	1024
+#define STREAM_READ	(64 * 1024)
+#define STREAM_SNIFF	1024	/* to find the first record */
+#define STREAM_POLL	100	/* ms, to see that the writer stopped */
+
+struct stream_block {
+	uint32_t	addr;		/* aligned to STREAM_BLOCK */
+	unsigned int	lo, hi;		/* data in data[lo, hi) */
+	uint8_t		data[STREAM_BLOCK];
+};
+
+struct image_stream {
+	int			fd;
+	uint8_t			*prefix;	/* read to detect the format */
+	size_t			prefix_len;
+	hex_stream_t		*hex;
+	struct spsc		*q;
+	struct stream_block	*cur;		/* being filled */
+	uint32_t		next;		/* after the last data */
+	pthread_t		thread;
+	int			running;
+	int			stop;		/* tells the reader to end */
+	int			written;
+	/* reader failure, set before the ring is closed */
+	int			failed;
+	char			msg[128];
+};
+#endif
+
+struct stm32flash_session {
+	struct stm32flash_options	opts;
+	struct stm32flash_callbacks	cb;
+	struct port_interface		*port;		/* trace wrapper, if any */
+	struct port_interface		*port_mem;	/* from port_open() */
+	stm32_t				*stm;
+	unsigned int			skipped_bytes;
+
+	/*
+	 * Verify by CRC: consecutive written blocks are collected up to the
+	 * end of the flash page, then the whole page is checked with a
+	 * single bootloader CRC command. Only a page whose CRC mismatches is
+	 * read back.
+	 */
+	struct {
+		uint8_t		*data;
+		uint32_t	addr, end;
+		unsigned int	len, size;
+		unsigned int	max_wlen, max_rlen;
+	} crc_verify;
+};
+
+#if defined(__GNUC__)
+__attribute__ ((format (printf, 3, 4)))
+#endif
+static void cb_log(const struct stm32flash_callbacks *cb,
+		   stm32flash_log_t level, const char *fmt, ...)
+{
+	char msg[256];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(msg, sizeof(msg), fmt, ap);
+	va_end(ap);
+
+	if (cb && cb->log)
+		cb->log(cb->arg, level, msg);
+	else if (level != STM32FLASH_LOG_INFO)
+		fprintf(stderr, "%s\n", msg);
+}
+
+#define log_err(s, ...)		cb_log(&(s)->cb, STM32FLASH_LOG_ERROR, __VA_ARGS__)
+#define log_info(s, ...)	cb_log(&(s)->cb, STM32FLASH_LOG_INFO, __VA_ARGS__)
+
+static void progress(stm32flash_session_t *s, stm32flash_op_t op,
+		     uint32_t addr, unsigned int done, unsigned int total,
+		     int verify, unsigned int rewritten)
+{
+	struct stm32flash_progress p = {
+		.op		= op,
+		.addr		= addr,
+		.done		= done,
+		.total		= total,
+		.verify		= verify,
+		.rewritten	= rewritten,
+	};
+
+	if (s->cb.progress)
+		s->cb.progress(s->cb.arg, &p);
+}
+
+static int is_addr_in_ram(const stm32_t *stm, uint32_t addr)
+{
+	return addr >= stm->dev->ram_start && addr < stm->dev->ram_end;
+}
+
+static int is_addr_in_flash(const stm32_t *stm, uint32_t addr)
+{
+	return addr >= stm->dev->fl_start && addr < stm->dev->fl_end;
+}
+
+static int is_addr_in_opt_bytes(const stm32_t *stm, uint32_t addr)
+{
+	/* option bytes upper range is inclusive in our device table */
+	return addr >= stm->dev->opt_start && addr <= stm->dev->opt_end;
+}
+
+static int is_addr_in_sysmem(const stm32_t *stm, uint32_t addr)
+{
+	return addr >= stm->dev->mem_start && addr < stm->dev->mem_end;
+}
+
+/* returns 1 if the whole buffer holds the value of erased flash */
+static int is_erased(const uint8_t *data, unsigned int len)
+{
+	while (len--)
+		if (*data++ != 0xff)
+			return 0;
+	return 1;
+}
+
+/* index of the first segment ending after "offset" */
+static unsigned int image_find(const stm32flash_image_t *img, uint32_t offset)
+{
+	uint32_t addr = img->base + offset;
+	unsigned int lo = 0, hi = img->nseg, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (img->seg[mid].addr + img->seg[mid].len <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* offset of the first byte of data at or after "offset", or the size */
+static uint32_t image_next_data(const stm32flash_image_t *img, uint32_t offset)
+{
+	unsigned int i = image_find(img, offset);
+
+	if (i == img->nseg)
+		return img->size;
+	if (img->base + offset > img->seg[i].addr)
+		return offset;
+	return img->seg[i].addr - img->base;
+}
+
+/*
+ * Content of the image from "offset": a pointer in the segment when it
+ * holds all the "len" bytes, otherwise a copy in "buf" with the gaps set
+ * to 0xFF.
+ */
+static const uint8_t *image_block(const stm32flash_image_t *img,
+				  uint32_t offset, unsigned int len,
+				  uint8_t *buf)
+{
+	const struct parser_segment *seg;
+	uint32_t addr = img->base + offset;
+	unsigned int i, done, n;
+
+	i = image_find(img, offset);
+	seg = &img->seg[i];
+	if (i < img->nseg && addr >= seg->addr
+	    && addr + len <= seg->addr + seg->len)
+		return seg->data + addr - seg->addr;
+
+	for (done = 0; done < len; done += n, addr += n) {
+		n = len - done;
+		if (i == img->nseg || addr < seg->addr) {
+			if (i < img->nseg && n > seg->addr - addr)
+				n = seg->addr - addr;
+			memset(buf + done, 0xff, n);
+			continue;
+		}
+		if (n > seg->addr + seg->len - addr)
+			n = seg->addr + seg->len - addr;
+		memcpy(buf + done, seg->data + addr - seg->addr, n);
+		seg = &img->seg[++i];
+	}
+	return buf;
+}
+
+void stm32flash_options_init(struct stm32flash_options *opts)
+{
+	memset(opts, 0, sizeof(*opts));
+	opts->port.baudRate	= SERIAL_BAUD_57600;
+	opts->port.serial_mode	= "8e1";
+	opts->port.rx_frame_max	= STM32_MAX_RX_FRAME;
+	opts->port.tx_frame_max	= STM32_MAX_TX_FRAME;
+	opts->init		= 1;
+	opts->retry		= 10;
+}
+
+/*
+ * Discover the target, with the profile cached for this port by a
+ * previous session, and update the cache when the profile changes.
+ */
+static stm32_t *session_init_profile(stm32flash_session_t *s, int init)
+{
+	struct stm32_profile prof, cached;
+	char key[256];
+	stm32_t *stm;
+
+	if (s->opts.port.bus_addr)
+		snprintf(key, sizeof(key), "%s@0x%02x", s->opts.port.device,
+			 s->opts.port.bus_addr);
+	else
+		snprintf(key, sizeof(key), "%s", s->opts.port.device);
+
+	profile_load(s->opts.profile_file, key, &prof);
+	memcpy(&cached, &prof, sizeof(prof));
+
+	stm = stm32_init_profile(s->port, init, &prof);
+	if (!stm)
+		return NULL;
+
+	if (!memcmp(&cached, &prof, sizeof(prof))) {
+		if (prof.valid)
+			log_info(s, "Using bootloader profile from %s",
+				 s->opts.profile_file);
+	} else if (prof.valid
+		   && profile_save(s->opts.profile_file, key, &prof))
+		log_err(s, "Failed to save bootloader profile in %s",
+			s->opts.profile_file);
+	return stm;
+}
+
+/* enter the bootloader and discover the target */
+static int session_connect(stm32flash_session_t *s, int init)
+{
+	int i;
+
+	if (init && init_bl_entry(s->port, s->opts.gpio_seq, s->opts.gpio_trace)) {
+		log_err(s, "Failed to send boot enter sequence");
+		return 1;
+	}
+
+	s->port->flush(s->port);
+
+	if (s->opts.profile_file)
+		s->stm = session_init_profile(s, init);
+	else
+		s->stm = stm32_init(s->port, init);
+	if (!s->stm)
+		return 1;
+
+	for (i = 0; i < STM32_TMO_NUM; i++)
+		stm32_set_timeout(s->stm, i, s->opts.ack_timeout[i]);
+	if (s->opts.adaptive_timeout && stm32_set_adaptive_timeout(s->stm, 1)) {
+		log_err(s, "Out of memory");
+		return 1;
+	}
+	return 0;
+}
+
+stm32flash_session_t *stm32flash_open(const struct stm32flash_options *opts,
+				      const struct stm32flash_callbacks *cb)
+{
+	stm32flash_session_t *s;
+
+	s = calloc(1, sizeof(*s));
+	if (!s) {
+		cb_log(cb, STM32FLASH_LOG_ERROR, "Out of memory");
+		return NULL;
+	}
+	s->opts = *opts;
+	if (cb)
+		s->cb = *cb;
+
+	if (port_open(&s->opts.port, &s->port_mem) != PORT_ERR_OK) {
+		log_err(s, "Failed to open port: %s", opts->port.device);
+		free(s);
+		return NULL;
+	}
+	s->port = s->port_mem;
+	if (opts->trace_file)
+		s->port = trace_wrap(s->port, opts->trace_file, opts->trace_ring);
+
+	log_info(s, "Interface %s: %s", s->port->name,
+		 s->port->get_cfg_str(s->port));
+	if (session_connect(s, opts->init))
+		goto err;
+
+	stm32_stats_phase(s->stm, STM32_PHASE_OTHER);
+	return s;
+
+err:
+	stm32flash_gpio_exit(s);
+	stm32flash_dump_trace(s);
+	stm32flash_close(s);
+	return NULL;
+}
+
+void stm32flash_close(stm32flash_session_t *s)
+{
+	if (!s)
+		return;
+	if (s->stm)
+		stm32_close(s->stm);
+	s->port->close(s->port);
+	free(s->port_mem);
+	free(s->crc_verify.data);
+	free(s);
+}
+
+int stm32flash_reconnect(stm32flash_session_t *s)
+{
+	if (s->stm)
+		stm32_close(s->stm);
+	s->stm = NULL;
+
+	if (session_connect(s, 1))
+		return 1;
+	stm32_stats_phase(s->stm, STM32_PHASE_OTHER);
+	return 0;
+}
+
+const stm32_t *stm32flash_target(const stm32flash_session_t *s)
+{
+	return s->stm;
+}
+
+struct port_interface *stm32flash_port(const stm32flash_session_t *s)
+{
+	return s->port;
+}
+
+void stm32flash_dump_trace(stm32flash_session_t *s)
+{
+	trace_error(s->port);
+}
+
+int stm32flash_range(stm32flash_session_t *s, uint32_t start_addr,
+		     uint32_t readwrite_len, int spage, int npages,
+		     struct stm32flash_range *range)
+{
+	const stm32_t *stm = s->stm;
+	uint32_t start, end;
+	int first_page, num_pages;
+
+	range->erasable = 1;
+	if (start_addr || readwrite_len) {
+		start = start_addr;
+
+		if (is_addr_in_flash(stm, start))
+			end = stm->dev->fl_end;
+		else {
+			range->erasable = 0;
+			if (is_addr_in_ram(stm, start))
+				end = stm->dev->ram_end;
+			else if (is_addr_in_opt_bytes(stm, start))
+				end = stm->dev->opt_end + 1;
+			else if (is_addr_in_sysmem(stm, start))
+				end = stm->dev->mem_end;
+			else {
+				/* Unknown territory */
+				if (readwrite_len)
+					end = start + readwrite_len;
+				else
+					end = start + sizeof(uint32_t);
+			}
+		}
+
+		if (readwrite_len && (end > start + readwrite_len))
+			end = start + readwrite_len;
+
+		first_page = stm32_addr_to_page_floor(stm, start);
+		if (!first_page && end == stm->dev->fl_end)
+			num_pages = STM32_MASS_ERASE;
+		else
+			num_pages = stm32_addr_to_page_ceil(stm, end) - first_page;
+	} else if (!spage && !npages) {
+		start = stm->dev->fl_start;
+		end = stm->dev->fl_end;
+		first_page = 0;
+		num_pages = STM32_MASS_ERASE;
+	} else {
+		first_page = spage;
+		start = stm32_page_to_addr(stm, first_page);
+		if (start > stm->dev->fl_end) {
+			log_err(s, "Address range exceeds flash size.");
+			return 1;
+		}
+
+		if (npages) {
+			num_pages = npages;
+			end = stm32_page_to_addr(stm, first_page + num_pages);
+			if (end > stm->dev->fl_end)
+				end = stm->dev->fl_end;
+		} else {
+			end = stm->dev->fl_end;
+			num_pages = stm32_addr_to_page_ceil(stm, end) - first_page;
+		}
+
+		if (!first_page && end == stm->dev->fl_end)
+			num_pages = STM32_MASS_ERASE;
+	}
+
+	range->start = start;
+	range->end = end;
+	range->first_page = first_page;
+	range->num_pages = num_pages;
+	return 0;
+}
+
+int stm32flash_image_range(stm32flash_session_t *s,
+			   const stm32flash_image_t *img,
+			   struct stm32flash_range *range)
+{
+	const stm32_t *stm = s->stm;
+	uint32_t start = img->base, end = img->base + img->size;
+
+	/* the addresses of a stream are known while writing it */
+	if (img->stream)
+		return stm32flash_range(s, 0, 0, 0, 0, range);
+	if (!img->addressed || !img->size)
+		return 1;
+
+	range->start = start;
+	range->end = end;
+	if (is_addr_in_flash(stm, start) && end <= stm->dev->fl_end) {
+		range->erasable = 1;
+		range->first_page = stm32_addr_to_page_floor(stm, start);
+		range->num_pages = stm32_addr_to_page_ceil(stm, end) - range->first_page;
+		return 0;
+	}
+	if (is_addr_in_ram(stm, start) && end <= stm->dev->ram_end) {
+		range->erasable = 0;
+		range->first_page = 0;
+		range->num_pages = 0;
+		return 0;
+	}
+	return 1;
+}
+
+static int read_direct(stm32flash_session_t *s, uint32_t start, uint32_t end,
+		       int (*sink)(void *arg, const uint8_t *data, unsigned int len),
+		       void *arg)
+{
+	unsigned int max_len = s->opts.port.rx_frame_max;
+	uint8_t buffer[256];
+	uint32_t addr, left;
+	unsigned int len;
+
+	addr = start;
+	while (addr < end) {
+		left = end - addr;
+		len = max_len > left ? left : max_len;
+		if (stm32_read_memory(s->stm, addr, buffer, len) != STM32_ERR_OK) {
+			log_err(s, "Failed to read memory at address 0x%08x, target write-protected?", addr);
+			return 1;
+		}
+		if (sink(arg, buffer, len))
+			return 1;
+		addr += len;
+
+		progress(s, STM32FLASH_OP_READ, addr, addr - start, end - start,
+			 0, 0);
+	}
+	return 0;
+}
+
+#ifndef __WIN32__
+/*
+ * Pipelined read-out: this thread keeps the link busy reading the device
+ * into the slots of a ring, one read per slot, while a second thread
+ * passes the data to the sink, all the full slots at once. A slow sink
+ * stalls the reads only once the ring is full.
+ */
+#define READ_SLOTS	1024
+
+struct read_pipe {
+	struct spsc	*q;
+	int		(*sink)(void *arg, const uint8_t *data, unsigned int len);
+	void		*arg;
+	int		failed;		/* the sink, read after the join */
+};
+
+static void *read_sink_thread(void *p)
+{
+	struct read_pipe *rp = p;
+	const uint8_t *data;
+	unsigned int n;
+	size_t len;
+
+	while ((data = spsc_peek(rp->q, &len, &n))) {
+		if (rp->sink(rp->arg, data, len)) {
+			rp->failed = 1;
+			spsc_close(rp->q);
+			break;
+		}
+		spsc_release(rp->q, n);
+	}
+	return NULL;
+}
+
+/* returns -1 if the pipeline cannot be started */
+static int read_pipelined(stm32flash_session_t *s, uint32_t start, uint32_t end,
+			  int (*sink)(void *arg, const uint8_t *data, unsigned int len),
+			  void *arg)
+{
+	unsigned int max_len = s->opts.port.rx_frame_max;
+	struct read_pipe rp = { NULL, sink, arg, 0 };
+	pthread_t thread;
+	uint32_t addr, left;
+	unsigned int len;
+	uint8_t *slot;
+	int ret = 1;
+
+	rp.q = spsc_new(READ_SLOTS, max_len);
+	if (!rp.q)
+		return -1;
+	if (pthread_create(&thread, NULL, read_sink_thread, &rp)) {
+		spsc_free(rp.q);
+		return -1;
+	}
+
+	addr = start;
+	while (addr < end) {
+		slot = spsc_get(rp.q);
+		if (!slot)
+			goto out;	/* the sink failed */
+		left = end - addr;
+		len = max_len > left ? left : max_len;
+		if (stm32_read_memory(s->stm, addr, slot, len) != STM32_ERR_OK) {
+			log_err(s, "Failed to read memory at address 0x%08x, target write-protected?", addr);
+			goto out;
+		}
+		spsc_put(rp.q, len);
+		addr += len;
+
+		progress(s, STM32FLASH_OP_READ, addr, addr - start, end - start,
+			 0, 0);
+	}
+	ret = 0;
+out:
+	/* the sink still gets the data already read */
+	spsc_close(rp.q);
+	pthread_join(thread, NULL);
+	spsc_free(rp.q);
+	return ret || rp.failed;
+}
+#endif
+
+int stm32flash_read(stm32flash_session_t *s, uint32_t start, uint32_t end,
+		    int (*sink)(void *arg, const uint8_t *data, unsigned int len),
+		    void *arg)
+{
+	int ret = -1;
+
+	stm32_stats_phase(s->stm, STM32_PHASE_READ);
+#ifndef __WIN32__
+	ret = read_pipelined(s, start, end, sink, arg);
+#endif
+	if (ret < 0)
+		ret = read_direct(s, start, end, sink, arg);
+	if (!ret)
+		log_info(s, "Done.");
+	stm32_stats_phase(s->stm, STM32_PHASE_OTHER);
+	return ret;
+}
+
+/*
+ * Write a block of at most one TX frame and read it back to verify it.
+ * Failed verifies are retried up to "retry" times.
+ * With "skip_write" the block is first checked, and only written if the
+ * check fails.
+ * Returns 0 on success.
+ */
+static int write_verify_block(stm32flash_session_t *s, uint32_t addr,
+			      const uint8_t *data, unsigned int len,
+			      unsigned int max_rlen, int skip_write)
+{
+	uint8_t compare[len];
+	unsigned int offset, rlen, r;
+	int failed = 0;
+	stm32_err_t s_err;
+
+	if (skip_write)
+		goto check;
+
+again:
+	stm32_stats_phase(s->stm, STM32_PHASE_WRITE);
+	s_err = stm32_write_memory(s->stm, addr, data, len);
+	if (s_err != STM32_ERR_OK) {
+		log_err(s, "Failed to write memory at address 0x%08x", addr);
+		return 1;
+	}
+
+check:
+	stm32_stats_phase(s->stm, STM32_PHASE_VERIFY);
+	offset = 0;
+	while (offset < len) {
+		rlen = len - offset;
+		rlen = rlen < max_rlen ? rlen : max_rlen;
+		s_err = stm32_read_memory(s->stm, addr + offset, compare + offset, rlen);
+		if (s_err != STM32_ERR_OK) {
+			log_err(s, "Failed to read memory at address 0x%08x", addr + offset);
+			return 1;
+		}
+		offset += rlen;
+	}
+
+	for (r = 0; r < len; ++r)
+		if (data[r] != compare[r]) {
+			if (failed == s->opts.retry) {
+				log_err(s, "Failed to verify at address 0x%08x, expected 0x%02x and found 0x%02x",
+					(uint32_t)(addr + r),
+					data[r],
+					compare[r]
+				);
+				return 1;
+			}
+			++failed;
+			goto again;
+		}
+
+	return 0;
+}
+
+static int crc_verify_flush(stm32flash_session_t *s)
+{
+	uint32_t crc;
+	unsigned int len, w;
+
+	if (!s->crc_verify.len)
+		return 0;
+
+	stm32_stats_phase(s->stm, STM32_PHASE_VERIFY);
+
+	/* the write command pads the last word with 0xFF */
+	len = (s->crc_verify.len + 3) & ~3;
+	memset(s->crc_verify.data + s->crc_verify.len, 0xff,
+	       len - s->crc_verify.len);
+	s->crc_verify.len = 0;
+
+	if (stm32_crc_memory(s->stm, s->crc_verify.addr, len, &crc) != STM32_ERR_OK) {
+		log_err(s, "Failed to read CRC at address 0x%08x",
+			s->crc_verify.addr);
+		return 1;
+	}
+	if (crc == stm32_sw_crc(STM32_CRC_INIT, s->crc_verify.data, len))
+		return 0;
+
+	/* mismatch, fall back to read back and rewrite the page */
+	for (w = 0; w < len; w += s->crc_verify.max_wlen) {
+		if (write_verify_block(s, s->crc_verify.addr + w, s->crc_verify.data + w,
+				       len - w > s->crc_verify.max_wlen ? s->crc_verify.max_wlen : len - w,
+				       s->crc_verify.max_rlen, 1))
+			return 1;
+	}
+	return 0;
+}
+
+static int crc_verify_queue(stm32flash_session_t *s, uint32_t addr,
+			    const uint8_t *data, unsigned int len)
+{
+	if (s->crc_verify.len && addr != s->crc_verify.addr + s->crc_verify.len)
+		if (crc_verify_flush(s))
+			return 1;
+
+	if (!s->crc_verify.len) {
+		s->crc_verify.addr = addr;
+		s->crc_verify.end = stm32_page_to_addr(s->stm,
+			stm32_addr_to_page_floor(s->stm, addr) + 1);
+	}
+
+	/* room for the word padding */
+	if (s->crc_verify.len + len + 3 > s->crc_verify.size) {
+		s->crc_verify.size = s->crc_verify.len + len + 3;
+		s->crc_verify.data = realloc(s->crc_verify.data, s->crc_verify.size);
+		if (!s->crc_verify.data) {
+			s->crc_verify.size = 0;
+			log_err(s, "Out of memory");
+			return 1;
+		}
+	}
+	memcpy(s->crc_verify.data + s->crc_verify.len, data, len);
+	s->crc_verify.len += len;
+
+	if (addr + len >= s->crc_verify.end)
+		return crc_verify_flush(s);
+	return 0;
+}
+
+/*
+ * Write a block of at most one TX frame and, if requested, verify it.
+ * If the destination is known to be "erased", a block of all 0xFF is not
+ * sent to the device; the verify still expects to read back 0xFF.
+ * Returns 0 on success.
+ */
+static int write_block(stm32flash_session_t *s, uint32_t addr,
+		       const uint8_t *data, unsigned int len,
+		       unsigned int max_rlen, int erased, int verify)
+{
+	int skip_write = 0;
+
+	if (erased && is_erased(data, len)) {
+		s->skipped_bytes += len;
+		skip_write = 1;
+	}
+
+	if (verify && !(s->crc_verify.max_wlen && is_addr_in_flash(s->stm, addr)))
+		return write_verify_block(s, addr, data, len, max_rlen, skip_write);
+
+	stm32_stats_phase(s->stm, STM32_PHASE_WRITE);
+	if (!skip_write && stm32_write_memory(s->stm, addr, data, len) != STM32_ERR_OK) {
+		log_err(s, "Failed to write memory at address 0x%08x", addr);
+		return 1;
+	}
+
+	if (verify)
+		return crc_verify_queue(s, addr, data, len);
+	return 0;
+}
+
+/*
+ * Compare "len" bytes of the device at "addr" with "data".
+ * Use the bootloader CRC command when available, otherwise read back the
+ * memory, stopping at the first difference.
+ * Returns 1 if content differs, 0 if it matches, -1 on error.
+ */
+static int flash_range_differs(stm32flash_session_t *s, uint32_t addr,
+			       uint8_t *data, unsigned int len,
+			       unsigned int max_rlen)
+{
+	uint8_t compare[max_rlen];
+	uint32_t crc;
+	unsigned int offset, rlen;
+
+	stm32_stats_phase(s->stm, STM32_PHASE_VERIFY);
+	if (stm32_has_crc(s->stm)) {
+		if (stm32_crc_memory(s->stm, addr, len, &crc) != STM32_ERR_OK) {
+			log_err(s, "Failed to read CRC at address 0x%08x", addr);
+			return -1;
+		}
+		return crc != stm32_sw_crc(STM32_CRC_INIT, data, len);
+	}
+
+	for (offset = 0; offset < len; offset += rlen) {
+		rlen = len - offset;
+		rlen = rlen < max_rlen ? rlen : max_rlen;
+		if (stm32_read_memory(s->stm, addr + offset, compare, rlen) != STM32_ERR_OK) {
+			log_err(s, "Failed to read memory at address 0x%08x", addr + offset);
+			return -1;
+		}
+		if (memcmp(compare, data + offset, rlen))
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Length of the next block of the image to write, from "offset" or after
+ * it: the blocks of flash falling in a gap of the image are skipped and
+ * "offset" is moved past them. Returns 0 at the end of image or range.
+ */
+static unsigned int next_block(stm32flash_session_t *s,
+			       const stm32flash_image_t *img,
+			       uint32_t start, uint32_t end,
+			       unsigned int max_wlen, unsigned int *offset)
+{
+	unsigned int skip, len;
+
+	if (*offset < img->size && is_addr_in_flash(s->stm, start + *offset)) {
+		skip = image_next_data(img, *offset) - *offset;
+		*offset += skip - skip % max_wlen;
+	}
+	if (*offset >= img->size || *offset >= end - start)
+		return 0;
+
+	len = end - start - *offset;
+	len = len > max_wlen ? max_wlen : len;
+	len = len > img->size - *offset ? img->size - *offset : len;
+	return len;
+}
+
+/*
+ * Erase only the pages that will be written, with one erase command per
+ * run of consecutive pages.
+ */
+static int erase_sparse(stm32flash_session_t *s, const stm32flash_image_t *img,
+			uint32_t start, uint32_t end, unsigned int max_wlen)
+{
+	unsigned int offset = 0, len;
+	int first = 0, num = 0, page, last;
+
+	stm32_stats_phase(s->stm, STM32_PHASE_ERASE);
+	for (;;) {
+		len = next_block(s, img, start, end, max_wlen, &offset);
+		if (len) {
+			page = stm32_addr_to_page_floor(s->stm, start + offset);
+			last = stm32_addr_to_page_ceil(s->stm, start + offset + len);
+			offset += len;
+			if (num && page <= first + num) {
+				num = last > first + num ? last - first : num;
+				continue;
+			}
+		}
+		if (num && stm32_erase_memory(s->stm, first, num) != STM32_ERR_OK) {
+			log_err(s, "Failed to erase pages %d to %d", first,
+				first + num - 1);
+			return 1;
+		}
+		if (!len)
+			return 0;
+		first = page;
+		num = last - page;
+	}
+}
+
+/*
+ * Differential write: walk the image page by page, and only erase and
+ * program the flash pages whose content differs from the image.
+ * Flash pages beyond the image, and with "sparse" in its gaps, are left
+ * untouched.
+ * Tail of the last page is compared against 0xFF, as after an erase.
+ */
+static int write_differential(stm32flash_session_t *s,
+			      const stm32flash_image_t *img,
+			      uint32_t start, uint32_t end, unsigned int size,
+			      unsigned int max_wlen, unsigned int max_rlen,
+			      int verify, int sparse)
+{
+	uint8_t *page_buf = NULL;
+	const uint8_t *data;
+	uint32_t addr, page_end;
+	unsigned int offset, len, plen, done, w;
+	int page, diff, pages = 0, rewritten = 0, ret = 1;
+
+	page = stm32_addr_to_page_floor(s->stm, start);
+	if (start != stm32_page_to_addr(s->stm, page)) {
+		log_err(s, "Differential write requires a page aligned start address");
+		return 1;
+	}
+
+	addr = start;
+	offset = 0;
+	while (addr < end && offset < size) {
+		page_end = stm32_page_to_addr(s->stm, page + 1);
+		plen = page_end - addr;
+
+		/* pages in a gap of the image are left untouched */
+		if (sparse && image_next_data(img, offset) >= offset + plen) {
+			offset += plen;
+			addr = page_end;
+			page++;
+			continue;
+		}
+
+		page_buf = realloc(page_buf, plen);
+		if (!page_buf) {
+			log_err(s, "Out of memory");
+			goto out;
+		}
+
+		/* fill page with image data, pad the rest as erased flash */
+		done = plen;
+		done = done > size - offset ? size - offset : done;
+		done = done > end - addr ? end - addr : done;
+		data = image_block(img, offset, done, page_buf);
+		if (data != page_buf)
+			memcpy(page_buf, data, done);
+		memset(page_buf + done, 0xff, plen - done);
+		offset += done;
+
+		diff = flash_range_differs(s, addr, page_buf, plen, max_rlen);
+		if (diff < 0)
+			goto out;
+		pages++;
+
+		if (diff) {
+			stm32_stats_phase(s->stm, STM32_PHASE_ERASE);
+			if (stm32_erase_memory(s->stm, page, 1) != STM32_ERR_OK) {
+				log_err(s, "Failed to erase page %d", page);
+				goto out;
+			}
+			for (w = 0; w < done; w += len) {
+				len = done - w;
+				len = len > max_wlen ? max_wlen : len;
+				if (write_block(s, addr + w, page_buf + w, len,
+						max_rlen, 1, verify))
+					goto out;
+			}
+			rewritten++;
+		}
+
+		if (crc_verify_flush(s))
+			goto out;
+
+		addr = page_end;
+		page++;
+
+		progress(s, STM32FLASH_OP_DIFF, addr, offset, size, verify,
+			 rewritten);
+	}
+
+	log_info(s, "Done.");
+	log_info(s, "Differential write: %d of %d page(s) rewritten",
+		 rewritten, pages);
+	if (s->skipped_bytes)
+		log_info(s, "Skipped %u bytes already erased (0xFF)",
+			 s->skipped_bytes);
+	ret = 0;
+out:
+	free(page_buf);
+	return ret;
+}
+
+/* erase the pages of the range, before writing it */
+static int erase_range(stm32flash_session_t *s,
+		       const struct stm32flash_range *range,
+		       uint32_t *erased_start, uint32_t *erased_end)
+{
+	const stm32_t *stm = s->stm;
+
+	log_info(s, "Erasing memory");
+	stm32_stats_phase(stm, STM32_PHASE_ERASE);
+	if (stm32_erase_memory(stm, range->first_page, range->num_pages) != STM32_ERR_OK) {
+		log_err(s, "Failed to erase memory");
+		return 1;
+	}
+	*erased_start = stm32_page_to_addr(stm, range->first_page);
+	if (range->num_pages == STM32_MASS_ERASE)
+		*erased_end = stm->dev->fl_end;
+	else
+		*erased_end = stm32_page_to_addr(stm, range->first_page + range->num_pages);
+	return 0;
+}
+
+#ifndef __WIN32__
+/*
+ * Write a streamed image block by block, as the reader thread decodes
+ * them. With "sparse" a page is erased just before its first block is
+ * written, together with the next pages whose blocks are already queued;
+ * otherwise the range is erased first and, as for any image, the first
+ * data is written at its start.
+ */
+static int write_stream(stm32flash_session_t *s, const stm32flash_image_t *img,
+			const struct stm32flash_range *range, unsigned int flags,
+			unsigned int max_wlen, unsigned int max_rlen, int verify)
+{
+	struct image_stream *st = img->stream;
+	const struct stream_block *b;
+	uint32_t addr, end, next, delta = 0, erased_start = 0, erased_end = 0;
+	unsigned int n, i, len, done = 0;
+	int sparse = (flags & STM32FLASH_SPARSE) && !(flags & STM32FLASH_NO_ERASE);
+	int first = 1, page, last, ret = 1;
+	size_t l;
+
+	if (st->written) {
+		log_err(s, "A streamed image can be written only once");
+		return 1;
+	}
+	st->written = 1;
+
+	if (flags & STM32FLASH_DIFF) {
+		log_err(s, "Differential write is not possible on a stream");
+		goto out;
+	}
+	if (!sparse && !(flags & STM32FLASH_NO_ERASE) && range->num_pages
+	    && erase_range(s, range, &erased_start, &erased_end))
+		goto out;
+
+	while ((b = spsc_peek(st->q, &l, &n))) {
+		addr = b->addr + (b->lo & ~3);
+		end = b->addr + b->hi;
+		if (first && !(flags & STM32FLASH_SPARSE))
+			delta = range->start - addr;
+		first = 0;
+		if (addr + delta < range->start || end + delta > range->end) {
+			log_err(s, "Data at address 0x%08x out of the range", addr);
+			goto out;
+		}
+		addr += delta;
+		end += delta;
+
+		if (sparse && end > erased_end) {
+			page = stm32_addr_to_page_floor(s->stm,
+				addr > erased_end ? addr : erased_end);
+			last = stm32_addr_to_page_ceil(s->stm, end);
+			for (i = 1; i < n; i++) {
+				next = b[i].addr + (b[i].lo & ~3);
+				if (next > stm32_page_to_addr(s->stm, last)
+				    || b[i].addr + b[i].hi > range->end)
+					break;
+				last = stm32_addr_to_page_ceil(s->stm,
+							       b[i].addr + b[i].hi);
+			}
+			stm32_stats_phase(s->stm, STM32_PHASE_ERASE);
+			if (stm32_erase_memory(s->stm, page, last - page) != STM32_ERR_OK) {
+				log_err(s, "Failed to erase pages %d to %d", page,
+					last - 1);
+				goto out;
+			}
+			if (stm32_page_to_addr(s->stm, page) != erased_end)
+				erased_start = stm32_page_to_addr(s->stm, page);
+			erased_end = stm32_page_to_addr(s->stm, last);
+		}
+
+		for (; addr < end; addr += len) {
+			len = end - addr > max_wlen ? max_wlen : end - addr;
+			if (write_block(s, addr, b->data + (addr - delta - b->addr),
+					len, max_rlen,
+					addr >= erased_start && addr + len <= erased_end,
+					verify))
+				goto out;
+			done += len;
+		}
+		spsc_release(st->q, 1);
+
+		progress(s, STM32FLASH_OP_WRITE, end, done, 0, verify, 0);
+	}
+
+	if (st->failed) {
+		log_err(s, "%s", st->msg);
+		goto out;
+	}
+	if (crc_verify_flush(s))
+		goto out;
+
+	log_info(s, "Done.");
+	if (s->skipped_bytes)
+		log_info(s, "Skipped %u bytes already erased (0xFF)",
+			 s->skipped_bytes);
+	ret = 0;
+out:
+	/* stops the reader */
+	__atomic_store_n(&st->stop, 1, __ATOMIC_RELEASE);
+	spsc_close(st->q);
+	return ret;
+}
+#endif
+
+static int write_image(stm32flash_session_t *s, const stm32flash_image_t *img,
+		       const struct stm32flash_range *range, unsigned int flags)
+{
+	const stm32_t *stm = s->stm;
+	uint32_t start = range->start, end = range->end;
+	uint32_t addr, erased_start = 0, erased_end = 0;
+	unsigned int offset = 0, len, size = img->size;
+	unsigned int max_wlen, max_rlen;
+	int verify = !!(flags & STM32FLASH_VERIFY);
+	const uint8_t *data;
+	uint8_t block[STM32_MAX_TX_FRAME];
+
+	s->skipped_bytes = 0;
+	s->crc_verify.len = 0;
+	s->crc_verify.max_wlen = 0;
+
+	max_wlen = s->opts.port.tx_frame_max - 2;	/* skip len and crc */
+	max_wlen = max_wlen < sizeof(block) ? max_wlen : sizeof(block);
+	max_wlen &= ~3;	/* 32 bit aligned */
+
+	max_rlen = s->opts.port.rx_frame_max;
+	max_rlen = max_rlen < max_wlen ? max_rlen : max_wlen;
+
+	/* verify flash by CRC if bootloader supports it */
+	if (verify && stm32_has_crc(stm)) {
+		log_info(s, "Verify by CRC");
+		s->crc_verify.max_wlen = max_wlen;
+		s->crc_verify.max_rlen = max_rlen;
+	}
+
+#ifndef __WIN32__
+	if (img->stream)
+		return write_stream(s, img, range, flags, max_wlen, max_rlen,
+				    verify);
+#endif
+
+	if (flags & STM32FLASH_DIFF) {
+		if ((flags & STM32FLASH_NO_ERASE) || !is_addr_in_flash(stm, start)) {
+			log_err(s, "Differential write is only possible on erasable flash");
+			return 1;
+		}
+		return write_differential(s, img, start, end, size,
+					  max_wlen, max_rlen, verify,
+					  flags & STM32FLASH_SPARSE);
+	}
+
+	// TODO: It is possible to write to non-page boundaries, by reading out flash
+	//       from partial pages and combining with the input data
+	// if ((start % stm->dev->fl_ps[i]) != 0 || (end % stm->dev->fl_ps[i]) != 0) {
+	//	fprintf(stderr, "Specified start & length are invalid (must be page aligned)\n");
+	//	goto close;
+	// }
+
+	// TODO: If writes are not page aligned, we should probably read out existing flash
+	//       contents first, so it can be preserved and combined with new data
+	if (!(flags & STM32FLASH_NO_ERASE) && (flags & STM32FLASH_SPARSE)) {
+		log_info(s, "Erasing memory");
+		if (erase_sparse(s, img, start, end, max_wlen))
+			return 1;
+		erased_start = start;
+		erased_end = end;
+	} else if (!(flags & STM32FLASH_NO_ERASE) && range->num_pages) {
+		if (erase_range(s, range, &erased_start, &erased_end))
+			return 1;
+	}
+
+	while ((len = next_block(s, img, start, end, max_wlen, &offset))) {
+		addr = start + offset;
+		data = image_block(img, offset, len, block);
+
+		if (write_block(s, addr, data, len, max_rlen,
+				addr >= erased_start && addr + len <= erased_end,
+				verify))
+			return 1;
+
+		offset	+= len;
+
+		progress(s, STM32FLASH_OP_WRITE, addr + len, offset, size, verify, 0);
+	}
+
+	if (crc_verify_flush(s))
+		return 1;
+
+	log_info(s, "Done.");
+	if (s->skipped_bytes)
+		log_info(s, "Skipped %u bytes already erased (0xFF)",
+			 s->skipped_bytes);
+	return 0;
+}
+
+int stm32flash_write(stm32flash_session_t *s, const stm32flash_image_t *img,
+		     const struct stm32flash_range *range, unsigned int flags)
+{
+	int ret;
+
+	if (!range->erasable)
+		flags |= STM32FLASH_NO_ERASE;
+	ret = write_image(s, img, range, flags);
+	stm32_stats_phase(s->stm, STM32_PHASE_OTHER);
+	return ret;
+}
+
+int stm32flash_erase(stm32flash_session_t *s,
+		     const struct stm32flash_range *range)
+{
+	int ret = 0;
+
+	if (range->num_pages != STM32_MASS_ERASE &&
+	    (range->start != stm32_page_to_addr(s->stm, range->first_page)
+	     || range->end != stm32_page_to_addr(s->stm, range->first_page + range->num_pages))) {
+		log_err(s, "Specified start & length are invalid (must be page aligned)");
+		return 1;
+	}
+
+	stm32_stats_phase(s->stm, STM32_PHASE_ERASE);
+	if (stm32_erase_memory(s->stm, range->first_page, range->num_pages) != STM32_ERR_OK) {
+		log_err(s, "Failed to erase memory");
+		ret = 1;
+	}
+	stm32_stats_phase(s->stm, STM32_PHASE_OTHER);
+	return ret;
+}
+
+int stm32flash_crc(stm32flash_session_t *s, uint32_t start, uint32_t end,
+		   uint32_t *crc)
+{
+	int ret = 0;
+
+	stm32_stats_phase(s->stm, STM32_PHASE_CRC);
+	if (stm32_crc_wrapper(s->stm, start, end - start, crc) != STM32_ERR_OK) {
+		log_err(s, "Failed to read CRC");
+		ret = 1;
+	}
+	stm32_stats_phase(s->stm, STM32_PHASE_OTHER);
+	return ret;
+}
+
+int stm32flash_go(stm32flash_session_t *s, uint32_t addr)
+{
+	return stm32_go(s->stm, addr) != STM32_ERR_OK;
+}
+
+int stm32flash_reset(stm32flash_session_t *s)
+{
+	return init_bl_exit(s->stm, s->port, s->opts.gpio_seq,
+			    s->opts.gpio_trace);
+}
+
+/* run the exit part of the GPIO sequence, if present */
+int stm32flash_gpio_exit(stm32flash_session_t *s)
+{
+	if (s->opts.gpio_seq && strchr(s->opts.gpio_seq, ':'))
+		return gpio_bl_exit(s->port, s->opts.gpio_seq,
+				    s->opts.gpio_trace);
+	return 0;
+}
+
+int stm32flash_read_protect(stm32flash_session_t *s)
+{
+	if (stm32_readprot_memory(s->stm) != STM32_ERR_OK) {
+		log_err(s, "Failed to read-protect flash");
+		return 1;
+	}
+	return 0;
+}
+
+int stm32flash_read_unprotect(stm32flash_session_t *s)
+{
+	if (stm32_runprot_memory(s->stm) != STM32_ERR_OK) {
+		log_err(s, "Failed to read-unprotect flash");
+		return 1;
+	}
+	return 0;
+}
+
+int stm32flash_write_unprotect(stm32flash_session_t *s)
+{
+	if (stm32_wunprot_memory(s->stm) != STM32_ERR_OK) {
+		log_err(s, "Failed to write-unprotect flash");
+		return 1;
+	}
+	return 0;
+}
+
+/* an image of a single segment, taking the malloc'ed data */
+static stm32flash_image_t *image_own(uint8_t *data, unsigned int size,
+				     const char *format)
+{
+	stm32flash_image_t *img;
+
+	img = calloc(1, sizeof(*img));
+	if (!img)
+		return NULL;
+	img->data = data;
+	img->size = size;
+	img->format = format;
+	img->own.len = size;
+	img->own.data = img->data;
+	img->seg = &img->own;
+	img->nseg = size ? 1 : 0;
+	return img;
+}
+
+/* the image refers to the segments of the open parser */
+static int image_segments(stm32flash_image_t *img, parser_t *parser,
+			  void *p_st)
+{
+	const struct parser_segment *last;
+	parser_err_t perr;
+
+	perr = parser->segments(p_st, &img->seg, &img->nseg);
+	if (perr != PARSER_ERR_OK)
+		return 1;
+	img->parser = parser;
+	img->p_st = p_st;
+	img->addressed = parser->addressed;
+	if (img->nseg) {
+		last = &img->seg[img->nseg - 1];
+		img->base = img->seg[0].addr;
+		img->size = last->addr + last->len - img->base;
+	}
+	return 0;
+}
+
+#ifndef __WIN32__
+/*
+ * Reader thread: data of the records, in blocks of one window. A window
+ * can be sent in more blocks when the stream stalls, each ending on a
+ * word, so that no word is written twice.
+ */
+static int stream_emit(void *arg, uint32_t addr, const uint8_t *data,
+		       unsigned int len)
+{
+	struct image_stream *st = arg;
+	unsigned int off, n;
+	uint32_t window;
+
+	if (addr < st->next) {
+		st->failed = 1;
+		snprintf(st->msg, sizeof(st->msg),
+			 "HEX records out of order or overlapping at address 0x%08x, cannot stream",
+			 addr);
+		return 1;
+	}
+	while (len) {
+		window = addr & ~(uint32_t)(STREAM_BLOCK - 1);
+		if (st->cur && st->cur->addr != window) {
+			spsc_put(st->q, sizeof(*st->cur));
+			st->cur = NULL;
+		}
+		if (!st->cur) {
+			st->cur = spsc_get(st->q);
+			if (!st->cur)
+				return 1;	/* closed by the writer */
+			memset(st->cur->data, 0xff, sizeof(st->cur->data));
+			st->cur->addr = window;
+			st->cur->lo = addr - window;
+		}
+		off = addr - window;
+		n = STREAM_BLOCK - off < len ? STREAM_BLOCK - off : len;
+		memcpy(st->cur->data + off, data, n);
+		st->cur->hi = off + n;
+		addr += n;
+		data += n;
+		len -= n;
+	}
+	st->next = addr;
+	return 0;
+}
+
+static void *stream_thread(void *p)
+{
+	struct image_stream *st = p;
+	struct pollfd pfd;
+	uint8_t *buf;
+	ssize_t r;
+	parser_err_t perr;
+
+	buf = malloc(STREAM_READ);
+	if (!buf) {
+		snprintf(st->msg, sizeof(st->msg), "Out of memory");
+		goto fail;
+	}
+	perr = hex_stream_feed(st->hex, st->prefix, st->prefix_len);
+	while (perr == PARSER_ERR_OK && !hex_stream_done(st->hex)) {
+		/* wait for data, or for the writer to give up */
+		if (__atomic_load_n(&st->stop, __ATOMIC_ACQUIRE))
+			break;
+		pfd.fd = st->fd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, 0) == 0) {
+			/* the writer would wait for the block being filled */
+			if (st->cur && !(st->cur->hi & 3)) {
+				spsc_put(st->q, sizeof(*st->cur));
+				st->cur = NULL;
+			}
+			if (poll(&pfd, 1, STREAM_POLL) == 0)
+				continue;
+		}
+		r = read(st->fd, buf, STREAM_READ);
+		if (r < 0 && (errno == EINTR || errno == EAGAIN))
+			continue;
+		if (r < 0) {
+			snprintf(st->msg, sizeof(st->msg),
+				 "Failed to read the HEX stream: %s",
+				 strerror(errno));
+			free(buf);
+			goto fail;
+		}
+		if (!r) {
+			perr = hex_stream_end(st->hex);
+			break;
+		}
+		perr = hex_stream_feed(st->hex, buf, r);
+	}
+	free(buf);
+	if (perr == PARSER_ERR_INVALID_FILE)
+		snprintf(st->msg, sizeof(st->msg),
+			 "Invalid record in the HEX stream");
+	if (perr != PARSER_ERR_OK) {
+		/* the message of a failed emit() is already set */
+		if (!st->msg[0])
+			snprintf(st->msg, sizeof(st->msg),
+				 "Failed to decode the HEX stream");
+		goto fail;
+	}
+	if (st->cur)
+		spsc_put(st->q, sizeof(*st->cur));
+	spsc_close(st->q);
+	return NULL;
+
+fail:
+	st->failed = 1;
+	spsc_close(st->q);
+	return NULL;
+}
+
+/*
+ * Read stdin: an Intel HEX stream is decoded while it is written, any
+ * other data is read until EOF as binary.
+ */
+static stm32flash_image_t *image_stdin(const struct stm32flash_callbacks *cb)
+{
+	struct image_stream *st;
+	stm32flash_image_t *img;
+	uint8_t *buf = NULL, *tmp;
+	size_t len = 0, size = 0;
+	ssize_t r = 1;
+	int hex = -1;
+
+	/* enough to find the first record */
+	while (hex < 0 || (!hex && r)) {
+		if (len == size) {
+			size = size ? 2 * size : STREAM_SNIFF;
+			tmp = realloc(buf, size);
+			if (!tmp) {
+				cb_log(cb, STM32FLASH_LOG_ERROR, "Out of memory");
+				free(buf);
+				return NULL;
+			}
+			buf = tmp;
+		}
+		r = read(STDIN_FILENO, buf + len, size - len);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0) {
+			cb_log(cb, STM32FLASH_LOG_ERROR, "stdin: %s", strerror(errno));
+			free(buf);
+			return NULL;
+		}
+		len += r;
+		if (hex < 0) {
+			hex = hex_sniff(buf, len);
+			if (hex < 0 && (!r || len >= STREAM_SNIFF))
+				hex = 0;
+		}
+	}
+
+	if (!hex) {
+		cb_log(cb, STM32FLASH_LOG_INFO, "Using Parser : %s", PARSER_BINARY.name);
+		img = image_own(buf, len, PARSER_BINARY.name);
+		if (!img) {
+			cb_log(cb, STM32FLASH_LOG_ERROR, "Out of memory");
+			free(buf);
+		}
+		return img;
+	}
+
+	cb_log(cb, STM32FLASH_LOG_INFO, "Using Parser : %s, streamed", PARSER_HEX.name);
+	img = calloc(1, sizeof(*img));
+	st = calloc(1, sizeof(*st));
+	if (!img || !st)
+		goto oom;
+	img->stream = st;
+	img->format = "Intel HEX stream";
+	img->addressed = 1;
+	st->fd = STDIN_FILENO;
+	st->prefix = buf;
+	st->prefix_len = len;
+	st->hex = hex_stream_new(stream_emit, st);
+	st->q = spsc_new(STREAM_SLOTS, sizeof(struct stream_block));
+	if (!st->hex || !st->q)
+		goto oom;
+	if (pthread_create(&st->thread, NULL, stream_thread, st)) {
+		cb_log(cb, STM32FLASH_LOG_ERROR, "Failed to start the HEX stream reader");
+		stm32flash_image_free(img);
+		return NULL;
+	}
+	st->running = 1;
+	return img;
+
+oom:
+	cb_log(cb, STM32FLASH_LOG_ERROR, "Out of memory");
+	if (img && img->stream) {
+		stm32flash_image_free(img);
+		return NULL;
+	}
+	free(st);
+	free(img);
+	free(buf);
+	return NULL;
+}
+#endif
+
+stm32flash_image_t *stm32flash_image_load(const char *filename,
+					  unsigned int flags,
+					  const struct stm32flash_callbacks *cb)
+{
+	int force_binary = (filename[0] == '-' && filename[1] == '\0')
+			   || (flags & STM32FLASH_BINARY);
+	/* the formats recognized by their content, binary is the fallback */
+	static parser_t * const formats[] = {
+		&PARSER_ELF, &PARSER_HEX, &PARSER_SREC, NULL
+	};
+	stm32flash_image_t *img;
+	parser_t *parser = NULL;
+	void *p_st = NULL;
+	parser_err_t perr = PARSER_ERR_INVALID_FILE;
+	unsigned int i;
+
+#ifndef __WIN32__
+	if (filename[0] == '-' && filename[1] == '\0' && !(flags & STM32FLASH_BINARY))
+		return image_stdin(cb);
+#endif
+
+	for (i = 0; !force_binary && !p_st && formats[i]; i++) {
+		parser = formats[i];
+		p_st = parser->init();
+		if (!p_st) {
+			cb_log(cb, STM32FLASH_LOG_ERROR, "%s Parser failed to initialize", parser->name);
+			return NULL;
+		}
+		perr = parser->open(p_st, filename, 0);
+		if (perr == PARSER_ERR_INVALID_FILE) {
+			parser->close(p_st);
+			p_st = NULL;
+		}
+	}
+
+	/* now try binary */
+	if (!p_st) {
+		parser = &PARSER_BINARY;
+		p_st = parser->init();
+		if (!p_st) {
+			cb_log(cb, STM32FLASH_LOG_ERROR, "%s Parser failed to initialize", parser->name);
+			return NULL;
+		}
+		perr = parser->open(p_st, filename, 0);
+	}
+
+	/* if still have an error, fail */
+	if (perr != PARSER_ERR_OK) {
+		cb_log(cb, STM32FLASH_LOG_ERROR, "%s ERROR: %s", parser->name, parser_errstr(perr));
+		if (perr == PARSER_ERR_SYSTEM)
+			cb_log(cb, STM32FLASH_LOG_ERROR, "%s: %s", filename, strerror(errno));
+		parser->close(p_st);
+		return NULL;
+	}
+
+	cb_log(cb, STM32FLASH_LOG_INFO, "Using Parser : %s", parser->name);
+
+	img = calloc(1, sizeof(*img));
+	if (!img) {
+		cb_log(cb, STM32FLASH_LOG_ERROR, "Out of memory");
+		parser->close(p_st);
+		return NULL;
+	}
+	img->format = parser->name;
+	if (image_segments(img, parser, p_st)) {
+		cb_log(cb, STM32FLASH_LOG_ERROR, "Failed to read input file");
+		parser->close(p_st);
+		stm32flash_image_free(img);
+		return NULL;
+	}
+	return img;
+}
+
+stm32flash_image_t *stm32flash_image_new(const void *data, unsigned int size)
+{
+	stm32flash_image_t *img;
+	uint8_t *copy;
+
+	copy = malloc(size ? size : 1);
+	if (!copy)
+		return NULL;
+	memcpy(copy, data, size);
+	img = image_own(copy, size, "memory");
+	if (!img)
+		free(copy);
+	return img;
+}
+
+void stm32flash_image_free(stm32flash_image_t *img)
+{
+	if (!img)
+		return;
+#ifndef __WIN32__
+	if (img->stream) {
+		/* stops the reader, if still running */
+		__atomic_store_n(&img->stream->stop, 1, __ATOMIC_RELEASE);
+		if (img->stream->q)
+			spsc_close(img->stream->q);
+		if (img->stream->running)
+			pthread_join(img->stream->thread, NULL);
+		if (img->stream->q)
+			spsc_free(img->stream->q);
+		if (img->stream->hex)
+			hex_stream_free(img->stream->hex);
+		free(img->stream->prefix);
+		free(img->stream);
+	}
+#endif
+	if (img->parser)
+		img->parser->close(img->p_st);
+	free(img->data);
+	free(img);
+}
+
+unsigned int stm32flash_image_size(const stm32flash_image_t *img)
+{
+	return img->size;
+}
+
+int stm32flash_image_read(const stm32flash_image_t *img, uint32_t offset,
+			  unsigned int len, uint8_t *buf)
+{
+	const uint8_t *data;
+
+	if (offset > img->size || len > img->size - offset)
+		return 1;
+	data = image_block(img, offset, len, buf);
+	if (data != buf)
+		memcpy(buf, data, len);
+	return 0;
+}
+
+const char *stm32flash_image_format(const stm32flash_image_t *img)
+{
+	return img->format;
+}
@@ -0,0 +1,183 @@
+/*
+  stm32flash - Open Source ST STM32 flash program for *nix
+  Copyright (C) 2026 The stm32flash contributors
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+
+#ifndef _H_LIBSTM32FLASH
+#define _H_LIBSTM32FLASH
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "stm32.h"
+#include "port.h"
+
+/*
+ * libstm32flash: the flashing engine of stm32flash, as a library.
+ *
+ * A session holds an open port and the bootloader connection of one
+ * target; an image holds the content of a file parsed in memory and can
+ * be written to any number of sessions. The library has no global state,
+ * different sessions can be used by different threads.
+ * Messages are sent to the log callback, without the trailing newline;
+ * nothing is printed, apart from the low level errors of the bootloader
+ * protocol in stm32.c, still on stderr.
+ * All the functions returning int return 0 on success.
+ */
+
+#define STM32FLASH_API_VERSION	1
+
+typedef struct stm32flash_session	stm32flash_session_t;
+typedef struct stm32flash_image		stm32flash_image_t;
+
+typedef enum {
+	STM32FLASH_LOG_ERROR = 0,
+	STM32FLASH_LOG_WARNING,
+	STM32FLASH_LOG_INFO,
+} stm32flash_log_t;
+
+typedef enum {
+	STM32FLASH_OP_READ = 0,
+	STM32FLASH_OP_WRITE,
+	STM32FLASH_OP_DIFF,	/* differential write, page compared */
+} stm32flash_op_t;
+
+struct stm32flash_progress {
+	stm32flash_op_t	op;
+	uint32_t	addr;		/* next address to process */
+	unsigned int	done, total;	/* bytes, total 0 if not known */
+	int		verify;		/* write is verified */
+	unsigned int	rewritten;	/* pages, differential write only */
+};
+
+struct stm32flash_callbacks {
+	void (*log)(void *arg, stm32flash_log_t level, const char *msg);
+	void (*progress)(void *arg, const struct stm32flash_progress *p);
+	void *arg;
+};
+
+/* the strings are not copied, keep them valid for the life of the session */
+struct stm32flash_options {
+	struct port_options	port;
+	const char		*gpio_seq;	/* see "-i" in the man page */
+	FILE			*gpio_trace;	/* GPIO sequences traced, or NULL */
+	int			init;		/* send the BL entry sequence and INIT */
+	unsigned int		ack_timeout[STM32_TMO_NUM];	/* ms, 0 default */
+	int			adaptive_timeout;
+	int			retry;		/* verify retries */
+	const char		*trace_file;	/* see trace.h */
+	size_t			trace_ring;
+	const char		*profile_file;	/* cache, see profile.h */
+};
+
+/* memory range of an operation, from stm32flash_range() */
+struct stm32flash_range {
+	uint32_t	start, end;	/* end excluded */
+	int		first_page;
+	int		num_pages;	/* or STM32_MASS_ERASE */
+	int		erasable;	/* start is in flash */
+};
+
+/* stm32flash_write() flags */
+#define STM32FLASH_VERIFY	(1 << 0)
+#define STM32FLASH_NO_ERASE	(1 << 1)
+#define STM32FLASH_DIFF		(1 << 2)	/* differential write */
+#define STM32FLASH_SPARSE	(1 << 3)	/* erase only the pages with data */
+
+/* image loading flags */
+#define STM32FLASH_BINARY	(1 << 0)	/* do not try ELF, HEX, S-record */
+
+void stm32flash_options_init(struct stm32flash_options *opts);
+
+stm32flash_session_t *stm32flash_open(const struct stm32flash_options *opts,
+				      const struct stm32flash_callbacks *cb);
+void stm32flash_close(stm32flash_session_t *s);
+/*
+ * Enter the bootloader again on the open port, e.g. after stm32flash_go()
+ * or a reset of the target. The INIT is always sent. After a failure only
+ * stm32flash_reconnect() and stm32flash_close() can be used.
+ */
+int stm32flash_reconnect(stm32flash_session_t *s);
+const stm32_t *stm32flash_target(const stm32flash_session_t *s);
+struct port_interface *stm32flash_port(const stm32flash_session_t *s);
+void stm32flash_dump_trace(stm32flash_session_t *s);
+
+/*
+ * Compute the range of an operation from either start address and length
+ * or first page and number of pages; all zero is the whole flash.
+ */
+int stm32flash_range(stm32flash_session_t *s, uint32_t start, uint32_t len,
+		     int spage, int npages, struct stm32flash_range *range);
+
+/*
+ * Range of the data of an image at the addresses of its file, when they
+ * are all in flash or all in RAM. Write it with STM32FLASH_SPARSE to
+ * erase and write only the pages with data.
+ * Returns 1, without error message, if the image has no addresses or
+ * does not fit.
+ */
+int stm32flash_image_range(stm32flash_session_t *s,
+			   const stm32flash_image_t *img,
+			   struct stm32flash_range *range);
+
+/*
+ * The sink gets the data in order, in blocks of any length; it can be
+ * called from a second thread, reading the device ahead while it runs.
+ * A sink returning not 0 stops the read.
+ */
+int stm32flash_read(stm32flash_session_t *s, uint32_t start, uint32_t end,
+		    int (*sink)(void *arg, const uint8_t *data, unsigned int len),
+		    void *arg);
+int stm32flash_write(stm32flash_session_t *s, const stm32flash_image_t *img,
+		     const struct stm32flash_range *range, unsigned int flags);
+int stm32flash_erase(stm32flash_session_t *s,
+		     const struct stm32flash_range *range);
+int stm32flash_crc(stm32flash_session_t *s, uint32_t start, uint32_t end,
+		   uint32_t *crc);
+int stm32flash_go(stm32flash_session_t *s, uint32_t addr);
+int stm32flash_reset(stm32flash_session_t *s);
+int stm32flash_gpio_exit(stm32flash_session_t *s);
+int stm32flash_read_protect(stm32flash_session_t *s);
+int stm32flash_read_unprotect(stm32flash_session_t *s);
+int stm32flash_write_unprotect(stm32flash_session_t *s);
+
+/*
+ * filename "-" reads stdin. Without STM32FLASH_BINARY, an Intel HEX
+ * stream is not read in memory: a thread decodes it while the image is
+ * written, it can be written only once and with no differential write.
+ * Its records must come in increasing address order.
+ */
+stm32flash_image_t *stm32flash_image_load(const char *filename,
+					  unsigned int flags,
+					  const struct stm32flash_callbacks *cb);
+stm32flash_image_t *stm32flash_image_new(const void *data, unsigned int size);
+void stm32flash_image_free(stm32flash_image_t *img);
+/* size up to the end of the last data, gaps included */
+unsigned int stm32flash_image_size(const stm32flash_image_t *img);
+/*
+ * Copy "len" bytes of the content of the image from "offset" in "buf",
+ * the gaps between the data of a file with addresses set to 0xFF.
+ * Returns 1 if the bytes are not all in the image. Writing an image does
+ * not need it.
+ */
+int stm32flash_image_read(const stm32flash_image_t *img, uint32_t offset,
+			  unsigned int len, uint8_t *buf);
+const char *stm32flash_image_format(const stm32flash_image_t *img);
+
+#endif
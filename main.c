@@ -29,12 +29,13 @@
 #include <string.h>
 #include <signal.h>
 
-#include "init.h"
-#include "utils.h"
+#include "compiler.h"
+#include "libstm32flash.h"
 #include "serial.h"
 #include "stm32.h"
 #include "parsers/parser.h"
 #include "port.h"
+#include "server.h"
 
 #include "parsers/binary.h"
 #include "parsers/hex.h"
@@ -45,21 +46,13 @@
 
 #define VERSION "STM32duino_0.5.1"
 
-/* device globals */
-stm32_t		*stm		= NULL;
-void		*p_st		= NULL;
-parser_t	*parser		= NULL;
-struct port_interface *port = NULL;
-
-/* settings */
-struct port_options port_opts = {
-	.device			= NULL,
-	.baudRate		= SERIAL_BAUD_57600,
-	.serial_mode		= "8e1",
-	.bus_addr		= 0,
-	.rx_frame_max		= STM32_MAX_RX_FRAME,
-	.tx_frame_max		= STM32_MAX_TX_FRAME,
-};
+/* session of the library, and output file of a memory read */
+static stm32flash_session_t *session	= NULL;
+static void	*p_st		= NULL;
+static parser_t	*parser		= NULL;
+
+/* settings, see stm32flash_options_init() for the defaults */
+static struct stm32flash_options opts;
 
 enum actions {
 	ACT_NONE,
@@ -77,21 +70,23 @@ int		npages		= 0;
 int             spage           = 0;
 int             no_erase        = 0;
 char		verify		= 0;
-int		retry		= 10;
+char		diff_write	= 0;
 char		exec_flag	= 0;
 uint32_t	execute		= 0;
-char		init_flag	= 1;
 int		use_stdinout	= 0;
 char		force_binary	= 0;
 FILE		*diag;
+int		skip_erased	= 0;
 char		reset_flag	= 0;
 char		*filename;
-char		*gpio_seq	= NULL;
 uint32_t	start_addr	= 0;
 uint32_t	readwrite_len	= 0;
+int		stats_format	= -1;	/* -1 none, 0 text, 1 JSON */
+char		*server_path	= NULL;
 
 /* functions */
 int  parse_options(int argc, char *argv[]);
+int  parse_timeouts(char *str);
 void show_help(char *name);
 
 static const char *action2str(enum actions act)
@@ -124,89 +119,52 @@ static void err_multi_action(enum actions new)
 		action2str(action), action2str(new));
 }
 
-static int is_addr_in_ram(uint32_t addr)
-{
-	return addr >= stm->dev->ram_start && addr < stm->dev->ram_end;
-}
-
-static int is_addr_in_flash(uint32_t addr)
+static void cli_log(void __unused *arg, stm32flash_log_t level, const char *msg)
 {
-	return addr >= stm->dev->fl_start && addr < stm->dev->fl_end;
-}
+	FILE *f = level == STM32FLASH_LOG_INFO ? diag : stderr;
 
-static int is_addr_in_opt_bytes(uint32_t addr)
-{
-	/* option bytes upper range is inclusive in our device table */
-	return addr >= stm->dev->opt_start && addr <= stm->dev->opt_end;
-}
-
-static int is_addr_in_sysmem(uint32_t addr)
-{
-	return addr >= stm->dev->mem_start && addr < stm->dev->mem_end;
+	fprintf(f, "%s\n", msg);
 }
 
-/* returns the page that contains address "addr" */
-static int flash_addr_to_page_floor(uint32_t addr)
+static void cli_progress(void __unused *arg, const struct stm32flash_progress *p)
 {
-	int page;
-	uint32_t *psize;
-
-	if (!is_addr_in_flash(addr))
-		return 0;
-
-	page = 0;
-	addr -= stm->dev->fl_start;
-	psize = stm->dev->fl_ps;
-
-	while (addr >= psize[0]) {
-		addr -= psize[0];
-		page++;
-		if (psize[1])
-			psize++;
+	float pct = (100.0f / (float)p->total) * (float)p->done;
+
+	switch (p->op) {
+	case STM32FLASH_OP_READ:
+		fprintf(diag, "\rRead address 0x%08x (%.2f%%) ", p->addr, pct);
+		break;
+	case STM32FLASH_OP_WRITE:
+		if (!p->total) {
+			/* streamed, the size is not known */
+			fprintf(diag, "\rWrote %saddress 0x%08x (%u bytes) ",
+				p->verify ? "and verified " : "", p->addr, p->done);
+			break;
+		}
+		fprintf(diag, "\rWrote %saddress 0x%08x (%.2f%%) ",
+			p->verify ? "and verified " : "", p->addr, pct);
+		break;
+	case STM32FLASH_OP_DIFF:
+		fprintf(diag,
+			"\rChecked address 0x%08x (%.2f%%), %d page(s) rewritten ",
+			p->addr, pct, p->rewritten);
+		break;
 	}
-
-	return page;
+	fflush(diag);
 }
 
-/* returns the first page whose start addr is >= "addr" */
-int flash_addr_to_page_ceil(uint32_t addr)
-{
-	int page;
-	uint32_t *psize;
-
-	if (!(addr >= stm->dev->fl_start && addr <= stm->dev->fl_end))
-		return 0;
-
-	page = 0;
-	addr -= stm->dev->fl_start;
-	psize = stm->dev->fl_ps;
-
-	while (addr >= psize[0]) {
-		addr -= psize[0];
-		page++;
-		if (psize[1])
-			psize++;
-	}
-
-	return addr ? page + 1 : page;
-}
+static const struct stm32flash_callbacks cli_cb = {
+	.log		= cli_log,
+	.progress	= cli_progress,
+};
 
-/* returns the lower address of flash page "page" */
-static uint32_t flash_page_to_addr(int page)
+static int cli_read_sink(void __unused *arg, const uint8_t *data, unsigned int len)
 {
-	int i;
-	uint32_t addr, *psize;
-
-	addr = stm->dev->fl_start;
-	psize = stm->dev->fl_ps;
-
-	for (i = 0; i < page; i++) {
-		addr += psize[0];
-		if (psize[1])
-			psize++;
+	if (parser->write(p_st, (void *)data, len) != PARSER_ERR_OK) {
+		fprintf(stderr, "Failed to write data to file\n");
+		return 1;
 	}
-
-	return addr;
+	return 0;
 }
 
 
@@ -214,25 +172,30 @@ static uint32_t flash_page_to_addr(int page)
 BOOL CtrlHandler( DWORD fdwCtrlType )
 {
 	fprintf(stderr, "\nCaught signal %lu\n",fdwCtrlType);
+	if (session) stm32flash_dump_trace(session);
 	if (p_st &&  parser ) parser->close(p_st);
-	if (stm  ) stm32_close  (stm);
-	if (port) port->close(port);
+	stm32flash_close(session);
 	exit(1);
 }
 #else
 void sighandler(int s){
 	fprintf(stderr, "\nCaught signal %d\n",s);
+	if (session) stm32flash_dump_trace(session);
 	if (p_st &&  parser ) parser->close(p_st);
-	if (stm  ) stm32_close  (stm);
-	if (port) port->close(port);
+	stm32flash_close(session);
 	exit(1);
 }
 #endif
 
 int main(int argc, char* argv[]) {
-	int ret = 1;
-	stm32_err_t s_err;
+	stm32flash_image_t *image = NULL;
+	const stm32_t *stm;
+	struct stm32flash_range range;
 	parser_err_t perr;
+	unsigned int sparse = 0;
+	int ret = 1;
+
+	stm32flash_options_init(&opts);
 	diag = stdout;
 
 	if (parse_options(argc, argv) != 0)
@@ -241,6 +204,7 @@ int main(int argc, char* argv[]) {
 	if (action == ACT_READ && use_stdinout) {
 		diag = stderr;
 	}
+	opts.gpio_trace = diag;
 
 	fprintf(diag, "stm32flash " VERSION "\n\n");
 	fprintf(diag, "https://github.com/stm32duino/stm32flash\n\n");
@@ -257,72 +221,26 @@ int main(int argc, char* argv[]) {
 	sigaction(SIGINT, &sigIntHandler, NULL);
 #endif
 
-	if (action == ACT_WRITE) {
-		/* first try hex */
-		if (!force_binary) {
-			parser = &PARSER_HEX;
-			p_st = parser->init();
-			if (!p_st) {
-				fprintf(stderr, "%s Parser failed to initialize\n", parser->name);
-				goto close;
-			}
-		}
-
-		if (force_binary || (perr = parser->open(p_st, filename, 0)) != PARSER_ERR_OK) {
-			if (force_binary || perr == PARSER_ERR_INVALID_FILE) {
-				if (!force_binary) {
-					parser->close(p_st);
-					p_st = NULL;
-				}
-
-				/* now try binary */
-				parser = &PARSER_BINARY;
-				p_st = parser->init();
-				if (!p_st) {
-					fprintf(stderr, "%s Parser failed to initialize\n", parser->name);
-					goto close;
-				}
-				perr = parser->open(p_st, filename, 0);
-			}
-
-			/* if still have an error, fail */
-			if (perr != PARSER_ERR_OK) {
-				fprintf(stderr, "%s ERROR: %s\n", parser->name, parser_errstr(perr));
-				if (perr == PARSER_ERR_SYSTEM) perror(filename);
-				goto close;
-			}
-		}
-
-		fprintf(diag, "Using Parser : %s\n", parser->name);
-	} else {
-		parser = &PARSER_BINARY;
-		p_st = parser->init();
-		if (!p_st) {
-			fprintf(stderr, "%s Parser failed to initialize\n", parser->name);
-			goto close;
-		}
-	}
-
-	if (port_open(&port_opts, &port) != PORT_ERR_OK) {
-		fprintf(stderr, "Failed to open port: %s\n", port_opts.device);
+	if (server_path) {
+		ret = server_run(server_path, &opts);
 		goto close;
 	}
 
-	fprintf(diag, "Interface %s: %s\n", port->name, port->get_cfg_str(port));
-	if (init_flag && init_bl_entry(port, gpio_seq)){
-		ret = 1;
-		fprintf(stderr, "Failed to send boot enter sequence\n");
-		goto close;
+	if (action == ACT_WRITE) {
+		image = stm32flash_image_load(filename,
+					      force_binary ? STM32FLASH_BINARY : 0,
+					      &cli_cb);
+		if (!image)
+			goto close;
 	}
 
-	port->flush(port);
-
-	stm = stm32_init(port, init_flag);
-	if (!stm)
+	session = stm32flash_open(&opts, &cli_cb);
+	if (!session)
 		goto close;
+	stm = stm32flash_target(session);
 
 	fprintf(diag, "Version      : 0x%02x\n", stm->bl_version);
-	if (port->flags & PORT_GVR_ETX) {
+	if (stm32flash_port(session)->flags & PORT_GVR_ETX) {
 		fprintf(diag, "Option 1     : 0x%02x\n", stm->option1);
 		fprintf(diag, "Option 2     : 0x%02x\n", stm->option2);
 	}
@@ -332,82 +250,26 @@ int main(int argc, char* argv[]) {
 	fprintf(diag, "- Option RAM : %db\n", stm->dev->opt_end - stm->dev->opt_start + 1);
 	fprintf(diag, "- System RAM : %dKiB\n", (stm->dev->mem_end - stm->dev->mem_start) / 1024);
 
-	uint8_t		buffer[256];
-	uint32_t	addr, start, end;
-	unsigned int	len;
-	int		failed = 0;
-	int		first_page, num_pages;
-
-	/*
-	 * Cleanup addresses:
-	 *
-	 * Starting from options
-	 *	start_addr, readwrite_len, spage, npages
-	 * and using device memory size, compute
-	 *	start, end, first_page, num_pages
-	 */
-	if (start_addr || readwrite_len) {
-		start = start_addr;
-
-		if (is_addr_in_flash(start))
-			end = stm->dev->fl_end;
-		else {
-			no_erase = 1;
-			if (is_addr_in_ram(start))
-				end = stm->dev->ram_end;
-			else if (is_addr_in_opt_bytes(start))
-				end = stm->dev->opt_end + 1;
-			else if (is_addr_in_sysmem(start))
-				end = stm->dev->mem_end;
-			else {
-				/* Unknown territory */
-				if (readwrite_len)
-					end = start + readwrite_len;
-				else
-					end = start + sizeof(uint32_t);
-			}
-		}
+	/* without a range, a file with addresses is written at them */
+	if (action == ACT_WRITE && !start_addr && !readwrite_len && !spage
+	    && !npages && !stm32flash_image_range(session, image, &range))
+		sparse = STM32FLASH_SPARSE;
+	else if (stm32flash_range(session, start_addr, readwrite_len, spage,
+				  npages, &range))
+		goto close;
 
-		if (readwrite_len && (end > start + readwrite_len))
-			end = start + readwrite_len;
+	if (action == ACT_READ) {
+		fprintf(diag, "Memory read\n");
 
-		first_page = flash_addr_to_page_floor(start);
-		if (!first_page && end == stm->dev->fl_end)
-			num_pages = STM32_MASS_ERASE;
+		if (!force_binary && hex_filename(filename))
+			parser = &PARSER_HEX;
 		else
-			num_pages = flash_addr_to_page_ceil(end) - first_page;
-	} else if (!spage && !npages) {
-		start = stm->dev->fl_start;
-		end = stm->dev->fl_end;
-		first_page = 0;
-		num_pages = STM32_MASS_ERASE;
-	} else {
-		first_page = spage;
-		start = flash_page_to_addr(first_page);
-		if (start > stm->dev->fl_end) {
-			fprintf(stderr, "Address range exceeds flash size.\n");
+			parser = &PARSER_BINARY;
+		p_st = parser->init();
+		if (!p_st) {
+			fprintf(stderr, "%s Parser failed to initialize\n", parser->name);
 			goto close;
 		}
-
-		if (npages) {
-			num_pages = npages;
-			end = flash_page_to_addr(first_page + num_pages);
-			if (end > stm->dev->fl_end)
-				end = stm->dev->fl_end;
-		} else {
-			end = stm->dev->fl_end;
-			num_pages = flash_addr_to_page_ceil(end) - first_page;
-		}
-
-		if (!first_page && end == stm->dev->fl_end)
-			num_pages = STM32_MASS_ERASE;
-	}
-
-	if (action == ACT_READ) {
-		unsigned int max_len = port_opts.rx_frame_max;
-
-		fprintf(diag, "Memory read\n");
-
 		perr = parser->open(p_st, filename, 1);
 		if (perr != PARSER_ERR_OK) {
 			fprintf(stderr, "%s ERROR: %s\n", parser->name, parser_errstr(perr));
@@ -415,248 +277,96 @@ int main(int argc, char* argv[]) {
 				perror(filename);
 			goto close;
 		}
+		if (parser == &PARSER_HEX)
+			hex_write_setup(p_st, range.start, skip_erased);
 
 		fflush(diag);
-		addr = start;
-		while(addr < end) {
-			uint32_t left	= end - addr;
-			len		= max_len > left ? left : max_len;
-			s_err = stm32_read_memory(stm, addr, buffer, len);
-			if (s_err != STM32_ERR_OK) {
-				fprintf(stderr, "Failed to read memory at address 0x%08x, target write-protected?\n", addr);
-				goto close;
-			}
-			if (parser->write(p_st, buffer, len) != PARSER_ERR_OK)
-			{
-				fprintf(stderr, "Failed to write data to file\n");
-				goto close;
-			}
-			addr += len;
-
-			fprintf(diag,
-				"\rRead address 0x%08x (%.2f%%) ",
-				addr,
-				(100.0f / (float)(end - start)) * (float)(addr - start)
-			);
-			fflush(diag);
+		ret = stm32flash_read(session, range.start, range.end,
+				      cli_read_sink, NULL);
+
+		/* the HEX writer flushes its buffer at close */
+		perr = parser->close(p_st);
+		p_st = NULL;
+		if (perr != PARSER_ERR_OK && !ret) {
+			perror(filename);
+			ret = 1;
 		}
-		fprintf(diag,	"Done.\n");
-		ret = 0;
-		goto close;
 	} else if (action == ACT_READ_PROTECT) {
 		fprintf(diag, "Read-Protecting flash\n");
 		/* the device automatically performs a reset after the sending the ACK */
 		reset_flag = 0;
-		s_err = stm32_readprot_memory(stm);
-		if (s_err != STM32_ERR_OK) {
-			fprintf(stderr, "Failed to read-protect flash\n");
-			goto close;
-		}
-		fprintf(diag,	"Done.\n");
-		ret = 0;
+		ret = stm32flash_read_protect(session);
+		if (!ret)
+			fprintf(diag,	"Done.\n");
 	} else if (action == ACT_READ_UNPROTECT) {
 		fprintf(diag, "Read-UnProtecting flash\n");
 		/* the device automatically performs a reset after the sending the ACK */
 		reset_flag = 0;
-		s_err = stm32_runprot_memory(stm);
-		if (s_err != STM32_ERR_OK) {
-			fprintf(stderr, "Failed to read-unprotect flash\n");
-			goto close;
-		}
-		fprintf(diag,	"Done.\n");
-		ret = 0;
+		ret = stm32flash_read_unprotect(session);
+		if (!ret)
+			fprintf(diag,	"Done.\n");
 	} else if (action == ACT_ERASE_ONLY) {
-		ret = 0;
 		fprintf(diag, "Erasing flash\n");
-
-		if (num_pages != STM32_MASS_ERASE &&
-		    (start != flash_page_to_addr(first_page)
-		     || end != flash_page_to_addr(first_page + num_pages))) {
-			fprintf(stderr, "Specified start & length are invalid (must be page aligned)\n");
-			ret = 1;
-			goto close;
-		}
-
-		s_err = stm32_erase_memory(stm, first_page, num_pages);
-		if (s_err != STM32_ERR_OK) {
-			fprintf(stderr, "Failed to erase memory\n");
-			ret = 1;
-			goto close;
-		}
-		ret = 0;
+		ret = stm32flash_erase(session, &range);
 	} else if (action == ACT_WRITE_UNPROTECT) {
 		fprintf(diag, "Write-unprotecting flash\n");
 		/* the device automatically performs a reset after the sending the ACK */
 		reset_flag = 0;
-		s_err = stm32_wunprot_memory(stm);
-		if (s_err != STM32_ERR_OK) {
-			fprintf(stderr, "Failed to write-unprotect flash\n");
-			goto close;
-		}
-		fprintf(diag,	"Done.\n");
-		ret = 0;
+		ret = stm32flash_write_unprotect(session);
+		if (!ret)
+			fprintf(diag,	"Done.\n");
 	} else if (action == ACT_WRITE) {
 		fprintf(diag, "Write to memory\n");
-
-		unsigned int offset = 0;
-		unsigned int r;
-		unsigned int size;
-		unsigned int max_wlen, max_rlen;
-
-		max_wlen = port_opts.tx_frame_max - 2;	/* skip len and crc */
-		max_wlen &= ~3;	/* 32 bit aligned */
-
-		max_rlen = port_opts.rx_frame_max;
-		max_rlen = max_rlen < max_wlen ? max_rlen : max_wlen;
-
-		/* Assume data from stdin is whole device */
-		if (use_stdinout)
-			size = end - start;
-		else
-			size = parser->size(p_st);
-
-		// TODO: It is possible to write to non-page boundaries, by reading out flash
-		//       from partial pages and combining with the input data
-		// if ((start % stm->dev->fl_ps[i]) != 0 || (end % stm->dev->fl_ps[i]) != 0) {
-		//	fprintf(stderr, "Specified start & length are invalid (must be page aligned)\n");
-		//	goto close;
-		// }
-
-		// TODO: If writes are not page aligned, we should probably read out existing flash
-		//       contents first, so it can be preserved and combined with new data
-		if (!no_erase && num_pages) {
-			fprintf(diag, "Erasing memory\n");
-			s_err = stm32_erase_memory(stm, first_page, num_pages);
-			if (s_err != STM32_ERR_OK) {
-				fprintf(stderr, "Failed to erase memory\n");
-				goto close;
-			}
-		}
-
 		fflush(diag);
-		addr = start;
-		while(addr < end && offset < size) {
-			uint32_t left	= end - addr;
-			len		= max_wlen > left ? left : max_wlen;
-			len		= len > size - offset ? size - offset : len;
-
-			if (parser->read(p_st, buffer, &len) != PARSER_ERR_OK)
-				goto close;
-
-			if (len == 0) {
-				if (use_stdinout) {
-					break;
-				} else {
-					fprintf(stderr, "Failed to read input file\n");
-					goto close;
-				}
-			}
-
-			again:
-			s_err = stm32_write_memory(stm, addr, buffer, len);
-			if (s_err != STM32_ERR_OK) {
-				fprintf(stderr, "Failed to write memory at address 0x%08x\n", addr);
-				goto close;
-			}
-
-			if (verify) {
-				uint8_t compare[len];
-				unsigned int offset, rlen;
-
-				offset = 0;
-				while (offset < len) {
-					rlen = len - offset;
-					rlen = rlen < max_rlen ? rlen : max_rlen;
-					s_err = stm32_read_memory(stm, addr + offset, compare + offset, rlen);
-					if (s_err != STM32_ERR_OK) {
-						fprintf(stderr, "Failed to read memory at address 0x%08x\n", addr + offset);
-						goto close;
-					}
-					offset += rlen;
-				}
-
-				for(r = 0; r < len; ++r)
-					if (buffer[r] != compare[r]) {
-						if (failed == retry) {
-							fprintf(stderr, "Failed to verify at address 0x%08x, expected 0x%02x and found 0x%02x\n",
-								(uint32_t)(addr + r),
-								buffer [r],
-								compare[r]
-							);
-							goto close;
-						}
-						++failed;
-						goto again;
-					}
-
-				failed = 0;
-			}
-
-			addr	+= len;
-			offset	+= len;
-
-			fprintf(diag,
-				"\rWrote %saddress 0x%08x (%.2f%%) ",
-				verify ? "and verified " : "",
-				addr,
-				(100.0f / size) * offset
-			);
-			fflush(diag);
-
-		}
-
-		fprintf(diag,	"Done.\n");
-		ret = 0;
-		goto close;
+		ret = stm32flash_write(session, image, &range,
+				       (verify ? STM32FLASH_VERIFY : 0) |
+				       (no_erase ? STM32FLASH_NO_ERASE : 0) |
+				       (diff_write ? STM32FLASH_DIFF : 0) | sparse);
 	} else if (action == ACT_CRC) {
 		uint32_t crc_val = 0;
 
 		fprintf(diag, "CRC computation\n");
-
-		s_err = stm32_crc_wrapper(stm, start, end - start, &crc_val);
-		if (s_err != STM32_ERR_OK) {
-			fprintf(stderr, "Failed to read CRC\n");
-			goto close;
-		}
-		fprintf(diag, "CRC(0x%08x-0x%08x) = 0x%08x\n", start, end,
-			crc_val);
-		ret = 0;
-		goto close;
+		ret = stm32flash_crc(session, range.start, range.end, &crc_val);
+		if (!ret)
+			fprintf(diag, "CRC(0x%08x-0x%08x) = 0x%08x\n",
+				range.start, range.end, crc_val);
 	} else
 		ret = 0;
 
 close:
-	if (stm && exec_flag && ret == 0) {
+	if (session && exec_flag && ret == 0) {
 		if (execute == 0)
-			execute = stm->dev->fl_start;
+			execute = stm32flash_target(session)->dev->fl_start;
 
 		fprintf(diag, "\nStarting execution at address 0x%08x... ", execute);
 		fflush(diag);
-		if (stm32_go(stm, execute) == STM32_ERR_OK) {
+		if (stm32flash_go(session, execute) == 0) {
 			reset_flag = 0;
 			fprintf(diag, "done.\n");
 		} else
 			fprintf(diag, "failed.\n");
 	}
 
-	if (stm && reset_flag) {
+	if (session && reset_flag) {
 		fprintf(diag, "\nResetting device... \n");
 		fflush(diag);
-		if (init_bl_exit(stm, port, gpio_seq)) {
+		if (stm32flash_reset(session)) {
 			ret = 1;
 			fprintf(diag, "Reset failed.\n");
 		} else
 			fprintf(diag, "Reset done.\n");
-	} else if (port) {
+	} else if (session) {
 		/* Always run exit sequence if present */
-		if (gpio_seq && strchr(gpio_seq, ':'))
-			ret = gpio_bl_exit(port, gpio_seq) || ret;
+		ret = stm32flash_gpio_exit(session) || ret;
 	}
 
+	if (session && stats_format >= 0)
+		stm32_stats_print(stm32flash_target(session), stderr, stats_format);
+	if (session && ret)
+		stm32flash_dump_trace(session);
 	if (p_st  ) parser->close(p_st);
-	if (stm   ) stm32_close  (stm);
-	if (port)
-		port->close(port);
+	stm32flash_close(session);
+	stm32flash_image_free(image);
 
 	fprintf(diag, "\n");
 	return ret;
@@ -667,15 +377,15 @@ int parse_options(int argc, char *argv[])
 	int c;
 	char *pLen;
 
-	while ((c = getopt(argc, argv, "a:b:m:r:w:e:vn:g:jkfcChuos:S:F:i:R")) != -1) {
+	while ((c = getopt(argc, argv, "a:b:m:r:w:e:vn:g:jkfzcChuos:S:F:i:RDT:X:L:U:P:")) != -1) {
 		switch(c) {
 			case 'a':
-				port_opts.bus_addr = strtoul(optarg, NULL, 0);
+				opts.port.bus_addr = strtoul(optarg, NULL, 0);
 				break;
 
 			case 'b':
-				port_opts.baudRate = serial_get_baud(strtoul(optarg, NULL, 0));
-				if (port_opts.baudRate == SERIAL_BAUD_INVALID) {
+				opts.port.baudRate = serial_get_baud(strtoul(optarg, NULL, 0));
+				if (opts.port.baudRate == SERIAL_BAUD_INVALID) {
 					serial_baud_t baudrate;
 					fprintf(stderr,	"Invalid baud rate, valid options are:\n");
 					for (baudrate = SERIAL_BAUD_1200; baudrate != SERIAL_BAUD_INVALID; ++baudrate)
@@ -692,7 +402,7 @@ int parse_options(int argc, char *argv[])
 					fprintf(stderr, "Invalid serial mode\n");
 					return 1;
 				}
-				port_opts.serial_mode = optarg;
+				opts.port.serial_mode = optarg;
 				break;
 
 			case 'r':
@@ -703,9 +413,11 @@ int parse_options(int argc, char *argv[])
 				}
 				action = (c == 'r') ? ACT_READ : ACT_WRITE;
 				filename = optarg;
+				/* stdin is written as HEX if it starts as HEX */
 				if (filename[0] == '-' && filename[1] == '\0') {
 					use_stdinout = 1;
-					force_binary = 1;
+					if (c == 'r')
+						force_binary = 1;
 				}
 				break;
 			case 'e':
@@ -757,8 +469,49 @@ int parse_options(int argc, char *argv[])
 				verify = 1;
 				break;
 
+			case 'D':
+				diff_write = 1;
+				break;
+
+			case 'T':
+				if (parse_timeouts(optarg))
+					return 1;
+				break;
+
+			case 'L':
+				opts.trace_file = optarg;
+				pLen = strrchr(optarg, ',');
+				if (pLen) {
+					*pLen++ = '\0';
+					opts.trace_ring = strtoul(pLen, NULL, 0) * 1024;
+					if (opts.trace_ring < 1024) {
+						fprintf(stderr, "ERROR: Invalid flight recorder size \"%s\"\n", pLen);
+						return 1;
+					}
+				}
+				break;
+
+			case 'U':
+				server_path = optarg;
+				break;
+
+			case 'P':
+				opts.profile_file = optarg;
+				break;
+
+			case 'X':
+				if (!strcmp(optarg, "text"))
+					stats_format = 0;
+				else if (!strcmp(optarg, "json"))
+					stats_format = 1;
+				else {
+					fprintf(stderr, "ERROR: Invalid statistics format \"%s\", use \"text\" or \"json\"\n", optarg);
+					return 1;
+				}
+				break;
+
 			case 'n':
-				retry = strtoul(optarg, NULL, 0);
+				opts.retry = strtoul(optarg, NULL, 0);
 				break;
 
 			case 'g':
@@ -793,41 +546,45 @@ int parse_options(int argc, char *argv[])
 				}
 				break;
 			case 'F':
-				port_opts.rx_frame_max = strtoul(optarg, &pLen, 0);
+				opts.port.rx_frame_max = strtoul(optarg, &pLen, 0);
 				if (*pLen == ':') {
 					pLen++;
-					port_opts.tx_frame_max = strtoul(pLen, NULL, 0);
+					opts.port.tx_frame_max = strtoul(pLen, NULL, 0);
 				}
-				if (port_opts.rx_frame_max < 0
-				    || port_opts.tx_frame_max < 0) {
+				if (opts.port.rx_frame_max < 0
+				    || opts.port.tx_frame_max < 0) {
 					fprintf(stderr, "ERROR: Invalid negative value for option -F\n");
 					return 1;
 				}
-				if (port_opts.rx_frame_max == 0)
-					port_opts.rx_frame_max = STM32_MAX_RX_FRAME;
-				if (port_opts.tx_frame_max == 0)
-					port_opts.tx_frame_max = STM32_MAX_TX_FRAME;
-				if (port_opts.rx_frame_max < 20
-				    || port_opts.tx_frame_max < 6) {
+				if (opts.port.rx_frame_max == 0)
+					opts.port.rx_frame_max = STM32_MAX_RX_FRAME;
+				if (opts.port.tx_frame_max == 0)
+					opts.port.tx_frame_max = STM32_MAX_TX_FRAME;
+				if (opts.port.rx_frame_max < 20
+				    || opts.port.tx_frame_max < 6) {
 					fprintf(stderr, "ERROR: current code cannot work with small frames.\n");
 					fprintf(stderr, "min(RX) = 20, min(TX) = 6\n");
 					return 1;
 				}
-				if (port_opts.rx_frame_max > STM32_MAX_RX_FRAME) {
+				if (opts.port.rx_frame_max > STM32_MAX_RX_FRAME) {
 					fprintf(stderr, "WARNING: Ignore RX length in option -F\n");
-					port_opts.rx_frame_max = STM32_MAX_RX_FRAME;
+					opts.port.rx_frame_max = STM32_MAX_RX_FRAME;
 				}
-				if (port_opts.tx_frame_max > STM32_MAX_TX_FRAME) {
+				if (opts.port.tx_frame_max > STM32_MAX_TX_FRAME) {
 					fprintf(stderr, "WARNING: Ignore TX length in option -F\n");
-					port_opts.tx_frame_max = STM32_MAX_TX_FRAME;
+					opts.port.tx_frame_max = STM32_MAX_TX_FRAME;
 				}
 				break;
 			case 'f':
 				force_binary = 1;
 				break;
 
+			case 'z':
+				skip_erased = 1;
+				break;
+
 			case 'c':
-				init_flag = 0;
+				opts.init = 0;
 				break;
 
 			case 'h':
@@ -835,7 +592,7 @@ int parse_options(int argc, char *argv[])
 				exit(0);
 
 			case 'i':
-				gpio_seq = optarg;
+				opts.gpio_seq = optarg;
 				break;
 
 			case 'R':
@@ -853,36 +610,85 @@ int parse_options(int argc, char *argv[])
 	}
 
 	for (c = optind; c < argc; ++c) {
-		if (port_opts.device) {
+		if (opts.port.device) {
 			fprintf(stderr, "ERROR: Invalid parameter specified\n");
 			show_help(argv[0]);
 			return 1;
 		}
-		port_opts.device = argv[c];
+		opts.port.device = argv[c];
 	}
 
-	if (port_opts.device == NULL) {
+	if (opts.port.device == NULL) {
 		fprintf(stderr, "ERROR: Device not specified\n");
 		show_help(argv[0]);
 		return 1;
 	}
 
+	if (server_path && (action != ACT_NONE || exec_flag || reset_flag)) {
+		fprintf(stderr, "ERROR: Invalid usage, -U can't be combined with -r, -w, -C, -u, -j, -k, -o, -g or -R\n");
+		show_help(argv[0]);
+		return 1;
+	}
+
 	if ((action != ACT_WRITE) && verify) {
 		fprintf(stderr, "ERROR: Invalid usage, -v is only valid when writing\n");
 		show_help(argv[0]);
 		return 1;
 	}
 
+	if ((action != ACT_WRITE) && diff_write) {
+		fprintf(stderr, "ERROR: Invalid usage, -D is only valid when writing\n");
+		show_help(argv[0]);
+		return 1;
+	}
+
+	return 0;
+}
+
+/* parse list "class=ms,...,adaptive" of option -T */
+int parse_timeouts(char *str)
+{
+	static const char *names[STM32_TMO_NUM] = {
+		[STM32_TMO_WRITE]	= "write",
+		[STM32_TMO_PAGE_ERASE]	= "erase",
+		[STM32_TMO_MASS_ERASE]	= "mass",
+		[STM32_TMO_PROTECT]	= "prot",
+	};
+	char *tok, *val, *end;
+	int i;
+
+	for (tok = strtok(str, ","); tok; tok = strtok(NULL, ",")) {
+		if (!strcmp(tok, "adaptive")) {
+			opts.adaptive_timeout = 1;
+			continue;
+		}
+		val = strchr(tok, '=');
+		if (val)
+			*val++ = '\0';
+		for (i = 0; i < STM32_TMO_NUM; i++)
+			if (!strcmp(tok, names[i]))
+				break;
+		if (i == STM32_TMO_NUM || !val || !*val) {
+			fprintf(stderr, "ERROR: Invalid timeout \"%s\" in option -T\n", tok);
+			return 1;
+		}
+		opts.ack_timeout[i] = strtoul(val, &end, 0);
+		if (*end || !opts.ack_timeout[i]) {
+			fprintf(stderr, "ERROR: Invalid timeout value \"%s\" in option -T\n", val);
+			return 1;
+		}
+	}
 	return 0;
 }
 
 void show_help(char *name) {
 	fprintf(stderr,
-		"Usage: %s [-bvngfhc] [-[rw] filename] [tty_device | i2c_device]\n"
+		"Usage: %s [-bvDngfhc] [-[rw] filename] [tty_device | i2c_device]\n"
 		"	-a bus_address	Bus address (e.g. for I2C port)\n"
 		"	-b rate		Baud rate (default 57600)\n"
 		"	-m mode		Serial port mode (default 8e1)\n"
-		"	-r filename	Read flash to file (or - stdout)\n"
+		"	-r filename	Read flash to file (or - stdout), as Intel HEX\n"
+		"			if filename ends with .hex\n"
 		"	-w filename	Write flash from file (or - stdout)\n"
 		"	-C		Compute CRC of flash content\n"
 		"	-u		Disable the flash write-protection\n"
@@ -891,13 +697,30 @@ void show_help(char *name) {
 		"	-o		Erase only\n"
 		"	-e n		Only erase n pages before writing the flash\n"
 		"	-v		Verify writes\n"
+		"	-D		Differential write, only erase and write the pages\n"
+		"			whose content differs from the file\n"
 		"	-n count	Retry failed writes up to count times (default 10)\n"
 		"	-g address	Start execution at specified address (0 = flash start)\n"
 		"	-S address[:length]	Specify start address and optionally length for\n"
 		"	                   	read/write/erase operations\n"
 		"	-F RX_length[:TX_length]  Specify the max length of RX and TX frame\n"
+		"	-T timeouts	ACK timeouts in ms, comma separated list of\n"
+		"			write=ms, erase=ms (per page), mass=ms, prot=ms\n"
+		"			and 'adaptive' to learn them from the device\n"
+		"	-X format	Print session statistics at exit on stderr,\n"
+		"			format is 'text' or 'json'\n"
+		"	-L file[,KiB]	Record a wire trace of the session in file;\n"
+		"			with KiB, keep only the last KiB in memory and\n"
+		"			write them only if the session fails.\n"
+		"			Replay the trace with device replay:file\n"
+		"	-P file		Cache in file the bootloader profile of the port,\n"
+		"			to skip its discovery in the next sessions\n"
+		"	-U socket	Server mode: keep the target in the bootloader\n"
+		"			and serve requests on the Unix domain socket\n"
+		"			(see SERVER.txt)\n"
 		"	-s start_page	Flash at specified page (0 = flash start)\n"
 		"	-f		Force binary parser\n"
+		"	-z		Leave out the all 0xFF records of the HEX file of -r\n"
 		"	-h		Show this help\n"
 		"	-c		Resume the connection (don't send initial INIT)\n"
 		"			*Baud rate must be kept the same as the first init*\n"
@@ -2,5 +2,5 @@ LOCAL_PATH := $(call my-dir)
 
 include $(CLEAR_VARS)
 LOCAL_MODULE := libparsers
-LOCAL_SRC_FILES := binary.c hex.c
+LOCAL_SRC_FILES := binary.c elf.c hex.c records.c srec.c
 include $(BUILD_STATIC_LIBRARY)
@@ -22,7 +22,11 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <stdint.h>
 #include <stdlib.h>
+#ifndef __WIN32__
+#include <sys/mman.h>
+#endif
 
 #include "binary.h"
 
@@ -30,6 +34,9 @@ typedef struct {
 	int		fd;
 	char		write;
 	struct stat	stat;
+	uint8_t		*data;		/* of segments() */
+	size_t		mapped;		/* length of data if mapped */
+	struct parser_segment seg;
 } binary_t;
 
 void* binary_init() {
@@ -80,12 +87,19 @@ parser_err_t binary_close(void *storage) {
 	binary_t *st = storage;
 
 	if (st->fd) close(st->fd);
+#ifndef __WIN32__
+	if (st->mapped)
+		munmap(st->data, st->mapped);
+	else
+#endif
+		free(st->data);
 	free(st);
 	return PARSER_ERR_OK;
 }
 
 unsigned int binary_size(void *storage) {
 	binary_t *st = storage;
+	if (st->data) return st->seg.len;
 	return st->stat.st_size;
 }
 
@@ -99,12 +113,10 @@ parser_err_t binary_read(void *storage, void *data, unsigned int *len) {
 	ssize_t r;
 	while(left > 0) {
 		r = read(st->fd, d, left);
-		/* If there is no data to read at all, return OK, but with zero read */
-		if (r == 0 && left == *len) {
-			*len = 0;
-			return PARSER_ERR_OK;
-		}
-		if (r <= 0) return PARSER_ERR_SYSTEM;
+		/* At end of file, return OK with what was read, maybe zero */
+		if (r == 0)
+			break;
+		if (r < 0) return PARSER_ERR_SYSTEM;
 		left -= r;
 		d += r;
 	}
@@ -132,6 +144,79 @@ parser_err_t binary_write(void *storage, void *data, unsigned int len) {
 	return PARSER_ERR_OK;
 }
 
+/* a regular file is used in place, from the page cache */
+static int binary_map(binary_t *st) {
+#ifndef __WIN32__
+	void *data;
+
+	if (!st->fd || !S_ISREG(st->stat.st_mode) || st->stat.st_size <= 0)
+		return -1;
+	data = mmap(NULL, st->stat.st_size, PROT_READ, MAP_PRIVATE, st->fd, 0);
+	if (data == MAP_FAILED)
+		return -1;
+#ifdef MADV_SEQUENTIAL
+	madvise(data, st->stat.st_size, MADV_SEQUENTIAL);
+#endif
+	st->data = data;
+	st->mapped = st->stat.st_size;
+	st->seg.len = st->mapped;
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+/* anything else is read in memory; stdin and pipes until EOF */
+static parser_err_t binary_load(binary_t *st) {
+	int regular = st->fd && S_ISREG(st->stat.st_mode);
+	unsigned int alloc, len;
+	uint8_t *data;
+	parser_err_t err;
+
+	alloc = regular ? st->stat.st_size : 64 * 1024;
+	st->data = malloc(alloc ? alloc : 1);
+	if (!st->data) return PARSER_ERR_SYSTEM;
+	st->seg.len = 0;
+	for (;;) {
+		if (st->seg.len == alloc) {
+			if (regular) break;
+			alloc *= 2;
+			data = realloc(st->data, alloc);
+			if (!data) return PARSER_ERR_SYSTEM;
+			st->data = data;
+		}
+		len = alloc - st->seg.len;
+		err = binary_read(st, st->data + st->seg.len, &len);
+		if (err != PARSER_ERR_OK) return err;
+		if (len == 0) break;
+		st->seg.len += len;
+	}
+	/* a regular file changed while read */
+	if (regular && st->seg.len != alloc) return PARSER_ERR_SYSTEM;
+	return PARSER_ERR_OK;
+}
+
+/* the whole file, at address 0 */
+parser_err_t binary_segments(void *storage, const struct parser_segment **seg, unsigned int *nseg) {
+	binary_t *st = storage;
+	parser_err_t err;
+
+	if (st->write) return PARSER_ERR_WRONLY;
+
+	if (!st->data) {
+		if (binary_map(st)) {
+			err = binary_load(st);
+			if (err != PARSER_ERR_OK) return err;
+		}
+		st->seg.addr = 0;
+		st->seg.data = st->data;
+	}
+
+	*seg = &st->seg;
+	*nseg = st->seg.len ? 1 : 0;
+	return PARSER_ERR_OK;
+}
+
 parser_t PARSER_BINARY = {
 	"Raw BINARY",
 	binary_init,
@@ -139,6 +224,8 @@ parser_t PARSER_BINARY = {
 	binary_close,
 	binary_size,
 	binary_read,
-	binary_write
+	binary_write,
+	binary_segments,
+	0
 };
 
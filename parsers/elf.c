@@ -0,0 +1,173 @@
+/*
+  stm32flash - Open Source ST STM32 flash program for *nix
+  Copyright (C) 2026 The stm32flash contributors
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "elf.h"
+#include "records.h"
+#include "../compiler.h"
+
+/*
+ * Only the ELF header and the program headers are read: the loadable
+ * segments point in the mapped file, at their physical (load) address.
+ * Sections, debug information included, are never touched.
+ */
+#define ELF_EHDR_SIZE	52
+#define ELF_PHDR_SIZE	32
+
+#define ELFCLASS32	1
+#define ELFDATA2LSB	1
+#define ET_EXEC		2
+#define EM_ARM		40
+#define PT_LOAD		1
+
+typedef struct {
+	records_file_t		file;
+	int			loaded;
+	struct records		rec;
+} elf_t;
+
+static uint16_t elf_u16(const uint8_t *p) {
+	return p[0] | p[1] << 8;
+}
+
+static uint32_t elf_u32(const uint8_t *p) {
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+void* elf_init() {
+	return calloc(sizeof(elf_t), 1);
+}
+
+static parser_err_t elf_parse(elf_t *st) {
+	const uint8_t *buf = st->file.buf, *ph;
+	size_t len = st->file.len;
+	uint32_t phoff, offset, filesz;
+	unsigned int phentsize, phnum, i;
+
+	if (len < ELF_EHDR_SIZE || memcmp(buf, "\177ELF", 4))
+		return PARSER_ERR_INVALID_FILE;
+
+	if (buf[4] != ELFCLASS32 || buf[5] != ELFDATA2LSB
+	    || elf_u16(buf + 18) != EM_ARM) {
+		fprintf(stderr, "ELF: only 32 bit little endian ARM files are supported\n");
+		return PARSER_ERR_UNSUPPORTED;
+	}
+	if (elf_u16(buf + 16) != ET_EXEC) {
+		fprintf(stderr, "ELF: not an executable file\n");
+		return PARSER_ERR_UNSUPPORTED;
+	}
+
+	phoff = elf_u32(buf + 28);
+	phentsize = elf_u16(buf + 42);
+	phnum = elf_u16(buf + 44);
+	if (phentsize < ELF_PHDR_SIZE || phoff > len
+	    || (len - phoff) / phentsize < phnum) {
+		fprintf(stderr, "ELF: truncated program header table\n");
+		return PARSER_ERR_UNSUPPORTED;
+	}
+
+	for (i = 0, ph = buf + phoff; i < phnum; i++, ph += phentsize) {
+		offset = elf_u32(ph + 4);
+		filesz = elf_u32(ph + 16);
+		/* bss has no data in the file */
+		if (elf_u32(ph) != PT_LOAD || !filesz)
+			continue;
+		if (offset > len || len - offset < filesz) {
+			fprintf(stderr, "ELF: segment %u beyond the end of file\n", i);
+			return PARSER_ERR_UNSUPPORTED;
+		}
+		if (records_add(&st->rec, elf_u32(ph + 12), buf + offset, filesz))
+			return PARSER_ERR_SYSTEM;
+	}
+	return PARSER_ERR_OK;
+}
+
+parser_err_t elf_open(void *storage, const char *filename, const char write) {
+	elf_t *st = storage;
+	parser_err_t err;
+
+	if (write)
+		return PARSER_ERR_RDONLY;
+
+	err = records_file_load(&st->file, filename);
+	if (err != PARSER_ERR_OK)
+		return err;
+	st->loaded = 1;
+	err = elf_parse(st);
+	if (err != PARSER_ERR_OK)
+		return err;
+	err = records_merge(&st->rec);
+	/* the flat view starts at the lowest load address */
+	if (err == PARSER_ERR_OK && st->rec.nseg)
+		st->rec.base = st->rec.seg[0].addr;
+	return err;
+}
+
+parser_err_t elf_close(void *storage) {
+	elf_t *st = storage;
+
+	if (!st)
+		return PARSER_ERR_OK;
+	records_free(&st->rec);
+	if (st->loaded)
+		records_file_free(&st->file);
+	free(st);
+	return PARSER_ERR_OK;
+}
+
+unsigned int elf_size(void *storage) {
+	elf_t *st = storage;
+
+	return records_size(&st->rec);
+}
+
+parser_err_t elf_read(void *storage, void *data, unsigned int *len) {
+	elf_t *st = storage;
+
+	return records_read(&st->rec, data, len);
+}
+
+parser_err_t elf_write(void __unused *storage, void __unused *data,
+		       unsigned int __unused len) {
+	return PARSER_ERR_RDONLY;
+}
+
+parser_err_t elf_segments(void *storage, const struct parser_segment **seg, unsigned int *nseg) {
+	elf_t *st = storage;
+
+	return records_segments(&st->rec, seg, nseg);
+}
+
+parser_t PARSER_ELF = {
+	"ELF",
+	elf_init,
+	elf_open,
+	elf_close,
+	elf_size,
+	elf_read,
+	elf_write,
+	elf_segments,
+	1
+};
@@ -19,204 +19,457 @@
 
 
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 
 #include "hex.h"
+#include "records.h"
 #include "../compiler.h"
 #include "../utils.h"
 
+/*
+ * The writer collects the data in records of HEX_RECLEN bytes, never
+ * across 64 KiB, and formats them in a large buffer written when full.
+ */
+#define HEX_RECLEN	16
+#define HEX_OUTBUF	(64 * 1024)
+
+struct hex_out {
+	int		fd;
+	uint32_t	addr;		/* of the next byte */
+	uint32_t	rec_addr;
+	unsigned int	rec_len;
+	uint8_t		rec[HEX_RECLEN];
+	uint32_t	ela;		/* upper address of the last type 04 */
+	int		ela_valid;
+	int		skip_erased;
+	size_t		len;
+	char		buf[HEX_OUTBUF];
+};
+
 typedef struct {
-	size_t		data_len, offset;
-	uint8_t		*data;
-	uint32_t	base;
+	struct records		rec;
+
+	/* writer, see hex_write_setup() */
+	struct hex_out		*out;
 } hex_t;
 
 void* hex_init() {
 	return calloc(sizeof(hex_t), 1);
 }
 
+/*
+ * Decoder state, kept across the buffers of a stream. The data records
+ * are decoded in place in the segments of "rec", or passed to "emit".
+ */
+struct hex_dec {
+	uint32_t		base;		/* of the data records */
+	int			eof;		/* EOF record seen */
+	struct records		*rec;
+	int			(*emit)(void *arg, uint32_t addr,
+					const uint8_t *data, unsigned int len);
+	void			*arg;
+};
+
+/* longest record: ':', length, address, type, 255 bytes of data, checksum */
+#define HEX_MAXREC	(1 + 2 * (4 + 255 + 1))
+
+struct hex_stream {
+	struct hex_dec		dec;
+	size_t			len;		/* of the partial record in line */
+	uint8_t			line[HEX_MAXREC];
+};
+
+/*
+ * Decode the complete records from *pp, up to end or to the EOF record;
+ * *pp is left at the start of a record cut by the end of the buffer.
+ */
+static parser_err_t hex_parse(struct hex_dec *d, const uint8_t **pp, const uint8_t *end) {
+	uint8_t hdr[4], payload[255], *record, *dst, checksum, bad;
+	unsigned int reclen, address, type, i;
+	const uint8_t *p = *pp, *start;
+
+	while (p < end && !d->eof) {
+		if (*p == '\n' || *p == '\r') {
+			p++;
+			continue;
+		}
+		if (*p != ':')
+			return PARSER_ERR_INVALID_FILE;
+		if (end - p < 11)
+			break;
+		start = p++;
+
+		/* reclen, address and type */
+		bad = 0;
+		checksum = 0;
+		for (i = 0; i < 4; i++, p += 2) {
+			bad |= records_nibble[p[0]] | records_nibble[p[1]];
+			hdr[i] = records_nibble[p[0]] << 4 | records_nibble[p[1]];
+			checksum += hdr[i];
+		}
+		if (bad & 0xf0)
+			return PARSER_ERR_INVALID_FILE;
+		reclen = hdr[0];
+		address = hdr[1] << 8 | hdr[2];
+		type = hdr[3];
+		if ((size_t)(end - p) < 2 * reclen + 2) {
+			p = start;
+			break;
+		}
+
+		record = NULL;
+		switch(type) {
+			/* data record */
+			case 0:
+				if (!d->rec)
+					break;
+				record = records_data(d->rec, d->base + address, reclen);
+				if (!record)
+					return PARSER_ERR_SYSTEM;
+				break;
+
+			/* extended segment address record */
+			case 2:
+			/* extended linear address record */
+			case 4:
+				d->base = 0;
+				break;
+		}
+
+		/* the payload, then the checksum byte */
+		dst = record ? record : payload;
+		for (i = 0; i < reclen; i++, p += 2) {
+			bad |= records_nibble[p[0]] | records_nibble[p[1]];
+			dst[i] = records_nibble[p[0]] << 4 | records_nibble[p[1]];
+			checksum += dst[i];
+		}
+		bad |= records_nibble[p[0]] | records_nibble[p[1]];
+		checksum += records_nibble[p[0]] << 4 | records_nibble[p[1]];
+		if ((bad & 0xf0) || checksum != 0x00)
+			return PARSER_ERR_INVALID_FILE;
+		p += 2;
+
+		if (type == 0 && d->emit
+		    && d->emit(d->arg, d->base + address, payload, reclen))
+			return PARSER_ERR_SYSTEM;
+
+		if (type == 2 || type == 4)
+			for (i = 0; i < reclen; i++)
+				d->base = (d->base << 8) | payload[i];
+
+		switch(type) {
+			/* EOF */
+			case 1:
+				d->eof = 1;
+				break;
+
+			/* address record */
+			case 4:	d->base = d->base << 12;
+				/* fall-through */
+			case 2: d->base = d->base << 4;
+				/* Only assign the program's base address once, and only
+				 * do so if we haven't seen any data records yet.
+				 * If there are any data records before address records,
+				 * the program's base address must be zero.
+				 */
+				if (d->rec && d->rec->base == 0 && d->rec->nseg == 0)
+					d->rec->base = d->base;
+				break;
+		}
+	}
+
+	*pp = p;
+	return PARSER_ERR_OK;
+}
+
+static parser_err_t hex_out_flush(struct hex_out *out) {
+	size_t done;
+	ssize_t r;
+
+	for (done = 0; done < out->len; done += r) {
+		r = write(out->fd, out->buf + done, out->len - done);
+		if (r < 1)
+			return PARSER_ERR_SYSTEM;
+	}
+	out->len = 0;
+	return PARSER_ERR_OK;
+}
+
+/* format a record in the output buffer */
+static void hex_out_record(struct hex_out *out, uint8_t type, uint16_t address,
+			   const uint8_t *data, unsigned int len) {
+	static const char digit[] = "0123456789ABCDEF";
+	uint8_t hdr[4] = { len, address >> 8, address, type };
+	uint8_t checksum = 0;
+	char *p = out->buf + out->len;
+	unsigned int i;
+
+	*p++ = ':';
+	for (i = 0; i < 4; i++) {
+		*p++ = digit[hdr[i] >> 4];
+		*p++ = digit[hdr[i] & 0xf];
+		checksum += hdr[i];
+	}
+	for (i = 0; i < len; i++) {
+		*p++ = digit[data[i] >> 4];
+		*p++ = digit[data[i] & 0xf];
+		checksum += data[i];
+	}
+	checksum = -checksum;
+	*p++ = digit[checksum >> 4];
+	*p++ = digit[checksum & 0xf];
+	*p++ = '\n';
+	out->len = p - out->buf;
+}
+
+/* the pending data record, preceded by an address record if needed */
+static parser_err_t hex_out_data(struct hex_out *out) {
+	unsigned int i, len = out->rec_len;
+	uint8_t ela[2];
+
+	out->rec_len = 0;
+	if (out->skip_erased) {
+		for (i = 0; i < len && out->rec[i] == 0xff; i++);
+		if (i == len)
+			return PARSER_ERR_OK;
+	}
+
+	/* room for two records */
+	if (out->len + 2 * (11 + 2 * HEX_RECLEN + 1) > sizeof(out->buf)
+	    && hex_out_flush(out) != PARSER_ERR_OK)
+		return PARSER_ERR_SYSTEM;
+
+	if (!out->ela_valid || out->rec_addr >> 16 != out->ela) {
+		out->ela = out->rec_addr >> 16;
+		out->ela_valid = 1;
+		ela[0] = out->ela >> 8;
+		ela[1] = out->ela;
+		hex_out_record(out, 4, 0, ela, 2);
+	}
+	hex_out_record(out, 0, out->rec_addr, out->rec, len);
+	return PARSER_ERR_OK;
+}
+
 parser_err_t hex_open(void *storage, const char *filename, const char write) {
 	hex_t *st = storage;
+	struct hex_dec d = { .rec = &st->rec };
+	records_file_t f;
+	const uint8_t *p;
+	parser_err_t err;
+
 	if (write) {
-		return PARSER_ERR_RDONLY;
-	} else {
-		char mark;
-		int fd;
-		uint8_t checksum;
-		unsigned int c, i;
-		uint32_t base = 0;
-		unsigned int last_address = 0x0;
-
-		fd = open(filename, O_RDONLY);
-		if (fd < 0)
+		st->out = calloc(1, sizeof(*st->out));
+		if (!st->out)
 			return PARSER_ERR_SYSTEM;
+		if (filename[0] == '-' && filename[1] == '\0')
+			st->out->fd = 1;
+		else
+			st->out->fd = open(filename,
+#ifndef __WIN32__
+				O_WRONLY | O_CREAT | O_TRUNC,
+				S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH
+#else
+				O_WRONLY | O_CREAT | O_TRUNC | O_BINARY,
+				0
+#endif
+			);
+		return st->out->fd == -1 ? PARSER_ERR_SYSTEM : PARSER_ERR_OK;
+	}
 
-		/* read in the file */
-
-		while(read(fd, &mark, 1) != 0) {
-			if (mark == '\n' || mark == '\r') continue;
-			if (mark != ':')
-				return PARSER_ERR_INVALID_FILE;
-
-			char buffer[9];
-			unsigned int reclen, address, type;
-			uint8_t *record = NULL;
-
-			/* get the reclen, address, and type */
-			buffer[8] = 0;
-			if (read(fd, &buffer, 8) != 8) return PARSER_ERR_INVALID_FILE;
-			if (sscanf(buffer, "%2x%4x%2x", &reclen, &address, &type) != 3) {
-				close(fd);
-				return PARSER_ERR_INVALID_FILE;
-			}
-
-			/* setup the checksum */
-			checksum =
-				reclen +
-				((address & 0xFF00) >> 8) +
-				((address & 0x00FF) >> 0) +
-				type;
-
-			switch(type) {
-				/* data record */
-				case 0:
-					c = address - last_address;
-					st->data = realloc(st->data, st->data_len + c + reclen);
-
-					/* if there is a gap, set it to 0xff and increment the length */
-					if (c > 0) {
-						memset(&st->data[st->data_len], 0xff, c);
-						st->data_len += c;
-					}
-
-					last_address = address + reclen;
-					record = &st->data[st->data_len];
-					st->data_len += reclen;
-					break;
+	err = records_file_load(&f, filename);
+	if (err != PARSER_ERR_OK)
+		return err;
+	p = f.buf;
+	err = hex_parse(&d, &p, f.buf + f.len);
+	/* a record cut by the end of file */
+	if (err == PARSER_ERR_OK && p != f.buf + f.len && !d.eof)
+		err = PARSER_ERR_INVALID_FILE;
+	records_file_free(&f);
+	if (err != PARSER_ERR_OK)
+		return err;
+	return records_merge(&st->rec);
+}
 
-				/* extended segment address record */
-				case 2:
-					base = 0;
-					break;
+void hex_write_setup(void *storage, uint32_t addr, int skip_erased) {
+	hex_t *st = storage;
 
-				/* extended linear address record */
-				case 4:
-					base = 0;
-					break;
-			}
-
-			buffer[2] = 0;
-			for(i = 0; i < reclen; ++i) {
-				if (read(fd, &buffer, 2) != 2 || sscanf(buffer, "%2x", &c) != 1) {
-					close(fd);
-					return PARSER_ERR_INVALID_FILE;
-				}
-
-				/* add the byte to the checksum */
-				checksum += c;
-
-				switch(type) {
-					case 0:
-						if (record != NULL) {
-							record[i] = c;
-						} else {
-							return PARSER_ERR_INVALID_FILE;
-						}
-						break;
-
-					case 2:
-					case 4:
-						base = (base << 8) | c;
-						break;
-				}
-			}
-
-			/* read, scan, and verify the checksum */
-			if (
-				read(fd, &buffer, 2 ) != 2 ||
-				sscanf(buffer, "%2x", &c) != 1 ||
-				(uint8_t)(checksum + c) != 0x00
-			) {
-				close(fd);
-				return PARSER_ERR_INVALID_FILE;
-			}
-
-			switch(type) {
-				/* EOF */
-				case 1:
-					close(fd);
-					return PARSER_ERR_OK;
-
-				/* address record */
-				case 4:	base = base << 12;
-					/* fall-through */
-				case 2: base = base << 4;
-					/* Reset last_address since our base changed */
-					last_address = 0;
-
-					/* Only assign the program's base address once, and only
-					 * do so if we haven't seen any data records yet.
-					 * If there are any data records before address records,
-					 * the program's base address must be zero.
-					 */
-					if (st->base == 0 && st->data_len == 0) {
-						st->base = base;
-						break;
-					}
-
-					/* we cant cope with files out of order */
-					if (base < st->base) {
-						close(fd);
-						return PARSER_ERR_INVALID_FILE;
-					}
-
-					/* if there is a gap, enlarge and fill with 0xff */
-					unsigned int len = base - st->base;
-					if (len > st->data_len) {
-						st->data = realloc(st->data, len);
-						memset(&st->data[st->data_len], 0xff, len - st->data_len);
-						st->data_len = len;
-					}
-					break;
-			}
-		}
+	st->out->addr = addr;
+	st->out->skip_erased = skip_erased;
+}
 
-		close(fd);
-		return PARSER_ERR_OK;
+int hex_filename(const char *filename) {
+	const char *ext = strrchr(filename, '.');
+
+	return ext && (!strcasecmp(ext, ".hex") || !strcasecmp(ext, ".ihex"));
+}
+
+int hex_sniff(const uint8_t *buf, size_t len) {
+	const uint8_t *p = buf, *end = buf + len;
+	uint8_t checksum = 0, bad = 0;
+	unsigned int n;
+
+	while (p < end && (*p == '\n' || *p == '\r'))
+		p++;
+	if (p == end)
+		return -1;
+	if (*p++ != ':')
+		return 0;
+	if (end - p < 2)
+		return -1;
+	bad = records_nibble[p[0]] | records_nibble[p[1]];
+	n = 5 + (records_nibble[p[0]] << 4 | records_nibble[p[1]]);
+	if (bad & 0xf0)
+		return 0;
+	if ((size_t)(end - p) < 2 * n)
+		return -1;
+	for (; n; n--, p += 2) {
+		bad |= records_nibble[p[0]] | records_nibble[p[1]];
+		checksum += records_nibble[p[0]] << 4 | records_nibble[p[1]];
 	}
+	return !(bad & 0xf0) && checksum == 0x00;
+}
+
+hex_stream_t *hex_stream_new(int (*emit)(void *arg, uint32_t addr,
+					 const uint8_t *data, unsigned int len),
+			     void *arg) {
+	hex_stream_t *hs;
+
+	hs = calloc(1, sizeof(*hs));
+	if (!hs)
+		return NULL;
+	hs->dec.emit = emit;
+	hs->dec.arg = arg;
+	return hs;
+}
+
+parser_err_t hex_stream_feed(hex_stream_t *hs, const uint8_t *buf, size_t len) {
+	const uint8_t *p;
+	size_t n, used;
+	parser_err_t err;
+
+	/* complete the record cut by the previous buffer */
+	if (hs->len) {
+		n = sizeof(hs->line) - hs->len;
+		n = n < len ? n : len;
+		memcpy(hs->line + hs->len, buf, n);
+		p = hs->line;
+		err = hex_parse(&hs->dec, &p, hs->line + hs->len + n);
+		if (err != PARSER_ERR_OK)
+			return err;
+		used = p - hs->line;
+		if (used < hs->len) {
+			/* still cut, all of buf is in line */
+			hs->len += n;
+			return hs->len == sizeof(hs->line) ? PARSER_ERR_INVALID_FILE
+							   : PARSER_ERR_OK;
+		}
+		buf += used - hs->len;
+		len -= used - hs->len;
+		hs->len = 0;
+	}
+
+	p = buf;
+	err = hex_parse(&hs->dec, &p, buf + len);
+	if (err != PARSER_ERR_OK || hs->dec.eof)
+		return err;
+	hs->len = buf + len - p;
+	memcpy(hs->line, p, hs->len);
+	return PARSER_ERR_OK;
+}
+
+parser_err_t hex_stream_end(hex_stream_t *hs) {
+	return hs->len && !hs->dec.eof ? PARSER_ERR_INVALID_FILE : PARSER_ERR_OK;
+}
+
+int hex_stream_done(const hex_stream_t *hs) {
+	return hs->dec.eof;
+}
+
+void hex_stream_free(hex_stream_t *hs) {
+	free(hs);
 }
 
 parser_err_t hex_close(void *storage) {
 	hex_t *st = storage;
-	if (st) free(st->data);
+	struct hex_out *out;
+	parser_err_t err = PARSER_ERR_OK;
+
+	if (!st)
+		return PARSER_ERR_OK;
+
+	out = st->out;
+	if (out && out->fd != -1) {
+		if (out->rec_len)
+			err = hex_out_data(out);
+		if (err == PARSER_ERR_OK)
+			err = hex_out_flush(out);
+		if (err == PARSER_ERR_OK) {
+			hex_out_record(out, 1, 0, NULL, 0);
+			err = hex_out_flush(out);
+		}
+		if (out->fd != 1 && close(out->fd) && err == PARSER_ERR_OK)
+			err = PARSER_ERR_SYSTEM;
+	}
+	free(out);
+
+	records_free(&st->rec);
 	free(st);
-	return PARSER_ERR_OK;
+	return err;
 }
 
 unsigned int hex_size(void *storage) {
 	hex_t *st = storage;
-	return st->data_len;
+
+	return records_size(&st->rec);
 }
 
+/* from the base address, the gaps between the segments read as 0xFF */
 parser_err_t hex_read(void *storage, void *data, unsigned int *len) {
 	hex_t *st = storage;
-	unsigned int left = st->data_len - st->offset;
-	unsigned int get  = left > *len ? *len : left;
 
-	memcpy(data, &st->data[st->offset], get);
-	st->offset += get;
+	return records_read(&st->rec, data, len);
+}
 
-	*len = get;
-	return PARSER_ERR_OK;
+parser_err_t hex_segments(void *storage, const struct parser_segment **seg, unsigned int *nseg) {
+	hex_t *st = storage;
+
+	return records_segments(&st->rec, seg, nseg);
 }
 
-parser_err_t hex_write(void __unused *storage, void __unused *data, unsigned int __unused len) {
-	return PARSER_ERR_RDONLY;
+parser_err_t hex_write(void *storage, void *data, unsigned int len) {
+	hex_t *st = storage;
+	struct hex_out *out = st->out;
+	const uint8_t *d = data;
+	unsigned int n;
+
+	if (!out)
+		return PARSER_ERR_RDONLY;
+
+	while (len) {
+		if (!out->rec_len)
+			out->rec_addr = out->addr;
+		n = HEX_RECLEN - out->rec_len;
+		n = n < len ? n : len;
+		/* a record does not cross 64 KiB */
+		if (n > 0x10000 - (out->addr & 0xffff))
+			n = 0x10000 - (out->addr & 0xffff);
+		memcpy(out->rec + out->rec_len, d, n);
+		out->rec_len += n;
+		out->addr += n;
+		d += n;
+		len -= n;
+		if ((out->rec_len == HEX_RECLEN || !(out->addr & 0xffff))
+		    && hex_out_data(out) != PARSER_ERR_OK)
+			return PARSER_ERR_SYSTEM;
+	}
+	return PARSER_ERR_OK;
 }
 
 parser_t PARSER_HEX = {
@@ -226,6 +479,8 @@ parser_t PARSER_HEX = {
 	hex_close,
 	hex_size,
 	hex_read,
-	hex_write
+	hex_write,
+	hex_segments,
+	1
 };
 
@@ -23,5 +23,42 @@
 
 #include "parser.h"
 
+#include <stddef.h>
+#include <stdint.h>
+
 extern parser_t PARSER_HEX;
+
+/*
+ * For a file open for write: address of the first byte written, and if
+ * the records of all 0xFF are left out. Default 0 and no.
+ */
+void hex_write_setup(void *storage, uint32_t addr, int skip_erased);
+
+/* the file name has the extension of an Intel HEX file */
+int hex_filename(const char *filename);
+
+/*
+ * The data starts with a valid record, after any empty line: 1 yes,
+ * 0 no, -1 more data is needed to know.
+ */
+int hex_sniff(const uint8_t *buf, size_t len);
+
+/*
+ * Incremental decoding of a stream that cannot be mapped, e.g. a pipe.
+ * The buffers fed can cut the records anywhere; the data of each record
+ * is passed to emit() as soon as the record is complete, in the order of
+ * the stream. The data after the EOF record is ignored.
+ * feed() returns PARSER_ERR_INVALID_FILE on a bad record and
+ * PARSER_ERR_SYSTEM if emit() returned not 0; end() fails on a last record
+ * cut by the end of the stream. done() tells that the EOF record was seen.
+ */
+typedef struct hex_stream hex_stream_t;
+
+hex_stream_t *hex_stream_new(int (*emit)(void *arg, uint32_t addr,
+					 const uint8_t *data, unsigned int len),
+			     void *arg);
+parser_err_t hex_stream_feed(hex_stream_t *hs, const uint8_t *buf, size_t len);
+parser_err_t hex_stream_end(hex_stream_t *hs);
+int hex_stream_done(const hex_stream_t *hs);
+void hex_stream_free(hex_stream_t *hs);
 #endif
@@ -21,15 +21,26 @@
 #ifndef _H_PARSER
 #define _H_PARSER
 
+#include <stdint.h>
+
 enum parser_err {
 	PARSER_ERR_OK,
 	PARSER_ERR_SYSTEM,
 	PARSER_ERR_INVALID_FILE,
 	PARSER_ERR_WRONLY,
-	PARSER_ERR_RDONLY
+	PARSER_ERR_RDONLY,
+	PARSER_ERR_OVERLAP,
+	PARSER_ERR_UNSUPPORTED
 };
 typedef enum   parser_err parser_err_t;
 
+/* data of the file at an address, see segments() */
+struct parser_segment {
+	uint32_t	addr;
+	uint32_t	len;
+	const uint8_t	*data;
+};
+
 struct parser {
 	const char *name;
 	void*        (*init )();							/* initialise the parser */
@@ -38,6 +49,14 @@ struct parser {
 	unsigned int (*size )(void *storage);						/* get the total data size */
 	parser_err_t (*read )(void *storage, void *data, unsigned int *len);		/* read a block of data */
 	parser_err_t (*write)(void *storage, void *data, unsigned int len);		/* write a block of data */
+
+	/*
+	 * v2, for files open for read: all the data, as segments sorted by
+	 * address, pointing in the storage of the parser and valid until
+	 * close. read() and size() give the same data with the gaps as 0xFF.
+	 */
+	parser_err_t (*segments)(void *storage, const struct parser_segment **seg, unsigned int *nseg);
+	int          addressed;	/* the segments are at the addresses of the file, otherwise from 0 */
 };
 typedef struct parser     parser_t;
 
@@ -48,6 +67,8 @@ static inline const char* parser_errstr(parser_err_t err) {
 		case PARSER_ERR_INVALID_FILE: return "Invalid File";
 		case PARSER_ERR_WRONLY      : return "Parser can only write";
 		case PARSER_ERR_RDONLY      : return "Parser can only read";
+		case PARSER_ERR_OVERLAP     : return "Overlapping data";
+		case PARSER_ERR_UNSUPPORTED : return "Unsupported file";
 		default:
 			return "Unknown Error";
 	}
@@ -0,0 +1,341 @@
+/*
+  stm32flash - Open Source ST STM32 flash program for *nix
+  Copyright (C) 2026 The stm32flash contributors
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#ifndef __WIN32__
+#include <sys/mman.h>
+#endif
+
+#include "records.h"
+
+/*
+ * The data of the records is kept as a sorted list of segments, each one
+ * contiguous in a chunk of memory. A segment under construction is the
+ * last data of the current chunk and grows in place; only when the chunk
+ * is full it is moved to a new, larger, chunk.
+ */
+#define RECORDS_CHUNK	(64 * 1024)
+
+struct records_chunk {
+	struct records_chunk	*next;
+	size_t			size, used;
+	uint8_t			data[];
+};
+
+const uint8_t records_nibble[256] = {
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+};
+
+parser_err_t records_file_load(records_file_t *f, const char *filename) {
+	struct stat st;
+	uint8_t *buf;
+	size_t done;
+	ssize_t r;
+	int fd;
+
+	fd = open(filename,
+#ifndef __WIN32__
+		O_RDONLY
+#else
+		O_RDONLY | O_BINARY
+#endif
+	);
+	if (fd < 0)
+		return PARSER_ERR_SYSTEM;
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		return PARSER_ERR_SYSTEM;
+	}
+
+	f->len = st.st_size;
+	f->mapped = 0;
+	if (f->len == 0) {
+		f->buf = NULL;
+		close(fd);
+		return PARSER_ERR_OK;
+	}
+
+#ifndef __WIN32__
+	buf = mmap(NULL, f->len, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (buf != MAP_FAILED) {
+#ifdef MADV_SEQUENTIAL
+		madvise(buf, f->len, MADV_SEQUENTIAL);
+#endif
+		f->buf = buf;
+		f->mapped = 1;
+		close(fd);
+		return PARSER_ERR_OK;
+	}
+#endif
+
+	buf = malloc(f->len);
+	if (!buf) {
+		close(fd);
+		return PARSER_ERR_SYSTEM;
+	}
+	for (done = 0; done < f->len; done += r) {
+		r = read(fd, buf + done, f->len - done);
+		if (r <= 0) {
+			free(buf);
+			close(fd);
+			return PARSER_ERR_SYSTEM;
+		}
+	}
+	f->buf = buf;
+	close(fd);
+	return PARSER_ERR_OK;
+}
+
+void records_file_free(records_file_t *f) {
+#ifndef __WIN32__
+	if (f->mapped) {
+		munmap((void *)f->buf, f->len);
+		return;
+	}
+#endif
+	free((void *)f->buf);
+}
+
+/* a new chunk, full, for len bytes */
+static uint8_t *records_chunk_new(struct records *r, size_t len) {
+	struct records_chunk *c;
+
+	c = malloc(sizeof(*c) + len);
+	if (!c)
+		return NULL;
+	c->size = c->used = len;
+	if (r->chunks) {
+		/* keep the current chunk first */
+		c->next = r->chunks->next;
+		r->chunks->next = c;
+	} else {
+		c->next = NULL;
+		r->chunks = c;
+	}
+	return c->data;
+}
+
+/* make room for len more bytes at the end of the last segment */
+static uint8_t *records_extend(struct records *r, unsigned int len) {
+	struct parser_segment *seg = &r->seg[r->nseg - 1];
+	struct records_chunk *c = r->chunks;
+	uint8_t *end;
+	size_t size;
+
+	if (!c || c->used + len > c->size) {
+		size = 2 * ((size_t)seg->len + len);
+		size = size < RECORDS_CHUNK ? RECORDS_CHUNK : size;
+		if (c && seg->len && seg->data == c->data) {
+			/* the segment is alone in the chunk */
+			c = realloc(c, sizeof(*c) + size);
+			if (!c)
+				return NULL;
+		} else {
+			c = malloc(sizeof(*c) + size);
+			if (!c)
+				return NULL;
+			if (seg->len)
+				memcpy(c->data, seg->data, seg->len);
+			c->next = r->chunks;
+			c->used = seg->len;
+		}
+		c->size = size;
+		r->chunks = c;
+		seg->data = c->data;
+	}
+
+	end = c->data + c->used;
+	c->used += len;
+	seg->len += len;
+	return end;
+}
+
+/* start a new segment at addr */
+static int records_segment_new(struct records *r, uint32_t addr) {
+	struct parser_segment *seg;
+	unsigned int nalloc;
+
+	if (r->nseg == r->nalloc) {
+		nalloc = r->nalloc ? 2 * r->nalloc : 16;
+		seg = realloc(r->seg, nalloc * sizeof(*seg));
+		if (!seg)
+			return -1;
+		r->seg = seg;
+		r->nalloc = nalloc;
+	}
+	seg = &r->seg[r->nseg++];
+	seg->addr = addr;
+	seg->len = 0;
+	seg->data = r->chunks ? r->chunks->data + r->chunks->used : NULL;
+	return 0;
+}
+
+uint8_t *records_data(struct records *r, uint32_t addr, unsigned int len) {
+	struct parser_segment *seg = r->nseg ? &r->seg[r->nseg - 1] : NULL;
+
+	/* any jump starts a new segment, sorted by records_merge() */
+	if ((!seg || addr != seg->addr + seg->len)
+	    && records_segment_new(r, addr))
+		return NULL;
+	return records_extend(r, len);
+}
+
+int records_add(struct records *r, uint32_t addr, const uint8_t *data,
+		uint32_t len) {
+	if (records_segment_new(r, addr))
+		return -1;
+	r->seg[r->nseg - 1].data = data;
+	r->seg[r->nseg - 1].len = len;
+	return 0;
+}
+
+static int records_segment_cmp(const void *a, const void *b) {
+	const struct parser_segment *sa = a, *sb = b;
+
+	return sa->addr < sb->addr ? -1 : sa->addr > sb->addr;
+}
+
+/* the adjacent segments not contiguous in memory are copied in a new chunk */
+parser_err_t records_merge(struct records *r) {
+	struct parser_segment *seg = r->seg, *out;
+	unsigned int i, j, k;
+	size_t len;
+	uint8_t *data;
+
+	for (i = 1; i < r->nseg; i++)
+		if (seg[i].addr < seg[i - 1].addr)
+			break;
+	if (i < r->nseg)
+		qsort(seg, r->nseg, sizeof(*seg), records_segment_cmp);
+
+	out = seg;
+	for (i = 0; i < r->nseg; i = j) {
+		len = seg[i].len;
+		for (j = i + 1; j < r->nseg; j++) {
+			if (seg[j].addr < seg[i].addr + len) {
+				fprintf(stderr, "Overlapping data at address 0x%08x\n",
+					seg[j].addr);
+				return PARSER_ERR_OVERLAP;
+			}
+			if (seg[j].addr > seg[i].addr + len)
+				break;
+			len += seg[j].len;
+		}
+
+		*out = seg[i];
+		for (k = i + 1; k < j; k++)
+			if (seg[k].data != seg[k - 1].data + seg[k - 1].len)
+				break;
+		if (k < j) {
+			data = records_chunk_new(r, len);
+			if (!data)
+				return PARSER_ERR_SYSTEM;
+			for (len = 0, k = i; k < j; len += seg[k++].len)
+				memcpy(data + len, seg[k].data, seg[k].len);
+			out->data = data;
+		}
+		out->len = len;
+		out++;
+	}
+	r->nseg = out - seg;
+
+	/* the flat view starts at the first base, or at data below it */
+	if (r->nseg && seg[0].addr < r->base)
+		r->base = seg[0].addr;
+	return PARSER_ERR_OK;
+}
+
+unsigned int records_size(const struct records *r) {
+	if (!r->nseg)
+		return 0;
+	return r->seg[r->nseg - 1].addr + r->seg[r->nseg - 1].len - r->base;
+}
+
+/* from the base address, the gaps between the segments read as 0xFF */
+parser_err_t records_read(struct records *r, void *data, unsigned int *len) {
+	struct parser_segment *seg;
+	unsigned int size = records_size(r);
+	unsigned int left = size - r->offset;
+	unsigned int get  = left > *len ? *len : left;
+	unsigned int done, n;
+	uint32_t addr;
+	uint8_t *d = data;
+
+	for (done = 0; done < get; done += n) {
+		addr = r->base + r->offset;
+		while (r->cur < r->nseg
+		       && r->seg[r->cur].addr + r->seg[r->cur].len <= addr)
+			r->cur++;
+		seg = &r->seg[r->cur];
+		n = get - done;
+		if (addr < seg->addr) {
+			n = n < seg->addr - addr ? n : seg->addr - addr;
+			memset(d + done, 0xff, n);
+		} else {
+			n = n < seg->addr + seg->len - addr ? n : seg->addr + seg->len - addr;
+			memcpy(d + done, seg->data + addr - seg->addr, n);
+		}
+		r->offset += n;
+	}
+
+	*len = get;
+	return PARSER_ERR_OK;
+}
+
+parser_err_t records_segments(const struct records *r,
+			      const struct parser_segment **seg,
+			      unsigned int *nseg) {
+	*seg = r->seg;
+	*nseg = r->nseg;
+	return PARSER_ERR_OK;
+}
+
+void records_free(struct records *r) {
+	struct records_chunk *c;
+
+	while ((c = r->chunks)) {
+		r->chunks = c->next;
+		free(c);
+	}
+	free(r->seg);
+}
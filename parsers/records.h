@@ -0,0 +1,83 @@
+/*
+  stm32flash - Open Source ST STM32 flash program for *nix
+  Copyright (C) 2026 The stm32flash contributors
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+
+
+#ifndef _PARSER_RECORDS_H
+#define _PARSER_RECORDS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "parser.h"
+
+/*
+ * Common code of the parsers of files of hex records, Intel HEX and
+ * Motorola S-record, also used by the ELF parser for the file and the
+ * segments.
+ * The whole file is mapped, or read in one buffer when it cannot be
+ * mapped, and decoded in place: two table lookups per byte, with the
+ * invalid digits and the checksum checked once per record.
+ */
+
+/* value of the hex digits, 0xff for any other char */
+extern const uint8_t records_nibble[256];
+
+typedef struct {
+	const uint8_t	*buf;
+	size_t		len;
+	int		mapped;
+} records_file_t;
+
+parser_err_t records_file_load(records_file_t *f, const char *filename);
+void records_file_free(records_file_t *f);
+
+/* the decoded data, as sorted segments after records_merge() */
+struct records {
+	struct records_chunk	*chunks;	/* current chunk first */
+	struct parser_segment	*seg;
+	unsigned int		nseg, nalloc;
+	uint32_t		base;		/* address of offset 0 */
+	size_t			offset;		/* of records_read() */
+	unsigned int		cur;		/* segment of offset */
+};
+
+/*
+ * Room for the len bytes of a record at addr, that continues the last
+ * segment or starts a new one. NULL if out of memory.
+ */
+uint8_t *records_data(struct records *r, uint32_t addr, unsigned int len);
+/* a segment of data kept by the caller until records_free(), 0 on success */
+int records_add(struct records *r, uint32_t addr, const uint8_t *data,
+		uint32_t len);
+/*
+ * Once all the records are decoded: sort the segments, fail on overlaps
+ * and merge the adjacent ones. The base is lowered to the first data.
+ */
+parser_err_t records_merge(struct records *r);
+void records_free(struct records *r);
+
+/* the parser_t views, flat from the base or as segments */
+unsigned int records_size(const struct records *r);
+parser_err_t records_read(struct records *r, void *data, unsigned int *len);
+parser_err_t records_segments(const struct records *r,
+			      const struct parser_segment **seg,
+			      unsigned int *nseg);
+
+#endif
@@ -0,0 +1,172 @@
+/*
+  stm32flash - Open Source ST STM32 flash program for *nix
+  Copyright (C) 2026 The stm32flash contributors
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "srec.h"
+#include "records.h"
+#include "../compiler.h"
+
+typedef struct {
+	struct records		rec;
+} srec_t;
+
+/* bytes of address of the record types S0 to S9, 0 for the invalid S4 */
+static const uint8_t srec_addr_len[10] = { 2, 2, 3, 4, 0, 2, 3, 4, 3, 2 };
+
+void* srec_init() {
+	return calloc(sizeof(srec_t), 1);
+}
+
+/*
+ * Data records S1, S2 and S3 are kept; header S0 and counts S5 and S6 are
+ * ignored, only their checksum is verified. A termination record S7, S8 or
+ * S9 ends the file.
+ */
+static parser_err_t srec_parse(srec_t *st, const uint8_t *p, const uint8_t *end) {
+	uint8_t payload[255], *record, *dst, byte, checksum, bad;
+	unsigned int type, count, alen, len, i;
+	uint32_t address;
+
+	while (p < end) {
+		if (*p == '\n' || *p == '\r') {
+			p++;
+			continue;
+		}
+		if (*p != 'S' || end - p < 4)
+			return PARSER_ERR_INVALID_FILE;
+		type = p[1] - '0';
+		if (type > 9 || !srec_addr_len[type])
+			return PARSER_ERR_INVALID_FILE;
+		alen = srec_addr_len[type];
+		p += 2;
+
+		/* count of address, data and checksum bytes */
+		bad = records_nibble[p[0]] | records_nibble[p[1]];
+		count = records_nibble[p[0]] << 4 | records_nibble[p[1]];
+		p += 2;
+		if ((bad & 0xf0) || count < alen + 1
+		    || (size_t)(end - p) < 2 * count)
+			return PARSER_ERR_INVALID_FILE;
+		checksum = count;
+
+		address = 0;
+		for (i = 0; i < alen; i++, p += 2) {
+			bad |= records_nibble[p[0]] | records_nibble[p[1]];
+			byte = records_nibble[p[0]] << 4 | records_nibble[p[1]];
+			address = (address << 8) | byte;
+			checksum += byte;
+		}
+		len = count - alen - 1;
+
+		record = NULL;
+		if (type >= 1 && type <= 3) {
+			record = records_data(&st->rec, address, len);
+			if (!record)
+				return PARSER_ERR_SYSTEM;
+		}
+
+		/* the data, then the checksum byte */
+		dst = record ? record : payload;
+		for (i = 0; i < len; i++, p += 2) {
+			bad |= records_nibble[p[0]] | records_nibble[p[1]];
+			dst[i] = records_nibble[p[0]] << 4 | records_nibble[p[1]];
+			checksum += dst[i];
+		}
+		bad |= records_nibble[p[0]] | records_nibble[p[1]];
+		checksum += records_nibble[p[0]] << 4 | records_nibble[p[1]];
+		if ((bad & 0xf0) || checksum != 0xff)
+			return PARSER_ERR_INVALID_FILE;
+		p += 2;
+
+		if (type >= 7)
+			return PARSER_ERR_OK;
+	}
+
+	return PARSER_ERR_OK;
+}
+
+parser_err_t srec_open(void *storage, const char *filename, const char write) {
+	srec_t *st = storage;
+	records_file_t f;
+	parser_err_t err;
+
+	if (write)
+		return PARSER_ERR_RDONLY;
+
+	err = records_file_load(&f, filename);
+	if (err != PARSER_ERR_OK)
+		return err;
+	err = srec_parse(st, f.buf, f.buf + f.len);
+	records_file_free(&f);
+	if (err != PARSER_ERR_OK)
+		return err;
+	err = records_merge(&st->rec);
+	/* no base address in the file, the flat view starts at the data */
+	if (err == PARSER_ERR_OK && st->rec.nseg)
+		st->rec.base = st->rec.seg[0].addr;
+	return err;
+}
+
+parser_err_t srec_close(void *storage) {
+	srec_t *st = storage;
+
+	if (st)
+		records_free(&st->rec);
+	free(st);
+	return PARSER_ERR_OK;
+}
+
+unsigned int srec_size(void *storage) {
+	srec_t *st = storage;
+
+	return records_size(&st->rec);
+}
+
+parser_err_t srec_read(void *storage, void *data, unsigned int *len) {
+	srec_t *st = storage;
+
+	return records_read(&st->rec, data, len);
+}
+
+parser_err_t srec_write(void __unused *storage, void __unused *data,
+			unsigned int __unused len) {
+	return PARSER_ERR_RDONLY;
+}
+
+parser_err_t srec_segments(void *storage, const struct parser_segment **seg, unsigned int *nseg) {
+	srec_t *st = storage;
+
+	return records_segments(&st->rec, seg, nseg);
+}
+
+parser_t PARSER_SREC = {
+	"Motorola S-record",
+	srec_init,
+	srec_open,
+	srec_close,
+	srec_size,
+	srec_read,
+	srec_write,
+	srec_segments,
+	1
+};
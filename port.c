@@ -19,28 +19,47 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "serial.h"
 #include "port.h"
+#include "utils.h"
 
 
+extern struct port_interface port_sim;
+extern struct port_interface port_replay;
 extern struct port_interface port_serial;
 extern struct port_interface port_i2c;
 
 static struct port_interface *ports[] = {
+	&port_sim,
+	&port_replay,
 	&port_serial,
 	&port_i2c,
 	NULL,
 };
 
 
+/*
+ * Probe the interfaces in turn. The returned port is a private copy of the
+ * interface, so more ports of the same kind can be open at once; free() it
+ * after port->close().
+ */
 port_err_t port_open(struct port_options *ops, struct port_interface **outport)
 {
 	int ret;
-	static struct port_interface **port;
+	struct port_interface **port, *p;
+
+	p = malloc(sizeof(*p));
+	if (!p) {
+		fprintf(stderr, "Out of memory\n");
+		return PORT_ERR_UNKNOWN;
+	}
 
 	for (port = ports; *port; port++) {
-		ret = (*port)->open(*port, ops);
+		*p = **port;
+		ret = p->open(p, ops);
 		if (ret == PORT_ERR_NODEV)
 			continue;
 		if (ret == PORT_ERR_OK)
@@ -51,9 +70,64 @@ port_err_t port_open(struct port_options *ops, struct port_interface **outport)
 	if (*port == NULL) {
 		fprintf(stderr, "Cannot handle device \"%s\"\n",
 			ops->device);
+		free(p);
 		return PORT_ERR_UNKNOWN;
 	}
 
-	*outport = *port;
+	*outport = p;
 	return PORT_ERR_OK;
 }
+
+/*
+ * Read with an absolute deadline, in ms from get_time_ms().
+ * Interfaces without native support retry the read until the deadline.
+ */
+port_err_t port_read_deadline(struct port_interface *port, void *buf,
+			      size_t nbyte, uint64_t deadline)
+{
+	port_err_t ret;
+
+	if (port->read_deadline)
+		return port->read_deadline(port, buf, nbyte, deadline);
+
+	do {
+		ret = port->read(port, buf, nbyte);
+	} while (ret == PORT_ERR_TIMEDOUT && get_time_ms() < deadline);
+	return ret;
+}
+
+/*
+ * Scatter-gather write of one frame.
+ * Interfaces without native support get the segments gathered in a
+ * single buffer, as frame oriented interfaces require a single write.
+ */
+port_err_t port_writev(struct port_interface *port,
+		       const struct port_iov *iov, int iovcnt)
+{
+	uint8_t stack_buf[512], *buf = stack_buf;
+	size_t len = 0;
+	port_err_t ret;
+	int i;
+
+	if (port->writev)
+		return port->writev(port, iov, iovcnt);
+
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].len;
+	if (len > sizeof(stack_buf)) {
+		buf = malloc(len);
+		if (!buf)
+			return PORT_ERR_UNKNOWN;
+	}
+
+	len = 0;
+	for (i = 0; i < iovcnt; i++) {
+		memcpy(buf + len, iov[i].buf, iov[i].len);
+		len += iov[i].len;
+	}
+	ret = port->write(port, buf, len);
+
+	if (buf != stack_buf)
+		free(buf);
+	return ret;
+}
@@ -45,6 +45,19 @@ struct port_options {
 	int tx_frame_max;
 };
 
+/* one segment of a scatter-gather write */
+struct port_iov {
+	const void *buf;
+	size_t len;
+};
+
+/* statistics of the receive path */
+struct port_stats {
+	unsigned long rx_calls;		/* read requests */
+	unsigned long rx_syscalls;	/* read() and poll() system calls */
+	unsigned long rx_buffered;	/* requests served from RX buffer only */
+};
+
 /*
  * Specify the length of reply for command GET
  * This is helpful for frame-oriented protocols, e.g. i2c, to avoid time
@@ -64,13 +77,24 @@ struct port_interface {
 	port_err_t (*close)(struct port_interface *port);
 	port_err_t (*flush)(struct port_interface *port);
 	port_err_t (*read)(struct port_interface *port, void *buf, size_t nbyte);
+	/* optional, read with absolute deadline in ms (see get_time_ms()) */
+	port_err_t (*read_deadline)(struct port_interface *port, void *buf,
+				    size_t nbyte, uint64_t deadline);
 	port_err_t (*write)(struct port_interface *port, void *buf, size_t nbyte);
+	/* optional, write the segments as a single frame */
+	port_err_t (*writev)(struct port_interface *port,
+			     const struct port_iov *iov, int iovcnt);
 	port_err_t (*gpio)(struct port_interface *port, serial_gpio_t n, int level);
 	const char *(*get_cfg_str)(struct port_interface *port);
 	struct varlen_cmd *cmd_get_reply;
+	struct port_stats stats;
 	void *private;
 };
 
 port_err_t port_open(struct port_options *ops, struct port_interface **outport);
+port_err_t port_writev(struct port_interface *port,
+		       const struct port_iov *iov, int iovcnt);
+port_err_t port_read_deadline(struct port_interface *port, void *buf,
+			      size_t nbyte, uint64_t deadline);
 
 #endif
@@ -0,0 +1,168 @@
+/*
+  stm32flash - Open Source ST STM32 flash program for *nix
+  Copyright (C) 2026 The stm32flash contributors
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "profile.h"
+
+#define PROFILE_LINE_MAX	512
+
+static const char *profile_ws = " \t\r\n";
+
+/* decode "hex" in "buf"; returns 0 on success */
+static int profile_unhex(const char *hex, uint8_t *buf, size_t size)
+{
+	unsigned int val;
+	size_t i, len = strlen(hex);
+
+	if (len % 2 || len / 2 > size)
+		return 1;
+	for (i = 0; i < len / 2; i++) {
+		if (sscanf(hex + 2 * i, "%2x", &val) != 1)
+			return 1;
+		buf[i] = val;
+	}
+	return 0;
+}
+
+/* returns 0 and fills "prof" if "line" holds a valid profile of "key" */
+static int profile_parse(char *line, const char *key,
+			 struct stm32_profile *prof)
+{
+	unsigned long val[4];
+	char *tok, *end;
+	int i;
+
+	tok = strtok(line, profile_ws);
+	if (!tok || strcmp(tok, key))
+		return 1;
+
+	memset(prof, 0, sizeof(*prof));
+	for (i = 0; i < 4; i++) {
+		tok = strtok(NULL, profile_ws);
+		if (!tok)
+			return 1;
+		val[i] = strtoul(tok, &end, 16);
+		if (*end)
+			return 1;
+	}
+	tok = strtok(NULL, profile_ws);
+	if (!tok || profile_unhex(tok, prof->get, sizeof(prof->get)))
+		return 1;
+	/* the reply of GET holds its length */
+	if ((size_t)prof->get[0] + 2 != strlen(tok) / 2)
+		return 1;
+
+	prof->version = val[0];
+	prof->option1 = val[1];
+	prof->option2 = val[2];
+	prof->pid = val[3];
+	prof->valid = 1;
+	return 0;
+}
+
+/* returns 0 if the profile of "key" is found in "file" */
+int profile_load(const char *file, const char *key, struct stm32_profile *prof)
+{
+	char line[PROFILE_LINE_MAX];
+	FILE *f;
+	int ret = 1;
+
+	memset(prof, 0, sizeof(*prof));
+	f = fopen(file, "r");
+	if (!f)
+		return 1;
+	while (ret && fgets(line, sizeof(line), f))
+		if (line[0] != '#')
+			ret = profile_parse(line, key, prof);
+	fclose(f);
+	if (ret)
+		memset(prof, 0, sizeof(*prof));
+	return ret;
+}
+
+/*
+ * Replace, or add, the profile of "key" in "file". The file is written
+ * aside and renamed, so concurrent sessions only see complete files.
+ */
+int profile_save(const char *file, const char *key,
+		 const struct stm32_profile *prof)
+{
+	char line[PROFILE_LINE_MAX], *tmp;
+	size_t len, klen = strlen(key);
+	FILE *in, *out;
+	int i, ret = 1;
+
+	if (strpbrk(key, profile_ws))
+		return 1;
+
+	len = strlen(file) + 16;
+	tmp = malloc(len);
+	if (!tmp)
+		return 1;
+	snprintf(tmp, len, "%s.%d", file, (int)getpid());
+	out = fopen(tmp, "w");
+	if (!out) {
+		perror(tmp);
+		free(tmp);
+		return 1;
+	}
+
+	fprintf(out, "# stm32flash bootloader profiles\n");
+	in = fopen(file, "r");
+	if (in) {
+		while (fgets(line, sizeof(line), in)) {
+			if (line[0] == '#')
+				continue;
+			if (!strncmp(line, key, klen) && strchr(profile_ws, line[klen]))
+				continue;
+			fputs(line, out);
+		}
+		fclose(in);
+	}
+
+	fprintf(out, "%s %02x %02x %02x %04x ", key, prof->version,
+		prof->option1, prof->option2, prof->pid);
+	for (i = 0; i < prof->get[0] + 2; i++)
+		fprintf(out, "%02x", prof->get[i]);
+	fprintf(out, "\n");
+
+	if (fclose(out)) {
+		perror(tmp);
+		goto out;
+	}
+#if defined(__WIN32__)
+	/* rename() does not replace an existing file */
+	remove(file);
+#endif
+	if (rename(tmp, file)) {
+		perror(file);
+		goto out;
+	}
+	ret = 0;
+out:
+	if (ret)
+		remove(tmp);
+	free(tmp);
+	return ret;
+}
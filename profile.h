@@ -0,0 +1,37 @@
+/*
+  stm32flash - Open Source ST STM32 flash program for *nix
+  Copyright (C) 2026 The stm32flash contributors
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+
+#ifndef _H_PROFILE
+#define _H_PROFILE
+
+#include "stm32.h"
+
+/*
+ * Cache of bootloader profiles (see stm32_init_profile()) in a text file,
+ * one line per port:
+ *	key version option1 option2 pid get
+ * with the numbers in hex and "get" the reply of GET as hex string.
+ * The key is the device name of the port, without white space.
+ */
+int profile_load(const char *file, const char *key, struct stm32_profile *prof);
+int profile_save(const char *file, const char *key,
+		 const struct stm32_profile *prof);
+
+#endif
@@ -17,8 +17,10 @@
   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 */
 
+#include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <poll.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -28,21 +30,28 @@
 #include <sys/ioctl.h>
 #include <stdio.h>
 #include <sys/file.h>
+#include <sys/uio.h>
 
 #include "serial.h"
 #include "port.h"
+#include "utils.h"
 
+/* default timeout between received bytes */
 #ifndef TERMIOS_TIMEOUT_MS
 #define TERMIOS_TIMEOUT_MS 500
 #endif
 
-#define TERMIOS_TIMEOUT ((TERMIOS_TIMEOUT_MS)/100)
+/* size of the receive buffer in user space */
+#define RX_BUF_SIZE	4096
 
 struct serial {
 	int fd;
 	struct termios oldtio;
 	struct termios newtio;
 	char setup_str[11];
+	/* data received but not consumed yet is in rx_buf[rx_pos..rx_len) */
+	size_t rx_pos, rx_len;
+	uint8_t rx_buf[RX_BUF_SIZE];
 };
 
 static serial_t *serial_open(const char *device)
@@ -69,9 +78,10 @@ static serial_t *serial_open(const char *device)
 	return h;
 }
 
-static void serial_flush(const serial_t *h)
+static void serial_flush(serial_t *h)
 {
 	tcflush(h->fd, TCIFLUSH);
+	h->rx_pos = h->rx_len = 0;
 }
 
 static void serial_close(serial_t *h)
@@ -192,8 +202,9 @@ static port_err_t serial_setup(serial_t *h, const serial_baud_t baud,
 	if ( port_parity != 0 )
 		h->newtio.c_iflag |= INPCK;
 
+	/* read() never blocks, timeouts are handled with poll() */
 	h->newtio.c_cc[VMIN] = 0;
-	h->newtio.c_cc[VTIME] = TERMIOS_TIMEOUT;	/* in units of 0.1 s */
+	h->newtio.c_cc[VTIME] = 0;
 
 	/* set the settings */
 	serial_flush(h);
@@ -267,30 +278,78 @@ static port_err_t serial_posix_close(struct port_interface *port)
 	return PORT_ERR_OK;
 }
 
-static port_err_t serial_posix_read(struct port_interface *port, void *buf,
-				     size_t nbyte)
+/*
+ * Reads are served from a receive buffer, refilled with all the data
+ * already available in the kernel, so ACK and payload of a reply are
+ * usually consumed with a single read() system call.
+ * When the buffer is empty, poll() for more data until "deadline" (ms,
+ * see get_time_ms()).
+ * A zero deadline means TERMIOS_TIMEOUT_MS between received bytes.
+ */
+static port_err_t serial_posix_read_deadline(struct port_interface *port,
+					     void *buf, size_t nbyte,
+					     uint64_t deadline)
 {
 	serial_t *h;
 	ssize_t r;
+	size_t n;
 	uint8_t *pos = (uint8_t *)buf;
+	struct pollfd pfd;
+	uint64_t now, expire = 0;
+	int syscall = 0;
 
 	h = (serial_t *)port->private;
 	if (h == NULL)
 		return PORT_ERR_UNKNOWN;
 
+	port->stats.rx_calls++;
+	pfd.fd = h->fd;
+	pfd.events = POLLIN;
+
 	while (nbyte) {
-		r = read(h->fd, pos, nbyte);
-		if (r == 0)
-			return PORT_ERR_TIMEDOUT;
-		if (r < 0)
+		if (h->rx_pos < h->rx_len) {
+			n = h->rx_len - h->rx_pos;
+			n = n < nbyte ? n : nbyte;
+			memcpy(pos, h->rx_buf + h->rx_pos, n);
+			h->rx_pos += n;
+			nbyte -= n;
+			pos += n;
+			continue;
+		}
+
+		syscall = 1;
+		port->stats.rx_syscalls++;
+		r = read(h->fd, h->rx_buf, sizeof(h->rx_buf));
+		if (r > 0) {
+			h->rx_pos = 0;
+			h->rx_len = r;
+			expire = 0;
+			continue;
+		}
+		if (r < 0 && errno != EINTR && errno != EAGAIN)
 			return PORT_ERR_UNKNOWN;
 
-		nbyte -= r;
-		pos += r;
+		now = get_time_ms();
+		if (!expire)
+			expire = deadline ? deadline : now + TERMIOS_TIMEOUT_MS;
+		if (now >= expire)
+			return PORT_ERR_TIMEDOUT;
+		port->stats.rx_syscalls++;
+		if (poll(&pfd, 1, expire - now) < 0 && errno != EINTR)
+			return PORT_ERR_UNKNOWN;
 	}
+
+	if (!syscall)
+		port->stats.rx_buffered++;
 	return PORT_ERR_OK;
 }
 
+static port_err_t serial_posix_read(struct port_interface *port, void *buf,
+				     size_t nbyte)
+{
+	return serial_posix_read_deadline(port, buf, nbyte, 0);
+}
+
 static port_err_t serial_posix_write(struct port_interface *port, void *buf,
 				      size_t nbyte)
 {
@@ -313,6 +372,55 @@ static port_err_t serial_posix_write(struct port_interface *port, void *buf,
 	return PORT_ERR_OK;
 }
 
+#define SERIAL_IOV_MAX	16
+
+static port_err_t serial_posix_writev(struct port_interface *port,
+				      const struct port_iov *piov, int iovcnt)
+{
+	serial_t *h;
+	ssize_t r;
+	struct iovec iov[SERIAL_IOV_MAX], *v = iov;
+	int i, n = 0;
+
+	h = (serial_t *)port->private;
+	if (h == NULL)
+		return PORT_ERR_UNKNOWN;
+
+	if (iovcnt > SERIAL_IOV_MAX) {
+		for (i = 0; i < iovcnt; i++)
+			if (serial_posix_write(port, (void *)piov[i].buf,
+					       piov[i].len) != PORT_ERR_OK)
+				return PORT_ERR_UNKNOWN;
+		return PORT_ERR_OK;
+	}
+
+	for (i = 0; i < iovcnt; i++) {
+		if (!piov[i].len)
+			continue;
+		iov[n].iov_base = (void *)piov[i].buf;
+		iov[n].iov_len = piov[i].len;
+		n++;
+	}
+
+	while (n) {
+		r = writev(h->fd, v, n);
+		if (r < 1)
+			return PORT_ERR_UNKNOWN;
+
+		/* skip what has been written, on partial write */
+		while (n && (size_t)r >= v->iov_len) {
+			r -= v->iov_len;
+			v++;
+			n--;
+		}
+		if (n) {
+			v->iov_base = (uint8_t *)v->iov_base + r;
+			v->iov_len -= r;
+		}
+	}
+	return PORT_ERR_OK;
+}
+
 static port_err_t serial_posix_gpio(struct port_interface *port,
 				    serial_gpio_t n, int level)
 {
@@ -380,7 +488,9 @@ struct port_interface port_serial = {
 	.close	= serial_posix_close,
 	.flush  = serial_posix_flush,
 	.read	= serial_posix_read,
+	.read_deadline	= serial_posix_read_deadline,
 	.write	= serial_posix_write,
+	.writev	= serial_posix_writev,
 	.gpio	= serial_posix_gpio,
 	.get_cfg_str	= serial_posix_get_cfg_str,
 };
@@ -0,0 +1,484 @@
+/*
+  stm32flash - Open Source ST STM32 flash program for *nix
+  Copyright (C) 2026 The stm32flash contributors
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "server.h"
+
+#if defined(__WIN32__)
+
+int server_run(const char *path, struct stm32flash_options *opts)
+{
+	fprintf(stderr, "Server mode is not supported on this platform\n");
+	return 1;
+}
+
+#else
+
+#include <errno.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "compiler.h"
+#include "parsers/parser.h"
+#include "parsers/binary.h"
+#include "parsers/hex.h"
+
+#define SERVER_MAX_ARGS	8
+
+/* result of a request */
+enum {
+	REQ_OK = 0,
+	REQ_FAILED,	/* the target did not complete it */
+	REQ_INVALID,	/* malformed request, not retried */
+};
+
+struct request {
+	char		*argv[SERVER_MAX_ARGS];
+	int		argc;
+	const char	*file;
+	uint32_t	addr, len;
+	unsigned int	flags;		/* STM32FLASH_* of stm32flash_write() */
+	char		result[64];
+};
+
+struct server {
+	stm32flash_session_t		*s;
+	struct stm32flash_callbacks	cb;
+	int				connected;	/* target in bootloader */
+	FILE				*out;		/* replies */
+
+	/* last image written, kept parsed while the file is unchanged */
+	stm32flash_image_t		*img;
+	char				*img_path;
+	struct stat			img_stat;
+};
+
+static volatile sig_atomic_t quit;
+
+static void server_sighandler(int __unused sig)
+{
+	quit = 1;
+}
+
+static void server_log(void *arg, stm32flash_log_t level, const char *msg)
+{
+	struct server *srv = arg;
+
+	fprintf(srv->out, "%c %s\n", level == STM32FLASH_LOG_INFO ? '#' : '!',
+		msg);
+}
+
+#if defined(__GNUC__)
+__attribute__ ((format (printf, 2, 3)))
+#endif
+static int invalid(struct server *srv, const char *fmt, ...)
+{
+	va_list ap;
+
+	fputs("! ", srv->out);
+	va_start(ap, fmt);
+	vfprintf(srv->out, fmt, ap);
+	va_end(ap);
+	fputc('\n', srv->out);
+	return REQ_INVALID;
+}
+
+/* split the request in words and parse the arguments common to all */
+static int parse_request(struct server *srv, char *line, struct request *req)
+{
+	char *tok, *end;
+	int i;
+
+	memset(req, 0, sizeof(*req));
+	for (tok = strtok(line, " \t\r\n"); tok; tok = strtok(NULL, " \t\r\n")) {
+		if (req->argc == SERVER_MAX_ARGS)
+			return invalid(srv, "Too many arguments");
+		req->argv[req->argc++] = tok;
+	}
+
+	for (i = 1; i < req->argc; i++) {
+		tok = req->argv[i];
+		if (!strncmp(tok, "addr=", 5)) {
+			req->addr = strtoul(tok + 5, &end, 0);
+		} else if (!strncmp(tok, "len=", 4)) {
+			req->len = strtoul(tok + 4, &end, 0);
+			if (!req->len)
+				return invalid(srv, "Invalid length \"%s\"", tok);
+		} else if (!strcmp(tok, "verify")) {
+			req->flags |= STM32FLASH_VERIFY;
+			continue;
+		} else if (!strcmp(tok, "diff")) {
+			req->flags |= STM32FLASH_DIFF;
+			continue;
+		} else if (!strcmp(tok, "noerase")) {
+			req->flags |= STM32FLASH_NO_ERASE;
+			continue;
+		} else if (i == 1 && !strchr(tok, '=')) {
+			/* file name, or address of "go" */
+			req->file = tok;
+			continue;
+		} else
+			return invalid(srv, "Invalid argument \"%s\"", tok);
+		if (*end)
+			return invalid(srv, "Invalid number \"%s\"", tok);
+	}
+	return REQ_OK;
+}
+
+static stm32flash_image_t *server_image(struct server *srv, const char *path)
+{
+	struct stat st;
+
+	if (stat(path, &st)) {
+		fprintf(srv->out, "! %s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+	if (srv->img && !strcmp(srv->img_path, path)
+	    && st.st_ino == srv->img_stat.st_ino
+	    && st.st_size == srv->img_stat.st_size
+	    && st.st_mtime == srv->img_stat.st_mtime)
+		return srv->img;
+
+	stm32flash_image_free(srv->img);
+	free(srv->img_path);
+	srv->img_path = NULL;
+	srv->img = stm32flash_image_load(path, 0, &srv->cb);
+	if (!srv->img)
+		return NULL;
+	srv->img_path = strdup(path);
+	if (!srv->img_path) {
+		stm32flash_image_free(srv->img);
+		srv->img = NULL;
+		return NULL;
+	}
+	srv->img_stat = st;
+	return srv->img;
+}
+
+struct read_file {
+	parser_t	*parser;
+	void		*p_st;
+};
+
+static int read_sink(void *arg, const uint8_t *data, unsigned int len)
+{
+	struct read_file *f = arg;
+
+	return f->parser->write(f->p_st, (void *)data, len) != PARSER_ERR_OK;
+}
+
+static int server_read(struct server *srv, struct request *req,
+		       const struct stm32flash_range *range)
+{
+	struct read_file f;
+	parser_err_t perr;
+	int ret;
+
+	f.parser = hex_filename(req->file) ? &PARSER_HEX : &PARSER_BINARY;
+	f.p_st = f.parser->init();
+	if (!f.p_st)
+		return REQ_FAILED;
+	perr = f.parser->open(f.p_st, req->file, 1);
+	if (perr != PARSER_ERR_OK) {
+		f.parser->close(f.p_st);
+		return invalid(srv, "%s: %s", req->file, parser_errstr(perr));
+	}
+	if (f.parser == &PARSER_HEX)
+		hex_write_setup(f.p_st, range->start, 0);
+	ret = stm32flash_read(srv->s, range->start, range->end, read_sink, &f);
+	/* the HEX writer flushes its buffer at close */
+	perr = f.parser->close(f.p_st);
+	if (ret)
+		return REQ_FAILED;
+	if (perr != PARSER_ERR_OK)
+		return invalid(srv, "%s: %s", req->file, strerror(errno));
+	return REQ_OK;
+}
+
+static int server_op(struct server *srv, struct request *req)
+{
+	const char *cmd = req->argv[0];
+	struct stm32flash_range range;
+	stm32flash_image_t *img;
+	uint32_t crc, addr;
+	unsigned int flags;
+	const stm32_t *stm;
+	char *end;
+
+	stm = stm32flash_target(srv->s);
+
+	if (!strcmp(cmd, "info")) {
+		snprintf(req->result, sizeof(req->result),
+			 "0x%04x 0x%02x %s", stm->pid, stm->bl_version,
+			 stm->dev->name);
+		return REQ_OK;
+	}
+
+	if (!strcmp(cmd, "go")) {
+		addr = stm->dev->fl_start;
+		if (req->file) {
+			addr = strtoul(req->file, &end, 0);
+			if (*end || addr % 4)
+				return invalid(srv, "Invalid address \"%s\"", req->file);
+		}
+		if (stm32flash_go(srv->s, addr))
+			return REQ_FAILED;
+		srv->connected = 0;
+		return REQ_OK;
+	}
+
+	if (!strcmp(cmd, "reset")) {
+		if (stm32flash_reset(srv->s))
+			return REQ_FAILED;
+		srv->connected = 0;
+		return REQ_OK;
+	}
+
+	if (stm32flash_range(srv->s, req->addr, req->len, 0, 0, &range))
+		return REQ_INVALID;
+
+	if (!strcmp(cmd, "read")) {
+		if (!req->file)
+			return invalid(srv, "Missing file name");
+		return server_read(srv, req, &range);
+	}
+
+	if (!strcmp(cmd, "write")) {
+		if (!req->file)
+			return invalid(srv, "Missing file name");
+		img = server_image(srv, req->file);
+		if (!img)
+			return REQ_INVALID;
+		flags = req->flags;
+		/* without a range, a file with addresses is written at them */
+		if (!req->addr && !req->len
+		    && !stm32flash_image_range(srv->s, img, &range))
+			flags |= STM32FLASH_SPARSE;
+		return stm32flash_write(srv->s, img, &range, flags) ?
+			REQ_FAILED : REQ_OK;
+	}
+
+	if (!strcmp(cmd, "erase")) {
+		if (range.num_pages != STM32_MASS_ERASE &&
+		    (range.start != stm32_page_to_addr(stm, range.first_page)
+		     || range.end != stm32_page_to_addr(stm, range.first_page + range.num_pages)))
+			return invalid(srv, "Specified start & length are invalid (must be page aligned)");
+		return stm32flash_erase(srv->s, &range) ? REQ_FAILED : REQ_OK;
+	}
+
+	if (!strcmp(cmd, "crc")) {
+		if (stm32flash_crc(srv->s, range.start, range.end, &crc))
+			return REQ_FAILED;
+		snprintf(req->result, sizeof(req->result), "0x%08x", crc);
+		return REQ_OK;
+	}
+
+	return invalid(srv, "Unknown request \"%s\"", cmd);
+}
+
+/*
+ * Run a request. If the target does not answer, it may have left the
+ * bootloader: enter it again and retry once.
+ */
+static int server_request(struct server *srv, struct request *req)
+{
+	int attempt, ret = REQ_FAILED;
+
+	for (attempt = 0; attempt < 2; attempt++) {
+		if (!srv->connected) {
+			if (stm32flash_reconnect(srv->s)) {
+				fprintf(srv->out, "! Cannot enter the bootloader\n");
+				return REQ_FAILED;
+			}
+			srv->connected = 1;
+		}
+		ret = server_op(srv, req);
+		if (ret != REQ_FAILED)
+			break;
+		srv->connected = 0;
+	}
+	return ret;
+}
+
+static void server_client(struct server *srv, int fd)
+{
+	struct request req;
+	char line[1024];
+	FILE *in, *out;
+	int ret;
+
+	in = fdopen(fd, "r");
+	out = fdopen(dup(fd), "w");
+	if (!in || !out) {
+		perror("fdopen");
+		if (in)
+			fclose(in);
+		else
+			close(fd);
+		if (out)
+			fclose(out);
+		return;
+	}
+
+	srv->out = out;
+	while (!quit && fgets(line, sizeof(line), in)) {
+		ret = parse_request(srv, line, &req);
+		if (ret == REQ_OK && !req.argc)
+			continue;
+		if (ret == REQ_OK && !strcmp(req.argv[0], "quit"))
+			break;
+		if (ret == REQ_OK)
+			ret = server_request(srv, &req);
+		if (ret == REQ_OK)
+			fprintf(out, "OK%s%s\n", *req.result ? " " : "", req.result);
+		else
+			fprintf(out, "ERR\n");
+		fflush(out);
+		fprintf(stdout, "Request %s: %s\n", req.argc ? req.argv[0] : "?",
+			ret == REQ_OK ? "done" : "failed");
+		fflush(stdout);
+	}
+	srv->out = stdout;
+	fclose(in);
+	fclose(out);
+}
+
+/*
+ * Make room for the socket at "path": a socket nobody listens on, left
+ * by a previous run, is removed; anything else is an error.
+ */
+static int server_free_path(const struct sockaddr_un *sa, const char *path)
+{
+	struct stat st;
+	int fd, busy;
+
+	if (lstat(path, &st))
+		return 0;
+	if (!S_ISSOCK(st.st_mode)) {
+		fprintf(stderr, "%s exists and is not a socket\n", path);
+		return 1;
+	}
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		perror("socket");
+		return 1;
+	}
+	busy = !connect(fd, (const struct sockaddr *)sa, sizeof(*sa));
+	if (!busy && errno != ECONNREFUSED) {
+		perror(path);
+		close(fd);
+		return 1;
+	}
+	close(fd);
+	if (busy) {
+		fprintf(stderr, "%s already in use\n", path);
+		return 1;
+	}
+	if (unlink(path)) {
+		perror(path);
+		return 1;
+	}
+	return 0;
+}
+
+int server_run(const char *path, struct stm32flash_options *opts)
+{
+	struct server srv;
+	struct sockaddr_un sa;
+	struct sigaction act;
+	int lfd = -1, fd, bound = 0, ret = 1;
+
+	memset(&sa, 0, sizeof(sa));
+	if (strlen(path) >= sizeof(sa.sun_path)) {
+		fprintf(stderr, "Socket path too long: %s\n", path);
+		return 1;
+	}
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path, path);
+	if (server_free_path(&sa, path))
+		return 1;
+
+	memset(&srv, 0, sizeof(srv));
+	srv.out = stdout;
+	srv.cb.log = server_log;
+	srv.cb.arg = &srv;
+	srv.s = stm32flash_open(opts, &srv.cb);
+	if (!srv.s)
+		return 1;
+	srv.connected = 1;
+
+	lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (lfd < 0) {
+		perror("socket");
+		goto close;
+	}
+	if (bind(lfd, (struct sockaddr *)&sa, sizeof(sa))) {
+		perror(path);
+		goto close;
+	}
+	bound = 1;
+	if (listen(lfd, 4)) {
+		perror(path);
+		goto close;
+	}
+
+	/* no SA_RESTART, to leave accept() and fgets() on signal */
+	act.sa_handler = server_sighandler;
+	sigemptyset(&act.sa_mask);
+	act.sa_flags = 0;
+	sigaction(SIGINT, &act, NULL);
+	sigaction(SIGTERM, &act, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	fprintf(stdout, "Listening on %s\n", path);
+	fflush(stdout);
+	while (!quit) {
+		fd = accept(lfd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("accept");
+			goto close;
+		}
+		server_client(&srv, fd);
+	}
+	ret = 0;
+
+close:
+	if (lfd >= 0)
+		close(lfd);
+	/* only the socket of this process */
+	if (bound)
+		unlink(path);
+	stm32flash_close(srv.s);
+	stm32flash_image_free(srv.img);
+	free(srv.img_path);
+	return ret;
+}
+
+#endif
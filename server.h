@@ -0,0 +1,34 @@
+/*
+  stm32flash - Open Source ST STM32 flash program for *nix
+  Copyright (C) 2026 The stm32flash contributors
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+
+#ifndef _H_SERVER
+#define _H_SERVER
+
+#include "libstm32flash.h"
+
+/*
+ * Keep the session with the target open and serve the requests received
+ * on the Unix domain socket "path", one client at a time, until SIGINT or
+ * SIGTERM. See SERVER.txt for the protocol.
+ * Returns 0 on clean exit.
+ */
+int server_run(const char *path, struct stm32flash_options *opts);
+
+#endif
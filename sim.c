@@ -0,0 +1,998 @@
+/*
+  stm32flash - Open Source ST STM32 flash program for *nix
+  Copyright (C) 2026 The stm32flash contributors
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "compiler.h"
+#include "crc.h"
+#include "serial.h"
+#include "port.h"
+#include "sim.h"
+#include "stm32.h"
+#include "utils.h"
+
+#define SIM_ACK		0x79
+#define SIM_NACK	0x1F
+
+#define SIM_CMD_INIT	0x7F
+#define SIM_CMD_GET	0x00
+#define SIM_CMD_GVR	0x01
+#define SIM_CMD_GID	0x02
+#define SIM_CMD_RM	0x11
+#define SIM_CMD_GO	0x21
+#define SIM_CMD_WM	0x31
+#define SIM_CMD_ER	0x43
+#define SIM_CMD_EE	0x44
+#define SIM_CMD_WP	0x63
+#define SIM_CMD_UW	0x73
+#define SIM_CMD_RP	0x82
+#define SIM_CMD_UR	0x92
+#define SIM_CMD_CRC	0xA1
+#define SIM_BUSY	0x76
+#define SIM_NS		0x01	/* no-stretch variant is base command + 1 */
+#define SIM_MAX_CMDS	16	/* in the GET reply */
+
+/* default timing of flash operations */
+#define SIM_WRITE_US	20	/* per 32 bit word */
+#define SIM_ERASE_MS	20	/* per page, plus SIM_ERASE_MS_KIB per KiB */
+#define SIM_ERASE_MS_KIB	10
+
+extern const stm32_dev_t devices[];
+
+enum sim_state {
+	S_INIT,		/* wait 0x7F after reset */
+	S_CMD,		/* wait command and its complement */
+	S_ADDR,		/* wait address and checksum */
+	S_RM_LEN,	/* wait length to read */
+	S_WM_DATA,	/* wait data to write */
+	S_ER_DATA,	/* wait pages of erase */
+	S_EE_DATA,	/* wait pages of extended erase */
+	S_CRC_LEN,	/* wait length for CRC */
+	S_WP_DATA,	/* wait sectors to write protect */
+};
+
+struct sim_region {
+	uint32_t start, end;
+	uint8_t *mem;
+	int writable;
+};
+
+enum { R_FLASH, R_RAM, R_OPT, R_SYS, R_NUM };
+
+struct sim {
+	const stm32_dev_t *dev;
+	struct sim_region reg[R_NUM];
+
+	/* protocol */
+	enum sim_state state;
+	uint8_t cmd;
+	uint8_t in[2 + 2 * 65536 + 1];
+	size_t in_len, need;
+	uint32_t addr;
+	int rdp;
+
+	/* reply bytes not read yet by host */
+	uint8_t *out;
+	size_t out_pos, out_len, out_size;
+	int nomem;			/* a reply was lost */
+
+	/* configuration */
+	unsigned int baud, bits;
+	uint8_t bl_version;
+	int crc, legacy_erase, ns, realtime, report;
+	unsigned int write_us, erase_ms, erase_ms_kib;
+	uint32_t noise_ppm, seed;
+	char *load, *save;
+	char cfg_str[64];
+
+	/* statistics */
+	uint64_t time_us, wire_us, flash_us;
+	uint64_t bytes_in, bytes_out, programmed;
+	unsigned long cmds, pages_erased, mass_erases, noise;
+};
+
+static struct sim_region *sim_region(sim_t *sim, uint32_t addr, uint32_t len)
+{
+	struct sim_region *r;
+
+	for (r = sim->reg; r < sim->reg + R_NUM; r++)
+		if (r->mem && addr >= r->start && addr < r->end
+		    && len <= r->end - addr)
+			return r;
+	return NULL;
+}
+
+static void sim_wire(sim_t *sim, size_t bytes)
+{
+	uint64_t us = (uint64_t)bytes * sim->bits * 1000000 / sim->baud;
+
+	sim->time_us += us;
+	sim->wire_us += us;
+}
+
+static void sim_byte(sim_t *sim, uint8_t b);
+
+/* no-stretch commands report BUSY while the flash operation runs */
+static void sim_busy(sim_t *sim, uint64_t us)
+{
+	if (sim->ns && (sim->cmd == SIM_CMD_WM || sim->cmd == SIM_CMD_EE
+			|| sim->cmd == SIM_CMD_UR))
+		sim_byte(sim, SIM_BUSY);
+	sim->time_us += us;
+	sim->flash_us += us;
+}
+
+/* pseudo random, deterministic for a given seed */
+static uint32_t sim_rand(sim_t *sim)
+{
+	sim->seed = sim->seed * 1103515245 + 12345;
+	return (sim->seed >> 8) % 1000000;
+}
+
+/* on failure the bytes are lost and sim_input() reports the error */
+static void sim_put(sim_t *sim, const uint8_t *buf, size_t len)
+{
+	uint8_t *out;
+	size_t i;
+
+	if (sim->out_pos == sim->out_len)
+		sim->out_pos = sim->out_len = 0;
+	if (sim->out_len + len > sim->out_size) {
+		out = realloc(sim->out, (sim->out_len + len) * 2);
+		if (!out) {
+			sim->nomem = 1;
+			return;
+		}
+		sim->out = out;
+		sim->out_size = (sim->out_len + len) * 2;
+	}
+	memcpy(sim->out + sim->out_len, buf, len);
+	if (sim->noise_ppm)
+		for (i = 0; i < len; i++)
+			if (sim_rand(sim) < sim->noise_ppm) {
+				sim->out[sim->out_len + i] ^= 1 << (sim_rand(sim) & 7);
+				sim->noise++;
+			}
+	sim->out_len += len;
+	sim->bytes_out += len;
+	sim_wire(sim, len);
+}
+
+static void sim_byte(sim_t *sim, uint8_t b)
+{
+	sim_put(sim, &b, 1);
+}
+
+static void sim_reset(sim_t *sim)
+{
+	sim->state = S_INIT;
+	sim->in_len = 0;
+	sim->need = 1;
+}
+
+static void sim_expect(sim_t *sim, enum sim_state state, size_t need)
+{
+	sim->state = state;
+	sim->in_len = 0;
+	sim->need = need;
+}
+
+static void sim_nack(sim_t *sim)
+{
+	sim_byte(sim, SIM_NACK);
+	sim_expect(sim, S_CMD, 2);
+}
+
+static uint8_t sim_xor(const uint8_t *buf, size_t len)
+{
+	uint8_t x = 0;
+
+	while (len--)
+		x ^= *buf++;
+	return x;
+}
+
+/* address and size of a page, 0 if the page is not in flash */
+static int sim_page(const sim_t *sim, unsigned int page, uint32_t *addr,
+		    uint32_t *size)
+{
+	const uint32_t *psize = sim->dev->fl_ps;
+	const struct sim_region *fl = &sim->reg[R_FLASH];
+	uint32_t a = fl->start;
+	unsigned int i;
+
+	for (i = 0; i < page; i++) {
+		a += psize[0];
+		if (psize[1])
+			psize++;
+	}
+	if (a >= fl->end)
+		return 0;
+	*addr = a;
+	*size = psize[0];
+	return 1;
+}
+
+static int sim_page_erase(sim_t *sim, unsigned int page)
+{
+	struct sim_region *fl = &sim->reg[R_FLASH];
+	uint32_t a, size;
+
+	if (!sim_page(sim, page, &a, &size))
+		return 0;
+
+	memset(fl->mem + (a - fl->start), 0xff, size);
+	sim_busy(sim, (sim->erase_ms + sim->erase_ms_kib * size / 1024) * 1000ULL);
+	sim->pages_erased++;
+	return 1;
+}
+
+/* the bootloader refuses the whole list if a page is not in flash */
+static int sim_pages_valid(const sim_t *sim, const uint8_t *list,
+			   unsigned int n, int wide)
+{
+	uint32_t a, size;
+	unsigned int i, page;
+
+	for (i = 0; i < n; i++) {
+		page = wide ? (list[2 * i] << 8) | list[2 * i + 1] : list[i];
+		if (!sim_page(sim, page, &a, &size))
+			return 0;
+	}
+	return 1;
+}
+
+static void sim_mass_erase(sim_t *sim)
+{
+	struct sim_region *fl = &sim->reg[R_FLASH];
+	uint32_t len = fl->end - fl->start;
+
+	memset(fl->mem, 0xff, len);
+	sim_busy(sim, (sim->erase_ms + sim->erase_ms_kib * (uint64_t)len / 1024) * 1000);
+	sim->mass_erases++;
+}
+
+/* commands of the GET reply, in "list" of SIM_MAX_CMDS bytes */
+static size_t sim_cmd_list(const sim_t *sim, uint8_t *list)
+{
+	uint8_t ns = sim->ns ? SIM_NS : 0;
+	size_t i = 0;
+
+	list[i++] = SIM_CMD_GET;
+	list[i++] = SIM_CMD_GVR;
+	list[i++] = SIM_CMD_GID;
+	list[i++] = SIM_CMD_RM;
+	list[i++] = SIM_CMD_GO;
+	list[i++] = SIM_CMD_WM + ns;
+	list[i++] = sim->legacy_erase ? SIM_CMD_ER : SIM_CMD_EE + ns;
+	list[i++] = SIM_CMD_WP + ns;
+	list[i++] = SIM_CMD_UW + ns;
+	list[i++] = SIM_CMD_RP + ns;
+	list[i++] = SIM_CMD_UR + ns;
+	if (sim->crc)
+		list[i++] = SIM_CMD_CRC;
+	return i;
+}
+
+static int sim_cmd_supported(const sim_t *sim, uint8_t cmd)
+{
+	uint8_t list[SIM_MAX_CMDS];
+	size_t i, n;
+
+	n = sim_cmd_list(sim, list);
+	for (i = 0; i < n; i++)
+		if (list[i] == cmd)
+			return 1;
+	return 0;
+}
+
+static void sim_command(sim_t *sim)
+{
+	uint8_t list[SIM_MAX_CMDS];
+	uint8_t buf[4];
+	size_t n;
+
+	if (sim->in[1] != (sim->in[0] ^ 0xFF)
+	    || !sim_cmd_supported(sim, sim->in[0])) {
+		sim_nack(sim);
+		return;
+	}
+
+	sim->cmd = sim->in[0];
+	/* handle no-stretch commands as their base command */
+	if (sim->ns)
+		switch (sim->cmd - SIM_NS) {
+		case SIM_CMD_WM:
+		case SIM_CMD_EE:
+		case SIM_CMD_WP:
+		case SIM_CMD_UW:
+		case SIM_CMD_RP:
+		case SIM_CMD_UR:
+			sim->cmd -= SIM_NS;
+		}
+	sim->cmds++;
+	switch (sim->cmd) {
+	case SIM_CMD_GET:
+		n = sim_cmd_list(sim, list);
+		sim_byte(sim, SIM_ACK);
+		sim_byte(sim, n);
+		sim_byte(sim, sim->bl_version);
+		sim_put(sim, list, n);
+		sim_byte(sim, SIM_ACK);
+		sim_expect(sim, S_CMD, 2);
+		return;
+
+	case SIM_CMD_GVR:
+		buf[0] = SIM_ACK;
+		buf[1] = sim->bl_version;
+		buf[2] = 0;
+		buf[3] = 0;
+		sim_put(sim, buf, 4);
+		sim_byte(sim, SIM_ACK);
+		sim_expect(sim, S_CMD, 2);
+		return;
+
+	case SIM_CMD_GID:
+		buf[0] = SIM_ACK;
+		buf[1] = 1;
+		buf[2] = sim->dev->id >> 8;
+		buf[3] = sim->dev->id & 0xFF;
+		sim_put(sim, buf, 4);
+		sim_byte(sim, SIM_ACK);
+		sim_expect(sim, S_CMD, 2);
+		return;
+
+	case SIM_CMD_RM:
+	case SIM_CMD_GO:
+	case SIM_CMD_WM:
+	case SIM_CMD_CRC:
+		if (sim->rdp) {
+			sim_nack(sim);
+			return;
+		}
+		sim_byte(sim, SIM_ACK);
+		sim_expect(sim, S_ADDR, 5);
+		return;
+
+	case SIM_CMD_ER:
+		sim_byte(sim, SIM_ACK);
+		sim_expect(sim, S_ER_DATA, 1);
+		return;
+
+	case SIM_CMD_EE:
+		sim_byte(sim, SIM_ACK);
+		sim_expect(sim, S_EE_DATA, 2);
+		return;
+
+	case SIM_CMD_WP:
+		sim_byte(sim, SIM_ACK);
+		sim_expect(sim, S_WP_DATA, 1);
+		return;
+
+	case SIM_CMD_UW:
+		sim_byte(sim, SIM_ACK);
+		sim_byte(sim, SIM_ACK);
+		sim_reset(sim);
+		return;
+
+	case SIM_CMD_RP:
+		sim_byte(sim, SIM_ACK);
+		sim->rdp = 1;
+		sim_byte(sim, SIM_ACK);
+		sim_reset(sim);
+		return;
+
+	case SIM_CMD_UR:
+		sim_byte(sim, SIM_ACK);
+		sim_mass_erase(sim);
+		sim->rdp = 0;
+		sim_byte(sim, SIM_ACK);
+		sim_reset(sim);
+		return;
+	}
+	sim_nack(sim);
+}
+
+static void sim_address(sim_t *sim)
+{
+	if (sim->in[4] != sim_xor(sim->in, 4)) {
+		sim_nack(sim);
+		return;
+	}
+	sim->addr = (sim->in[0] << 24) | (sim->in[1] << 16)
+		    | (sim->in[2] << 8) | sim->in[3];
+	if (!sim_region(sim, sim->addr, 1)) {
+		sim_nack(sim);
+		return;
+	}
+	sim_byte(sim, SIM_ACK);
+
+	switch (sim->cmd) {
+	case SIM_CMD_RM:
+		sim_expect(sim, S_RM_LEN, 2);
+		return;
+	case SIM_CMD_WM:
+		sim_expect(sim, S_WM_DATA, 1);
+		return;
+	case SIM_CMD_CRC:
+		sim_expect(sim, S_CRC_LEN, 5);
+		return;
+	case SIM_CMD_GO:
+		/* the device leaves the bootloader; model a reset into it */
+		sim_reset(sim);
+		return;
+	}
+}
+
+static void sim_read_memory(sim_t *sim)
+{
+	struct sim_region *r;
+	unsigned int len = sim->in[0] + 1;
+
+	if (sim->in[1] != (sim->in[0] ^ 0xFF)) {
+		sim_nack(sim);
+		return;
+	}
+	r = sim_region(sim, sim->addr, len);
+	if (!r) {
+		sim_nack(sim);
+		return;
+	}
+	sim_byte(sim, SIM_ACK);
+	sim_put(sim, r->mem + (sim->addr - r->start), len);
+	sim_expect(sim, S_CMD, 2);
+}
+
+static void sim_write_memory(sim_t *sim)
+{
+	struct sim_region *r;
+	unsigned int i, len = sim->in[0] + 1;
+	uint8_t *p;
+
+	if (sim->in_len == 1) {
+		sim->need = 1 + len + 1;
+		return;
+	}
+	if (sim->in[len + 1] != sim_xor(sim->in, len + 1)) {
+		sim_nack(sim);
+		return;
+	}
+	r = sim_region(sim, sim->addr, len);
+	if (!r || !r->writable) {
+		sim_nack(sim);
+		return;
+	}
+
+	p = r->mem + (sim->addr - r->start);
+	if (r == &sim->reg[R_FLASH]) {
+		/* programming can only clear bits */
+		for (i = 0; i < len; i++)
+			p[i] &= sim->in[i + 1];
+		sim_busy(sim, (uint64_t)sim->write_us * ((len + 3) / 4));
+		sim->programmed += len;
+	} else {
+		memcpy(p, sim->in + 1, len);
+	}
+	sim_byte(sim, SIM_ACK);
+	sim_expect(sim, S_CMD, 2);
+}
+
+static void sim_erase(sim_t *sim)
+{
+	unsigned int i, n = sim->in[0] + 1;
+
+	if (sim->in_len == 1) {
+		/* 0xFF is mass erase, followed by 0x00 */
+		sim->need = sim->in[0] == 0xFF ? 2 : 1 + n + 1;
+		return;
+	}
+	if (sim->in[0] == 0xFF ? sim->in[1] != 0x00
+	    : sim->in[sim->in_len - 1] != sim_xor(sim->in, sim->in_len - 1)) {
+		sim_nack(sim);
+		return;
+	}
+	if (sim->in[0] == 0xFF) {
+		sim_mass_erase(sim);
+	} else {
+		if (!sim_pages_valid(sim, sim->in + 1, n, 0)) {
+			sim_nack(sim);
+			return;
+		}
+		for (i = 0; i < n; i++)
+			sim_page_erase(sim, sim->in[1 + i]);
+	}
+	sim_byte(sim, SIM_ACK);
+	sim_expect(sim, S_CMD, 2);
+}
+
+static void sim_ext_erase(sim_t *sim)
+{
+	unsigned int i, n = (sim->in[0] << 8) | sim->in[1];
+
+	if (sim->in_len == 2) {
+		/* 0xFFFF, 0xFFFE, 0xFFFD are mass/bank erase */
+		sim->need = n >= 0xFFF0 ? 3 : 2 + 2 * (n + 1) + 1;
+		return;
+	}
+	if (sim->in[sim->in_len - 1] != sim_xor(sim->in, sim->in_len - 1)) {
+		sim_nack(sim);
+		return;
+	}
+	if (n >= 0xFFF0) {
+		sim_mass_erase(sim);
+	} else {
+		if (!sim_pages_valid(sim, sim->in + 2, n + 1, 1)) {
+			sim_nack(sim);
+			return;
+		}
+		for (i = 0; i <= n; i++)
+			sim_page_erase(sim, (sim->in[2 + 2 * i] << 8) | sim->in[3 + 2 * i]);
+	}
+	sim_byte(sim, SIM_ACK);
+	sim_expect(sim, S_CMD, 2);
+}
+
+static void sim_crc(sim_t *sim)
+{
+	struct sim_region *r;
+	uint32_t len, crc;
+	uint8_t buf[5];
+
+	if (sim->in[4] != sim_xor(sim->in, 4)) {
+		sim_nack(sim);
+		return;
+	}
+	len = (sim->in[0] << 24) | (sim->in[1] << 16)
+	      | (sim->in[2] << 8) | sim->in[3];
+	r = sim_region(sim, sim->addr, len);
+	if (!r || (len & 3) || !len) {
+		sim_nack(sim);
+		return;
+	}
+	sim_byte(sim, SIM_ACK);
+	crc = crc_stm32(STM32_CRC_INIT, r->mem + (sim->addr - r->start), len);
+	/* about one word per cycle at 16 MHz */
+	sim_busy(sim, len / 4 / 16);
+	sim_byte(sim, SIM_ACK);
+	buf[0] = crc >> 24;
+	buf[1] = crc >> 16;
+	buf[2] = crc >> 8;
+	buf[3] = crc;
+	buf[4] = sim_xor(buf, 4);
+	sim_put(sim, buf, 5);
+	sim_expect(sim, S_CMD, 2);
+}
+
+static void sim_write_protect(sim_t *sim)
+{
+	if (sim->in_len == 1) {
+		sim->need = 1 + sim->in[0] + 1 + 1;
+		return;
+	}
+	if (sim->in[sim->in_len - 1] != sim_xor(sim->in, sim->in_len - 1)) {
+		sim_nack(sim);
+		return;
+	}
+	sim_byte(sim, SIM_ACK);
+	sim_reset(sim);
+}
+
+static void sim_process(sim_t *sim)
+{
+	switch (sim->state) {
+	case S_INIT:
+		if (sim->in[0] == SIM_CMD_INIT) {
+			sim_byte(sim, SIM_ACK);
+			sim_expect(sim, S_CMD, 2);
+		} else {
+			sim->in_len = 0;
+		}
+		return;
+	case S_CMD:
+		sim_command(sim);
+		return;
+	case S_ADDR:
+		sim_address(sim);
+		return;
+	case S_RM_LEN:
+		sim_read_memory(sim);
+		return;
+	case S_WM_DATA:
+		sim_write_memory(sim);
+		return;
+	case S_ER_DATA:
+		sim_erase(sim);
+		return;
+	case S_EE_DATA:
+		sim_ext_erase(sim);
+		return;
+	case S_CRC_LEN:
+		sim_crc(sim);
+		return;
+	case S_WP_DATA:
+		sim_write_protect(sim);
+		return;
+	}
+}
+
+int sim_input(sim_t *sim, const uint8_t *buf, size_t len)
+{
+	sim->bytes_in += len;
+	sim_wire(sim, len);
+	while (len--) {
+		sim->in[sim->in_len++] = *buf++;
+		if (sim->in_len == sim->need)
+			sim_process(sim);
+	}
+	return sim->nomem ? -1 : 0;
+}
+
+size_t sim_output(sim_t *sim, uint8_t *buf, size_t len)
+{
+	size_t n = sim->out_len - sim->out_pos;
+
+	if (n > len)
+		n = len;
+	memcpy(buf, sim->out + sim->out_pos, n);
+	sim->out_pos += n;
+	return n;
+}
+
+size_t sim_pending(const sim_t *sim)
+{
+	return sim->out_len - sim->out_pos;
+}
+
+void sim_flush(sim_t *sim)
+{
+	sim->out_pos = sim->out_len = 0;
+}
+
+uint64_t sim_time_us(const sim_t *sim)
+{
+	return sim->time_us;
+}
+
+int sim_realtime(const sim_t *sim)
+{
+	return sim->realtime;
+}
+
+const char *sim_get_cfg_str(const sim_t *sim)
+{
+	return sim->cfg_str;
+}
+
+void sim_report(const sim_t *sim, FILE *f)
+{
+	fprintf(f, "{\"sim_time_us\": %llu, \"wire_time_us\": %llu, "
+		"\"flash_time_us\": %llu, \"host_to_dev_bytes\": %llu, "
+		"\"dev_to_host_bytes\": %llu, \"commands\": %lu, "
+		"\"bytes_programmed\": %llu, \"pages_erased\": %lu, "
+		"\"mass_erases\": %lu, \"noise_errors\": %lu}\n",
+		(unsigned long long)sim->time_us,
+		(unsigned long long)sim->wire_us,
+		(unsigned long long)sim->flash_us,
+		(unsigned long long)sim->bytes_in,
+		(unsigned long long)sim->bytes_out,
+		sim->cmds,
+		(unsigned long long)sim->programmed,
+		sim->pages_erased, sim->mass_erases, sim->noise);
+}
+
+static int sim_file(sim_t *sim, const char *name, int save)
+{
+	struct sim_region *fl = &sim->reg[R_FLASH];
+	FILE *f;
+	size_t len = fl->end - fl->start, r;
+
+	f = fopen(name, save ? "wb" : "rb");
+	if (!f) {
+		perror(name);
+		return -1;
+	}
+	if (save)
+		r = fwrite(fl->mem, 1, len, f);
+	else
+		r = fread(fl->mem, 1, len, f);
+	fclose(f);
+	if (save && r != len) {
+		fprintf(stderr, "sim: failed to save flash in %s\n", name);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Configuration is a comma separated list, starting with the device ID:
+ *	0x413[,baud=n][,crc][,legacy_erase][,ns][,ver=n][,write_us=n]
+ *	[,erase_ms=n][,erase_ms_kib=n][,noise=ppm][,seed=n][,realtime]
+ *	[,load=file][,save=file][,report]
+ */
+static int sim_parse(sim_t *sim, const char *cfg)
+{
+	char *str, *tok, *val;
+	unsigned long pid;
+	int ret = 0;
+
+	str = strdup(cfg);
+	if (!str)
+		return -1;
+
+	for (tok = strtok(str, ","); tok && !ret; tok = strtok(NULL, ",")) {
+		val = strchr(tok, '=');
+		if (val)
+			*val++ = '\0';
+
+		if (tok == str && !val) {
+			pid = strtoul(tok, NULL, 0);
+			for (sim->dev = devices; sim->dev->id; sim->dev++)
+				if (sim->dev->id == pid)
+					break;
+			if (!sim->dev->id) {
+				fprintf(stderr, "sim: unknown device ID \"%s\"\n", tok);
+				ret = -1;
+			}
+		} else if (!strcmp(tok, "crc")) {
+			sim->crc = 1;
+		} else if (!strcmp(tok, "legacy_erase")) {
+			sim->legacy_erase = 1;
+		} else if (!strcmp(tok, "ns")) {
+			sim->ns = 1;
+		} else if (!strcmp(tok, "realtime")) {
+			sim->realtime = 1;
+		} else if (!strcmp(tok, "report")) {
+			sim->report = 1;
+		} else if (val && !strcmp(tok, "baud")) {
+			sim->baud = strtoul(val, NULL, 0);
+		} else if (val && !strcmp(tok, "ver")) {
+			sim->bl_version = strtoul(val, NULL, 0);
+		} else if (val && !strcmp(tok, "write_us")) {
+			sim->write_us = strtoul(val, NULL, 0);
+		} else if (val && !strcmp(tok, "erase_ms")) {
+			sim->erase_ms = strtoul(val, NULL, 0);
+		} else if (val && !strcmp(tok, "erase_ms_kib")) {
+			sim->erase_ms_kib = strtoul(val, NULL, 0);
+		} else if (val && !strcmp(tok, "noise")) {
+			sim->noise_ppm = strtoul(val, NULL, 0);
+		} else if (val && !strcmp(tok, "seed")) {
+			sim->seed = strtoul(val, NULL, 0);
+		} else if (val && !strcmp(tok, "load")) {
+			sim->load = strdup(val);
+		} else if (val && !strcmp(tok, "save")) {
+			sim->save = strdup(val);
+		} else {
+			fprintf(stderr, "sim: invalid option \"%s\"\n", tok);
+			ret = -1;
+		}
+	}
+
+	free(str);
+	return ret;
+}
+
+sim_t *sim_new(const char *cfg, serial_baud_t baud)
+{
+	const stm32_dev_t *dev;
+	sim_t *sim;
+	int i;
+
+	sim = calloc(1, sizeof(*sim));
+	if (!sim)
+		return NULL;
+
+	sim->dev = devices;
+	sim->baud = serial_get_baud_int(baud);
+	sim->bits = 1 + 8 + 1 + 1;	/* start, data, parity, stop */
+	sim->bl_version = 0x31;
+	sim->write_us = SIM_WRITE_US;
+	sim->erase_ms = SIM_ERASE_MS;
+	sim->erase_ms_kib = SIM_ERASE_MS_KIB;
+	sim->seed = 1;
+	if (sim_parse(sim, cfg) || !sim->baud) {
+		sim_free(sim);
+		return NULL;
+	}
+
+	dev = sim->dev;
+	sim->reg[R_FLASH].start = dev->fl_start;
+	sim->reg[R_FLASH].end = dev->fl_end;
+	sim->reg[R_FLASH].writable = 1;
+	sim->reg[R_RAM].start = 0x20000000;
+	sim->reg[R_RAM].end = dev->ram_end;
+	sim->reg[R_RAM].writable = 1;
+	sim->reg[R_OPT].start = dev->opt_start;
+	sim->reg[R_OPT].end = dev->opt_end + 1;
+	sim->reg[R_OPT].writable = 1;
+	sim->reg[R_SYS].start = dev->mem_start;
+	sim->reg[R_SYS].end = dev->mem_end;
+
+	for (i = 0; i < R_NUM; i++) {
+		sim->reg[i].mem = malloc(sim->reg[i].end - sim->reg[i].start);
+		if (!sim->reg[i].mem) {
+			sim_free(sim);
+			return NULL;
+		}
+		memset(sim->reg[i].mem, i == R_SYS ? 0 : 0xff,
+		       sim->reg[i].end - sim->reg[i].start);
+	}
+
+	if (sim->load && sim_file(sim, sim->load, 0)) {
+		sim_free(sim);
+		return NULL;
+	}
+
+	snprintf(sim->cfg_str, sizeof(sim->cfg_str), "0x%03x %u 8E1%s",
+		 dev->id, sim->baud, sim->crc ? " crc" : "");
+	sim_reset(sim);
+	return sim;
+}
+
+void sim_free(sim_t *sim)
+{
+	int i;
+
+	if (!sim)
+		return;
+	if (sim->save && sim->reg[R_FLASH].mem)
+		sim_file(sim, sim->save, 1);
+	if (sim->report)
+		sim_report(sim, stderr);
+	for (i = 0; i < R_NUM; i++)
+		free(sim->reg[i].mem);
+	free(sim->out);
+	free(sim->load);
+	free(sim->save);
+	free(sim);
+}
+
+/*
+ * Port interface on the simulator, for device names "sim:<config>".
+ * The replies are produced synchronously, so a read that cannot be
+ * satisfied times out immediately.
+ */
+struct sim_priv {
+	sim_t *sim;
+	uint64_t t0_ms, t0_us;
+};
+
+/* in realtime mode, wait until the wall clock reaches the virtual time */
+static void sim_port_sync(struct sim_priv *h)
+{
+	uint64_t virt_ms, now_ms;
+
+	if (!sim_realtime(h->sim))
+		return;
+	virt_ms = (sim_time_us(h->sim) - h->t0_us) / 1000;
+	now_ms = get_time_ms() - h->t0_ms;
+	if (virt_ms > now_ms)
+		usleep((virt_ms - now_ms) * 1000);
+}
+
+static port_err_t sim_port_open(struct port_interface *port,
+				struct port_options *ops)
+{
+	struct sim_priv *h;
+
+	if (strncmp(ops->device, "sim:", strlen("sim:")))
+		return PORT_ERR_NODEV;
+
+	h = calloc(1, sizeof(*h));
+	if (!h)
+		return PORT_ERR_UNKNOWN;
+	h->sim = sim_new(ops->device + strlen("sim:"), ops->baudRate);
+	if (!h->sim) {
+		free(h);
+		return PORT_ERR_UNKNOWN;
+	}
+	h->t0_ms = get_time_ms();
+	port->private = h;
+	return PORT_ERR_OK;
+}
+
+static port_err_t sim_port_close(struct port_interface *port)
+{
+	struct sim_priv *h = port->private;
+
+	if (h == NULL)
+		return PORT_ERR_UNKNOWN;
+	sim_free(h->sim);
+	free(h);
+	port->private = NULL;
+	return PORT_ERR_OK;
+}
+
+static port_err_t sim_port_flush(struct port_interface *port)
+{
+	struct sim_priv *h = port->private;
+
+	if (h == NULL)
+		return PORT_ERR_UNKNOWN;
+	sim_flush(h->sim);
+	return PORT_ERR_OK;
+}
+
+static port_err_t sim_port_read(struct port_interface *port, void *buf,
+				size_t nbyte)
+{
+	struct sim_priv *h = port->private;
+
+	if (h == NULL)
+		return PORT_ERR_UNKNOWN;
+	port->stats.rx_calls++;
+	if (sim_pending(h->sim) < nbyte) {
+		sim_output(h->sim, buf, nbyte);
+		return PORT_ERR_TIMEDOUT;
+	}
+	sim_output(h->sim, buf, nbyte);
+	return PORT_ERR_OK;
+}
+
+static port_err_t sim_port_read_deadline(struct port_interface *port,
+					 void *buf, size_t nbyte,
+					 uint64_t __unused deadline)
+{
+	return sim_port_read(port, buf, nbyte);
+}
+
+static port_err_t sim_port_write(struct port_interface *port, void *buf,
+				 size_t nbyte)
+{
+	struct sim_priv *h = port->private;
+
+	if (h == NULL)
+		return PORT_ERR_UNKNOWN;
+	if (sim_input(h->sim, buf, nbyte)) {
+		fprintf(stderr, "sim: out of memory\n");
+		return PORT_ERR_UNKNOWN;
+	}
+	sim_port_sync(h);
+	return PORT_ERR_OK;
+}
+
+static port_err_t sim_port_gpio(struct port_interface __unused *port,
+				serial_gpio_t __unused n,
+				int __unused level)
+{
+	return PORT_ERR_OK;
+}
+
+static const char *sim_port_get_cfg_str(struct port_interface *port)
+{
+	struct sim_priv *h = port->private;
+
+	return h ? sim_get_cfg_str(h->sim) : "INVALID";
+}
+
+struct port_interface port_sim = {
+	.name	= "sim",
+	.flags	= PORT_BYTE | PORT_GVR_ETX | PORT_CMD_INIT | PORT_RETRY,
+	.open	= sim_port_open,
+	.close	= sim_port_close,
+	.flush	= sim_port_flush,
+	.read	= sim_port_read,
+	.read_deadline	= sim_port_read_deadline,
+	.write	= sim_port_write,
+	.gpio	= sim_port_gpio,
+	.get_cfg_str	= sim_port_get_cfg_str,
+};
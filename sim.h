@@ -0,0 +1,49 @@
+/*
+  stm32flash - Open Source ST STM32 flash program for *nix
+  Copyright (C) 2026 The stm32flash contributors
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+
+#ifndef _H_SIM
+#define _H_SIM
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "serial.h"
+
+/*
+ * Software model of the STM32 system bootloader (UART protocol, AN3155).
+ * The model is fed with the bytes sent by the host and produces the
+ * bytes of the replies. Time is virtual: it accounts for the bytes on
+ * the wire at the configured baud rate and for the flash operations.
+ */
+typedef struct sim sim_t;
+
+sim_t *sim_new(const char *cfg, serial_baud_t baud);
+void sim_free(sim_t *sim);
+/* returns -1 if a reply could not be stored, out of memory */
+int sim_input(sim_t *sim, const uint8_t *buf, size_t len);
+size_t sim_output(sim_t *sim, uint8_t *buf, size_t len);
+size_t sim_pending(const sim_t *sim);
+void sim_flush(sim_t *sim);
+uint64_t sim_time_us(const sim_t *sim);
+int sim_realtime(const sim_t *sim);
+const char *sim_get_cfg_str(const sim_t *sim);
+void sim_report(const sim_t *sim, FILE *f);
+
+#endif
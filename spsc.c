@@ -0,0 +1,175 @@
+/*
+  stm32flash - Open Source ST STM32 flash program for *nix
+  Copyright (C) 2026 The stm32flash contributors
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "spsc.h"
+
+struct spsc {
+	uint8_t		*buf;
+	size_t		*len;		/* of the data of each slot */
+	size_t		slot_size;
+	unsigned int	mask;		/* slots - 1 */
+
+	/* free running, head written by the producer, tail by the consumer */
+	unsigned int	head, tail;
+	int		closed;
+	int		sleepers;
+
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+};
+
+struct spsc *spsc_new(unsigned int nslots, size_t slot_size)
+{
+	struct spsc *q;
+	unsigned int n;
+
+	for (n = 1; n < nslots; n <<= 1);
+
+	q = calloc(1, sizeof(*q));
+	if (!q)
+		return NULL;
+	q->buf = malloc((size_t)n * slot_size);
+	q->len = malloc(n * sizeof(*q->len));
+	if (!q->buf || !q->len) {
+		free(q->buf);
+		free(q->len);
+		free(q);
+		return NULL;
+	}
+	q->slot_size = slot_size;
+	q->mask = n - 1;
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->cond, NULL);
+	return q;
+}
+
+void spsc_free(struct spsc *q)
+{
+	if (!q)
+		return;
+	pthread_mutex_destroy(&q->lock);
+	pthread_cond_destroy(&q->cond);
+	free(q->buf);
+	free(q->len);
+	free(q);
+}
+
+/*
+ * Sleep until *index moves from value, or the ring is closed.
+ * The sleeper count is raised before checking the index again, and the
+ * other side moves the index before checking the count (all sequentially
+ * consistent): either this side sees the new index, or the other side
+ * sees the sleeper and wakes it, under the lock.
+ */
+static void spsc_wait(struct spsc *q, const unsigned int *index,
+		      unsigned int value)
+{
+	pthread_mutex_lock(&q->lock);
+	__atomic_add_fetch(&q->sleepers, 1, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(index, __ATOMIC_SEQ_CST) == value
+	       && !__atomic_load_n(&q->closed, __ATOMIC_SEQ_CST))
+		pthread_cond_wait(&q->cond, &q->lock);
+	__atomic_sub_fetch(&q->sleepers, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&q->lock);
+}
+
+static void spsc_wake(struct spsc *q)
+{
+	if (!__atomic_load_n(&q->sleepers, __ATOMIC_SEQ_CST))
+		return;
+	pthread_mutex_lock(&q->lock);
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+}
+
+void *spsc_get(struct spsc *q)
+{
+	unsigned int head = q->head;
+
+	while (head - __atomic_load_n(&q->tail, __ATOMIC_SEQ_CST) > q->mask) {
+		if (__atomic_load_n(&q->closed, __ATOMIC_SEQ_CST))
+			return NULL;
+		spsc_wait(q, &q->tail, head - q->mask - 1);
+	}
+	if (__atomic_load_n(&q->closed, __ATOMIC_SEQ_CST))
+		return NULL;
+	return q->buf + (size_t)(head & q->mask) * q->slot_size;
+}
+
+void spsc_put(struct spsc *q, size_t len)
+{
+	q->len[q->head & q->mask] = len;
+	__atomic_store_n(&q->head, q->head + 1, __ATOMIC_SEQ_CST);
+	spsc_wake(q);
+}
+
+const void *spsc_peek(struct spsc *q, size_t *len, unsigned int *nslots)
+{
+	unsigned int tail = q->tail, head, i, n;
+	size_t l;
+
+	for (;;) {
+		head = __atomic_load_n(&q->head, __ATOMIC_SEQ_CST);
+		if (head != tail)
+			break;
+		if (__atomic_load_n(&q->closed, __ATOMIC_SEQ_CST)) {
+			/* the last slots may have been put before the close */
+			head = __atomic_load_n(&q->head, __ATOMIC_SEQ_CST);
+			if (head != tail)
+				break;
+			return NULL;
+		}
+		spsc_wait(q, &q->head, tail);
+	}
+
+	/* up to the end of the buffer, through the full slots */
+	n = head - tail;
+	if (n > q->mask + 1 - (tail & q->mask))
+		n = q->mask + 1 - (tail & q->mask);
+	for (i = 0, l = 0; i < n; i++) {
+		l += q->len[(tail + i) & q->mask];
+		if (q->len[(tail + i) & q->mask] != q->slot_size) {
+			i++;
+			break;
+		}
+	}
+	*len = l;
+	*nslots = i;
+	return q->buf + (size_t)(tail & q->mask) * q->slot_size;
+}
+
+void spsc_release(struct spsc *q, unsigned int nslots)
+{
+	__atomic_store_n(&q->tail, q->tail + nslots, __ATOMIC_SEQ_CST);
+	spsc_wake(q);
+}
+
+void spsc_close(struct spsc *q)
+{
+	__atomic_store_n(&q->closed, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_lock(&q->lock);
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+}
@@ -0,0 +1,59 @@
+/*
+  stm32flash - Open Source ST STM32 flash program for *nix
+  Copyright (C) 2026 The stm32flash contributors
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+
+
+#ifndef _H_SPSC
+#define _H_SPSC
+
+#include <stddef.h>
+
+/*
+ * Single producer, single consumer ring of fixed size slots, to connect
+ * two threads. The indexes are shared without lock; a side takes the
+ * lock only to sleep when the ring is full (producer) or empty (consumer)
+ * and the other side only to wake it.
+ * A slot is filled up to its size, but the last one: the consumer gets
+ * the consecutive full slots as one contiguous block.
+ */
+struct spsc;
+
+/* nslots is rounded up to a power of 2 */
+struct spsc *spsc_new(unsigned int nslots, size_t slot_size);
+void spsc_free(struct spsc *q);
+
+/*
+ * Producer: next free slot, waiting while the ring is full, then publish
+ * it with the length of its data. NULL once the ring is closed.
+ */
+void *spsc_get(struct spsc *q);
+void spsc_put(struct spsc *q, size_t len);
+
+/*
+ * Consumer: the data of the next slots, up to the first not full one or
+ * to the end of the buffer, waiting while the ring is empty, then give
+ * the slots back. NULL once the ring is closed and empty.
+ */
+const void *spsc_peek(struct spsc *q, size_t *len, unsigned int *nslots);
+void spsc_release(struct spsc *q, unsigned int nslots);
+
+/* either side: no more data, or stop the producer */
+void spsc_close(struct spsc *q);
+
+#endif
@@ -22,9 +22,9 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
-#include <time.h>
 #include <unistd.h>
 
+#include "crc.h"
 #include "stm32.h"
 #include "port.h"
 #include "utils.h"
@@ -55,13 +55,21 @@
 #define STM32_CMD_CRC	0xA1	/* compute CRC */
 #define STM32_CMD_ERR	0xFF	/* not a valid command */
 
-#define STM32_RESYNC_TIMEOUT	35	/* seconds */
-#define STM32_MASSERASE_TIMEOUT	35	/* seconds */
-#define STM32_PAGEERASE_TIMEOUT	5	/* seconds */
-#define STM32_BLKWRITE_TIMEOUT	1	/* seconds */
-#define STM32_WUNPROT_TIMEOUT	1	/* seconds */
-#define STM32_WPROT_TIMEOUT	1	/* seconds */
-#define STM32_RPROT_TIMEOUT	1	/* seconds */
+#define STM32_RESYNC_TIMEOUT	35000	/* ms */
+#define STM32_MASSERASE_TIMEOUT	35000	/* ms */
+#define STM32_PAGEERASE_TIMEOUT	5000	/* ms */
+#define STM32_BLKWRITE_TIMEOUT	1000	/* ms */
+#define STM32_PROT_TIMEOUT	1000	/* ms */
+
+/*
+ * Adaptive timeout: after STM32_ADAPT_SAMPLES replies of a command class,
+ * the deadline becomes STM32_ADAPT_FACTOR times the slowest reply seen,
+ * but never less than STM32_ADAPT_MIN_MS nor more than the configured
+ * timeout.
+ */
+#define STM32_ADAPT_SAMPLES	4
+#define STM32_ADAPT_FACTOR	4
+#define STM32_ADAPT_MIN_MS	20
 
 #define STM32_CMD_GET_LENGTH	17	/* bytes in the reply */
 
@@ -80,6 +88,68 @@ struct stm32_cmd {
 	uint8_t	crc;
 };
 
+struct stm32_ack_stat {
+	unsigned int samples;
+	unsigned int max_ms;	/* slowest reply, per unit */
+};
+
+/*
+ * Session statistics, per command and per phase. Bytes on the wire are
+ * accounted to the last command sent; ACK wait times are collected in a
+ * histogram with power of two buckets in us.
+ */
+#define STM32_STAT_HIST	24	/* last bucket: 2^23 us (8 s) and more */
+
+enum {
+	STM32_STAT_INIT = 0,
+	STM32_STAT_GET,
+	STM32_STAT_GVR,
+	STM32_STAT_GID,
+	STM32_STAT_RM,
+	STM32_STAT_GO,
+	STM32_STAT_WM,
+	STM32_STAT_ER,
+	STM32_STAT_WP,
+	STM32_STAT_UW,
+	STM32_STAT_RP,
+	STM32_STAT_UR,
+	STM32_STAT_CRC,
+	STM32_STAT_OTHER,
+	STM32_STAT_NUM
+};
+
+static const char *stm32_stat_name[STM32_STAT_NUM] = {
+	"INIT", "GET", "GVR", "GID", "RM", "GO", "WM", "ER",
+	"WP", "UW", "RP", "UR", "CRC", "OTHER",
+};
+
+static const char *stm32_phase_name[STM32_PHASE_NUM] = {
+	"init", "erase", "write", "verify", "read", "crc", "other",
+};
+
+struct stm32_cmd_stat {
+	unsigned long calls, nack, busy, errors, retries;
+	unsigned long long tx_bytes, rx_bytes;
+	unsigned long long ack_us, ack_max_us;
+	unsigned long hist[STM32_STAT_HIST];
+};
+
+struct stm32_stats {
+	struct stm32_cmd_stat cmd[STM32_STAT_NUM];
+	int cur;		/* command in progress */
+	int failed;		/* last command that failed, or -1 */
+	stm32_phase_t phase;
+	uint64_t phase_start;
+	unsigned long long phase_us[STM32_PHASE_NUM];
+};
+
+static const unsigned int stm32_default_timeout[STM32_TMO_NUM] = {
+	[STM32_TMO_WRITE]	= STM32_BLKWRITE_TIMEOUT,
+	[STM32_TMO_PAGE_ERASE]	= STM32_PAGEERASE_TIMEOUT,
+	[STM32_TMO_MASS_ERASE]	= STM32_MASSERASE_TIMEOUT,
+	[STM32_TMO_PROTECT]	= STM32_PROT_TIMEOUT,
+};
+
 /* Reset code for ARMv7-M (Cortex-M3) and ARMv6-M (Cortex-M0)
  * see ARMv7-M or ARMv6-M Architecture Reference Manual (table B3-8)
  * or "The definitive guide to the ARM Cortex-M3", section 14.4.
@@ -172,8 +242,6 @@ static const uint32_t stm_pempty_launch_code_length = sizeof(stm_pempty_launch_c
 
 extern const stm32_dev_t devices[];
 
-int flash_addr_to_page_ceil(uint32_t addr);
-
 static void stm32_warn_stretching(const char *f)
 {
 	fprintf(stderr, "Attention !!!\n");
@@ -183,42 +251,167 @@ static void stm32_warn_stretching(const char *f)
 	fprintf(stderr, "\tCheck \"I2C.txt\" in stm32flash source code.\n");
 }
 
-static stm32_err_t stm32_get_ack_timeout(const stm32_t *stm, time_t timeout)
+static int stm32_stat_slot(uint8_t cmd)
+{
+	switch (cmd) {
+	case STM32_CMD_INIT:	return STM32_STAT_INIT;
+	case STM32_CMD_GET:	return STM32_STAT_GET;
+	case STM32_CMD_GVR:	return STM32_STAT_GVR;
+	case STM32_CMD_GID:	return STM32_STAT_GID;
+	case STM32_CMD_RM:	return STM32_STAT_RM;
+	case STM32_CMD_GO:	return STM32_STAT_GO;
+	case STM32_CMD_WM:
+	case STM32_CMD_WM_NS:	return STM32_STAT_WM;
+	case STM32_CMD_ER:
+	case STM32_CMD_EE:
+	case STM32_CMD_EE_NS:	return STM32_STAT_ER;
+	case STM32_CMD_WP:
+	case STM32_CMD_WP_NS:	return STM32_STAT_WP;
+	case STM32_CMD_UW:
+	case STM32_CMD_UW_NS:	return STM32_STAT_UW;
+	case STM32_CMD_RP:
+	case STM32_CMD_RP_NS:	return STM32_STAT_RP;
+	case STM32_CMD_UR:
+	case STM32_CMD_UR_NS:	return STM32_STAT_UR;
+	case STM32_CMD_CRC:	return STM32_STAT_CRC;
+	}
+	return STM32_STAT_OTHER;
+}
+
+/* a new command starts; re-sending the one that just failed is a retry */
+static void stm32_stat_cmd(const stm32_t *stm, uint8_t cmd)
+{
+	struct stm32_stats *st = stm->stats;
+
+	if (!st)
+		return;
+	st->cur = stm32_stat_slot(cmd);
+	st->cmd[st->cur].calls++;
+	if (st->failed == st->cur)
+		st->cmd[st->cur].retries++;
+	st->failed = -1;
+}
+
+static void stm32_stat_ack(const stm32_t *stm, stm32_err_t s_err,
+			   uint64_t t0)
+{
+	struct stm32_stats *st = stm->stats;
+	struct stm32_cmd_stat *cs;
+	unsigned long long us;
+	int i;
+
+	if (!st)
+		return;
+	cs = &st->cmd[st->cur];
+	if (s_err != STM32_ERR_OK) {
+		if (s_err == STM32_ERR_NACK)
+			cs->nack++;
+		else
+			cs->errors++;
+		st->failed = st->cur;
+		return;
+	}
+	us = get_time_us() - t0;
+	cs->ack_us += us;
+	if (us > cs->ack_max_us)
+		cs->ack_max_us = us;
+	for (i = 0; i < STM32_STAT_HIST - 1 && us >> (i + 1); i++)
+		;
+	cs->hist[i]++;
+}
+
+static port_err_t stm32_port_read(const stm32_t *stm, void *buf, size_t nbyte)
+{
+	port_err_t p_err;
+
+	p_err = stm->port->read(stm->port, buf, nbyte);
+	if (stm->stats && p_err == PORT_ERR_OK)
+		stm->stats->cmd[stm->stats->cur].rx_bytes += nbyte;
+	return p_err;
+}
+
+static port_err_t stm32_port_read_deadline(const stm32_t *stm, void *buf,
+					   size_t nbyte, uint64_t deadline)
+{
+	port_err_t p_err;
+
+	p_err = port_read_deadline(stm->port, buf, nbyte, deadline);
+	if (stm->stats && p_err == PORT_ERR_OK)
+		stm->stats->cmd[stm->stats->cur].rx_bytes += nbyte;
+	return p_err;
+}
+
+static port_err_t stm32_port_write(const stm32_t *stm, void *buf, size_t nbyte)
+{
+	port_err_t p_err;
+
+	p_err = stm->port->write(stm->port, buf, nbyte);
+	if (stm->stats && p_err == PORT_ERR_OK)
+		stm->stats->cmd[stm->stats->cur].tx_bytes += nbyte;
+	return p_err;
+}
+
+static port_err_t stm32_port_writev(const stm32_t *stm,
+				    const struct port_iov *iov, int iovcnt)
+{
+	port_err_t p_err;
+	int i;
+
+	p_err = port_writev(stm->port, iov, iovcnt);
+	if (stm->stats && p_err == PORT_ERR_OK)
+		for (i = 0; i < iovcnt; i++)
+			stm->stats->cmd[stm->stats->cur].tx_bytes += iov[i].len;
+	return p_err;
+}
+
+static stm32_err_t stm32_get_ack_timeout(const stm32_t *stm, uint32_t timeout)
 {
 	struct port_interface *port = stm->port;
 	uint8_t byte;
 	port_err_t p_err;
-	time_t t0, t1;
+	stm32_err_t s_err;
+	uint64_t deadline = 0, t0 = 0;
 
 	if (!(port->flags & PORT_RETRY))
 		timeout = 0;
 
 	if (timeout)
-		time(&t0);
+		deadline = get_time_ms() + timeout;
+	if (stm->stats)
+		t0 = get_time_us();
 
 	do {
-		p_err = port->read(port, &byte, 1);
-		if (p_err == PORT_ERR_TIMEDOUT && timeout) {
-			time(&t1);
-			if (t1 < t0 + timeout)
-				continue;
-		}
+		if (timeout)
+			p_err = stm32_port_read_deadline(stm, &byte, 1, deadline);
+		else
+			p_err = stm32_port_read(stm, &byte, 1);
 
 		if (p_err != PORT_ERR_OK) {
 			fprintf(stderr, "Failed to read ACK byte\n");
-			return STM32_ERR_UNKNOWN;
+			s_err = STM32_ERR_UNKNOWN;
+			break;
 		}
 
-		if (byte == STM32_ACK)
-			return STM32_ERR_OK;
-		if (byte == STM32_NACK)
-			return STM32_ERR_NACK;
+		if (byte == STM32_ACK) {
+			s_err = STM32_ERR_OK;
+			break;
+		}
+		if (byte == STM32_NACK) {
+			s_err = STM32_ERR_NACK;
+			break;
+		}
 		if (byte != STM32_BUSY) {
 			fprintf(stderr, "Got byte 0x%02x instead of ACK\n",
 				byte);
-			return STM32_ERR_UNKNOWN;
+			s_err = STM32_ERR_UNKNOWN;
+			break;
 		}
+		if (stm->stats)
+			stm->stats->cmd[stm->stats->cur].busy++;
 	} while (1);
+
+	stm32_stat_ack(stm, s_err, t0);
+	return s_err;
 }
 
 static stm32_err_t stm32_get_ack(const stm32_t *stm)
@@ -226,18 +419,59 @@ static stm32_err_t stm32_get_ack(const stm32_t *stm)
 	return stm32_get_ack_timeout(stm, 0);
 }
 
-static stm32_err_t stm32_send_command_timeout(const stm32_t *stm,
-					      const uint8_t cmd,
-					      time_t timeout)
+/* timeout in ms for "units" (blocks, pages) of command class "tmo" */
+static uint32_t stm32_timeout(const stm32_t *stm, stm32_tmo_t tmo,
+			      unsigned int units)
+{
+	struct stm32_ack_stat *st;
+	uint32_t ms = stm->timeout[tmo];
+
+	if (stm->ack_stat) {
+		st = &stm->ack_stat[tmo];
+		if (st->samples >= STM32_ADAPT_SAMPLES
+		    && st->max_ms * STM32_ADAPT_FACTOR < ms) {
+			ms = st->max_ms * STM32_ADAPT_FACTOR;
+			if (ms < STM32_ADAPT_MIN_MS)
+				ms = STM32_ADAPT_MIN_MS;
+		}
+	}
+	return ms * units;
+}
+
+/* wait ACK for command class "tmo", learning the reply time if adaptive */
+static stm32_err_t stm32_get_ack_tmo(const stm32_t *stm, stm32_tmo_t tmo,
+				     unsigned int units)
+{
+	struct stm32_ack_stat *st;
+	stm32_err_t s_err;
+	uint64_t t0;
+	unsigned int ms;
+
+	t0 = get_time_ms();
+	s_err = stm32_get_ack_timeout(stm, stm32_timeout(stm, tmo, units));
+	if (s_err != STM32_ERR_OK || !stm->ack_stat)
+		return s_err;
+
+	st = &stm->ack_stat[tmo];
+	ms = (get_time_ms() - t0 + units - 1) / units;
+	if (ms > st->max_ms)
+		st->max_ms = ms;
+	st->samples++;
+	return s_err;
+}
+
+/* send a byte and its complement, as commands and some parameters */
+static stm32_err_t stm32_send_byte_timeout(const stm32_t *stm,
+					   const uint8_t cmd,
+					   uint32_t timeout)
 {
-	struct port_interface *port = stm->port;
 	stm32_err_t s_err;
 	port_err_t p_err;
 	uint8_t buf[2];
 
 	buf[0] = cmd;
 	buf[1] = cmd ^ 0xFF;
-	p_err = port->write(port, buf, 2);
+	p_err = stm32_port_write(stm, buf, 2);
 	if (p_err != PORT_ERR_OK) {
 		fprintf(stderr, "Failed to send command\n");
 		return STM32_ERR_UNKNOWN;
@@ -252,6 +486,14 @@ static stm32_err_t stm32_send_command_timeout(const stm32_t *stm,
 	return STM32_ERR_UNKNOWN;
 }
 
+static stm32_err_t stm32_send_command_timeout(const stm32_t *stm,
+					      const uint8_t cmd,
+					      uint32_t timeout)
+{
+	stm32_stat_cmd(stm, cmd);
+	return stm32_send_byte_timeout(stm, cmd, timeout);
+}
+
 static stm32_err_t stm32_send_command(const stm32_t *stm, const uint8_t cmd)
 {
 	return stm32_send_command_timeout(stm, cmd, 0);
@@ -260,31 +502,25 @@ static stm32_err_t stm32_send_command(const stm32_t *stm, const uint8_t cmd)
 /* if we have lost sync, send a wrong command and expect a NACK */
 static stm32_err_t stm32_resync(const stm32_t *stm)
 {
-	struct port_interface *port = stm->port;
 	port_err_t p_err;
 	uint8_t buf[2], ack;
-	time_t t0, t1;
+	uint64_t deadline;
 
-	time(&t0);
-	t1 = t0;
+	deadline = get_time_ms() + STM32_RESYNC_TIMEOUT;
 
 	buf[0] = STM32_CMD_ERR;
 	buf[1] = STM32_CMD_ERR ^ 0xFF;
-	while (t1 < t0 + STM32_RESYNC_TIMEOUT) {
-		p_err = port->write(port, buf, 2);
+	while (get_time_ms() < deadline) {
+		p_err = stm32_port_write(stm, buf, 2);
 		if (p_err != PORT_ERR_OK) {
 			usleep(500000);
-			time(&t1);
 			continue;
 		}
-		p_err = port->read(port, &ack, 1);
-		if (p_err != PORT_ERR_OK) {
-			time(&t1);
+		p_err = stm32_port_read(stm, &ack, 1);
+		if (p_err != PORT_ERR_OK)
 			continue;
-		}
 		if (ack == STM32_NACK)
 			return STM32_ERR_OK;
-		time(&t1);
 	}
 	return STM32_ERR_UNKNOWN;
 }
@@ -311,17 +547,17 @@ static stm32_err_t stm32_guess_len_cmd(const stm32_t *stm, uint8_t cmd,
 		return STM32_ERR_UNKNOWN;
 	if (port->flags & PORT_BYTE) {
 		/* interface is UART-like */
-		p_err = port->read(port, data, 1);
+		p_err = stm32_port_read(stm, data, 1);
 		if (p_err != PORT_ERR_OK)
 			return STM32_ERR_UNKNOWN;
 		len = data[0];
-		p_err = port->read(port, data + 1, len + 1);
+		p_err = stm32_port_read(stm, data + 1, len + 1);
 		if (p_err != PORT_ERR_OK)
 			return STM32_ERR_UNKNOWN;
 		return STM32_ERR_OK;
 	}
 
-	p_err = port->read(port, data, len + 2);
+	p_err = stm32_port_read(stm, data, len + 2);
 	if (p_err == PORT_ERR_OK && len == data[0])
 		return STM32_ERR_OK;
 	if (p_err != PORT_ERR_OK) {
@@ -330,7 +566,7 @@ static stm32_err_t stm32_guess_len_cmd(const stm32_t *stm, uint8_t cmd,
 			return STM32_ERR_UNKNOWN;
 		if (stm32_send_command(stm, cmd) != STM32_ERR_OK)
 			return STM32_ERR_UNKNOWN;
-		p_err = port->read(port, data, 1);
+		p_err = stm32_port_read(stm, data, 1);
 		if (p_err != PORT_ERR_OK)
 			return STM32_ERR_UNKNOWN;
 	}
@@ -342,7 +578,7 @@ static stm32_err_t stm32_guess_len_cmd(const stm32_t *stm, uint8_t cmd,
 	len = data[0];
 	if (stm32_send_command(stm, cmd) != STM32_ERR_OK)
 		return STM32_ERR_UNKNOWN;
-	p_err = port->read(port, data, len + 2);
+	p_err = stm32_port_read(stm, data, len + 2);
 	if (p_err != PORT_ERR_OK)
 		return STM32_ERR_UNKNOWN;
 	return STM32_ERR_OK;
@@ -362,16 +598,16 @@ static stm32_err_t stm32_guess_len_cmd(const stm32_t *stm, uint8_t cmd,
  */
 static stm32_err_t stm32_send_init_seq(const stm32_t *stm)
 {
-	struct port_interface *port = stm->port;
 	port_err_t p_err;
 	uint8_t byte, cmd = STM32_CMD_INIT;
 
-	p_err = port->write(port, &cmd, 1);
+	stm32_stat_cmd(stm, cmd);
+	p_err = stm32_port_write(stm, &cmd, 1);
 	if (p_err != PORT_ERR_OK) {
 		fprintf(stderr, "Failed to send init to device\n");
 		return STM32_ERR_UNKNOWN;
 	}
-	p_err = port->read(port, &byte, 1);
+	p_err = stm32_port_read(stm, &byte, 1);
 	if (p_err == PORT_ERR_OK && byte == STM32_ACK)
 		return STM32_ERR_OK;
 	if (p_err == PORT_ERR_OK && byte == STM32_NACK) {
@@ -389,12 +625,12 @@ static stm32_err_t stm32_send_init_seq(const stm32_t *stm)
 	 * Check if previous STM32_CMD_INIT was taken as first byte
 	 * of a command. Send a new byte, we should get back a NACK.
 	 */
-	p_err = port->write(port, &cmd, 1);
+	p_err = stm32_port_write(stm, &cmd, 1);
 	if (p_err != PORT_ERR_OK) {
 		fprintf(stderr, "Failed to send init to device\n");
 		return STM32_ERR_UNKNOWN;
 	}
-	p_err = port->read(port, &byte, 1);
+	p_err = stm32_port_read(stm, &byte, 1);
 	if (p_err == PORT_ERR_OK && byte == STM32_NACK)
 		return STM32_ERR_OK;
 	fprintf(stderr, "Failed to init device.\n");
@@ -406,49 +642,13 @@ static stm32_err_t stm32_send_init_seq(const stm32_t *stm)
 			? (a) \
 			: (((prev) > (a)) ? (prev) : (a)))
 
-stm32_t *stm32_init(struct port_interface *port, const char init)
+/* decode the reply of GET, as in "buf" */
+static void stm32_parse_get(stm32_t *stm, const uint8_t *buf)
 {
-	uint8_t len, val, buf[257];
-	stm32_t *stm;
-	int i, new_cmds;
-
-	stm      = calloc(sizeof(stm32_t), 1);
-	stm->cmd = malloc(sizeof(stm32_cmd_t));
-	memset(stm->cmd, STM32_CMD_ERR, sizeof(stm32_cmd_t));
-	stm->port = port;
-
-	if ((port->flags & PORT_CMD_INIT) && init)
-		if (stm32_send_init_seq(stm) != STM32_ERR_OK)
-			return NULL;
-
-	/* get the version and read protection status  */
-	if (stm32_send_command(stm, STM32_CMD_GVR) != STM32_ERR_OK) {
-		stm32_close(stm);
-		return NULL;
-	}
-
-	/* From AN, only UART bootloader returns 3 bytes */
-	len = (port->flags & PORT_GVR_ETX) ? 3 : 1;
-	if (port->read(port, buf, len) != PORT_ERR_OK)
-		return NULL;
-	stm->version = buf[0];
-	stm->option1 = (port->flags & PORT_GVR_ETX) ? buf[1] : 0;
-	stm->option2 = (port->flags & PORT_GVR_ETX) ? buf[2] : 0;
-	if (stm32_get_ack(stm) != STM32_ERR_OK) {
-		stm32_close(stm);
-		return NULL;
-	}
+	unsigned int i, len;
+	int new_cmds;
+	uint8_t val;
 
-	/* get the bootloader information */
-	len = STM32_CMD_GET_LENGTH;
-	if (port->cmd_get_reply)
-		for (i = 0; port->cmd_get_reply[i].length; i++)
-			if (stm->version == port->cmd_get_reply[i].version) {
-				len = port->cmd_get_reply[i].length;
-				break;
-			}
-	if (stm32_guess_len_cmd(stm, STM32_CMD_GET, buf, len) != STM32_ERR_OK)
-		return NULL;
 	len = buf[0] + 1;
 	stm->bl_version = buf[1];
 	new_cmds = 0;
@@ -504,40 +704,30 @@ stm32_t *stm32_init(struct port_interface *port, const char init)
 	}
 	if (new_cmds)
 		fprintf(stderr, ")\n");
-	if (stm32_get_ack(stm) != STM32_ERR_OK) {
-		stm32_close(stm);
-		return NULL;
-	}
+}
 
-	if (stm->cmd->get == STM32_CMD_ERR
-	    || stm->cmd->gvr == STM32_CMD_ERR
-	    || stm->cmd->gid == STM32_CMD_ERR) {
-		fprintf(stderr, "Error: bootloader did not returned correct information from GET command\n");
-		return NULL;
-	}
+/* read the device ID with command GID and look it up in devices[] */
+static stm32_err_t stm32_get_id(stm32_t *stm, int verbose)
+{
+	uint8_t buf[257];
+	int i, len;
 
-	/* get the device ID */
-	if (stm32_guess_len_cmd(stm, stm->cmd->gid, buf, 1) != STM32_ERR_OK) {
-		stm32_close(stm);
-		return NULL;
-	}
+	if (stm32_guess_len_cmd(stm, stm->cmd->gid, buf, 1) != STM32_ERR_OK)
+		return STM32_ERR_UNKNOWN;
 	len = buf[0] + 1;
 	if (len < 2) {
-		stm32_close(stm);
 		fprintf(stderr, "Only %d bytes sent in the PID, unknown/unsupported device\n", len);
-		return NULL;
+		return STM32_ERR_UNKNOWN;
 	}
 	stm->pid = (buf[1] << 8) | buf[2];
-	if (len > 2) {
+	if (len > 2 && verbose) {
 		fprintf(stderr, "This bootloader returns %d extra bytes in PID:", len);
 		for (i = 2; i <= len ; i++)
 			fprintf(stderr, " %02x", buf[i]);
 		fprintf(stderr, "\n");
 	}
-	if (stm32_get_ack(stm) != STM32_ERR_OK) {
-		stm32_close(stm);
-		return NULL;
-	}
+	if (stm32_get_ack(stm) != STM32_ERR_OK)
+		return STM32_ERR_UNKNOWN;
 
 	stm->dev = devices;
 	while (stm->dev->id != 0x00 && stm->dev->id != stm->pid)
@@ -545,24 +735,272 @@ stm32_t *stm32_init(struct port_interface *port, const char init)
 
 	if (!stm->dev->id) {
 		fprintf(stderr, "Unknown/unsupported device (Device ID: 0x%03x)\n", stm->pid);
+		return STM32_ERR_UNKNOWN;
+	}
+	return STM32_ERR_OK;
+}
+
+/*
+ * Use the profile of a previous session: only GID is sent and, if the
+ * device ID matches, version and commands are taken from the profile.
+ */
+static stm32_err_t stm32_use_profile(stm32_t *stm,
+				     const struct stm32_profile *prof)
+{
+	stm->cmd->gid = STM32_CMD_GID;
+	if (stm32_get_id(stm, 0) != STM32_ERR_OK || stm->pid != prof->pid) {
+		memset(stm->cmd, STM32_CMD_ERR, sizeof(stm32_cmd_t));
+		return STM32_ERR_UNKNOWN;
+	}
+
+	stm->version = prof->version;
+	stm->option1 = prof->option1;
+	stm->option2 = prof->option2;
+	stm32_parse_get(stm, prof->get);
+	if (stm->cmd->gid != STM32_CMD_GID)
+		return STM32_ERR_UNKNOWN;
+	return STM32_ERR_OK;
+}
+
+stm32_t *stm32_init(struct port_interface *port, const char init)
+{
+	return stm32_init_profile(port, init, NULL);
+}
+
+/*
+ * As stm32_init(). With a valid "prof", from a previous session on the
+ * same port, the discovery is reduced to GID when the device ID matches.
+ * Otherwise, "prof" is filled with the result of the discovery.
+ */
+stm32_t *stm32_init_profile(struct port_interface *port, const char init,
+			    struct stm32_profile *prof)
+{
+	uint8_t len, buf[257];
+	stm32_t *stm;
+	int i;
+
+	stm      = calloc(sizeof(stm32_t), 1);
+	stm->cmd = malloc(sizeof(stm32_cmd_t));
+	memset(stm->cmd, STM32_CMD_ERR, sizeof(stm32_cmd_t));
+	stm->port = port;
+	memcpy(stm->timeout, stm32_default_timeout, sizeof(stm->timeout));
+	stm->stats = calloc(1, sizeof(*stm->stats));
+	if (stm->stats) {
+		stm->stats->cur = STM32_STAT_OTHER;
+		stm->stats->failed = -1;
+		stm->stats->phase = STM32_PHASE_INIT;
+		stm->stats->phase_start = get_time_us();
+	}
+
+	if ((port->flags & PORT_CMD_INIT) && init)
+		if (stm32_send_init_seq(stm) != STM32_ERR_OK)
+			return NULL;
+
+	if (prof && prof->valid) {
+		if (stm32_use_profile(stm, prof) == STM32_ERR_OK)
+			return stm;
+		prof->valid = 0;
+	}
+
+	/* get the version and read protection status  */
+	if (stm32_send_command(stm, STM32_CMD_GVR) != STM32_ERR_OK) {
+		stm32_close(stm);
+		return NULL;
+	}
+
+	/* From AN, only UART bootloader returns 3 bytes */
+	len = (port->flags & PORT_GVR_ETX) ? 3 : 1;
+	if (stm32_port_read(stm, buf, len) != PORT_ERR_OK)
+		return NULL;
+	stm->version = buf[0];
+	stm->option1 = (port->flags & PORT_GVR_ETX) ? buf[1] : 0;
+	stm->option2 = (port->flags & PORT_GVR_ETX) ? buf[2] : 0;
+	if (stm32_get_ack(stm) != STM32_ERR_OK) {
+		stm32_close(stm);
+		return NULL;
+	}
+
+	/* get the bootloader information */
+	len = STM32_CMD_GET_LENGTH;
+	if (port->cmd_get_reply)
+		for (i = 0; port->cmd_get_reply[i].length; i++)
+			if (stm->version == port->cmd_get_reply[i].version) {
+				len = port->cmd_get_reply[i].length;
+				break;
+			}
+	/* a previous session knows the length of this bootloader */
+	if (prof && prof->get[0] && prof->version == stm->version)
+		len = prof->get[0];
+	if (stm32_guess_len_cmd(stm, STM32_CMD_GET, buf, len) != STM32_ERR_OK)
+		return NULL;
+	stm32_parse_get(stm, buf);
+	if (prof) {
+		memset(prof, 0, sizeof(*prof));
+		if (buf[0] + 2 <= (int)sizeof(prof->get))
+			memcpy(prof->get, buf, buf[0] + 2);
+	}
+	if (stm32_get_ack(stm) != STM32_ERR_OK) {
 		stm32_close(stm);
 		return NULL;
 	}
 
+	if (stm->cmd->get == STM32_CMD_ERR
+	    || stm->cmd->gvr == STM32_CMD_ERR
+	    || stm->cmd->gid == STM32_CMD_ERR) {
+		fprintf(stderr, "Error: bootloader did not returned correct information from GET command\n");
+		return NULL;
+	}
+
+	/* get the device ID */
+	if (stm32_get_id(stm, 1) != STM32_ERR_OK) {
+		stm32_close(stm);
+		return NULL;
+	}
+
+	if (prof && prof->get[0]) {
+		prof->version = stm->version;
+		prof->option1 = stm->option1;
+		prof->option2 = stm->option2;
+		prof->pid = stm->pid;
+		prof->valid = 1;
+	}
 	return stm;
 }
 
 void stm32_close(stm32_t *stm)
 {
-	if (stm)
+	if (stm) {
 		free(stm->cmd);
+		free(stm->ack_stat);
+		free(stm->stats);
+	}
 	free(stm);
 }
 
+/* override the default ACK timeout of a command class; 0 restores it */
+void stm32_set_timeout(stm32_t *stm, stm32_tmo_t tmo, unsigned int ms)
+{
+	stm->timeout[tmo] = ms ? ms : stm32_default_timeout[tmo];
+}
+
+/*
+ * In adaptive mode the ACK timeout of each command class is derived from
+ * the reply time measured during the session.
+ */
+int stm32_set_adaptive_timeout(stm32_t *stm, int enable)
+{
+	free(stm->ack_stat);
+	stm->ack_stat = NULL;
+	if (!enable)
+		return 0;
+
+	stm->ack_stat = calloc(STM32_TMO_NUM, sizeof(*stm->ack_stat));
+	return stm->ack_stat ? 0 : -1;
+}
+
+/* account the time up to now to the current phase, then switch phase */
+void stm32_stats_phase(const stm32_t *stm, stm32_phase_t phase)
+{
+	struct stm32_stats *st = stm->stats;
+	uint64_t now;
+
+	if (!st)
+		return;
+	now = get_time_us();
+	st->phase_us[st->phase] += now - st->phase_start;
+	st->phase = phase;
+	st->phase_start = now;
+}
+
+/* upper bound in us of the bucket holding the given percentile */
+static unsigned long long stm32_stat_percentile(const struct stm32_cmd_stat *cs,
+						unsigned int pct)
+{
+	unsigned long n, acked = 0;
+	int i;
+
+	for (i = 0; i < STM32_STAT_HIST; i++)
+		acked += cs->hist[i];
+	if (!acked)
+		return 0;
+	n = 0;
+	for (i = 0; i < STM32_STAT_HIST - 1; i++) {
+		n += cs->hist[i];
+		if (n * 100 >= acked * pct)
+			break;
+	}
+	return (2ULL << i) - 1;
+}
+
+void stm32_stats_print(const stm32_t *stm, FILE *f, int json)
+{
+	struct stm32_stats *st = stm->stats;
+	const struct port_stats *ps = &stm->port->stats;
+	const struct stm32_cmd_stat *cs;
+	unsigned long acked;
+	int i, j, first = 1;
+
+	if (!st)
+		return;
+	stm32_stats_phase(stm, st->phase);
+
+	if (!json) {
+		fprintf(f, "%-5s %7s %9s %9s %5s %5s %5s %5s %9s %9s %9s\n",
+			"cmd", "calls", "tx_bytes", "rx_bytes", "nack", "busy",
+			"err", "retry", "ack_avg", "ack_p99", "ack_max");
+		for (i = 0; i < STM32_STAT_NUM; i++) {
+			cs = &st->cmd[i];
+			if (!cs->calls)
+				continue;
+			for (acked = 0, j = 0; j < STM32_STAT_HIST; j++)
+				acked += cs->hist[j];
+			fprintf(f, "%-5s %7lu %9llu %9llu %5lu %5lu %5lu %5lu "
+				"%7lluus %7lluus %7lluus\n",
+				stm32_stat_name[i], cs->calls, cs->tx_bytes,
+				cs->rx_bytes, cs->nack, cs->busy, cs->errors,
+				cs->retries, acked ? cs->ack_us / acked : 0,
+				stm32_stat_percentile(cs, 99), cs->ack_max_us);
+		}
+		fprintf(f, "phase");
+		for (i = 0; i < STM32_PHASE_NUM; i++)
+			if (st->phase_us[i])
+				fprintf(f, " %s=%.3fs", stm32_phase_name[i],
+					st->phase_us[i] / 1e6);
+		fprintf(f, "\nport  reads=%lu syscalls=%lu buffered=%lu\n",
+			ps->rx_calls, ps->rx_syscalls, ps->rx_buffered);
+		return;
+	}
+
+	fprintf(f, "{\"commands\": {");
+	for (i = 0; i < STM32_STAT_NUM; i++) {
+		cs = &st->cmd[i];
+		if (!cs->calls)
+			continue;
+		fprintf(f, "%s\n  \"%s\": {\"calls\": %lu, \"tx_bytes\": %llu, "
+			"\"rx_bytes\": %llu, \"nack\": %lu, \"busy\": %lu, "
+			"\"errors\": %lu, \"retries\": %lu, "
+			"\"ack_total_us\": %llu, \"ack_max_us\": %llu, "
+			"\"ack_hist_log2_us\": [",
+			first ? "" : ",", stm32_stat_name[i], cs->calls,
+			cs->tx_bytes, cs->rx_bytes, cs->nack, cs->busy,
+			cs->errors, cs->retries, cs->ack_us, cs->ack_max_us);
+		for (j = 0; j < STM32_STAT_HIST; j++)
+			fprintf(f, "%s%lu", j ? ", " : "", cs->hist[j]);
+		fprintf(f, "]}");
+		first = 0;
+	}
+	fprintf(f, "},\n \"phases_us\": {");
+	for (i = 0; i < STM32_PHASE_NUM; i++)
+		fprintf(f, "%s\"%s\": %llu", i ? ", " : "",
+			stm32_phase_name[i], st->phase_us[i]);
+	fprintf(f, "},\n \"port\": {\"rx_calls\": %lu, \"rx_syscalls\": %lu, "
+		"\"rx_buffered\": %lu}}\n",
+		ps->rx_calls, ps->rx_syscalls, ps->rx_buffered);
+}
+
 stm32_err_t stm32_read_memory(const stm32_t *stm, uint32_t address,
 			      uint8_t data[], unsigned int len)
 {
-	struct port_interface *port = stm->port;
 	uint8_t buf[5];
 
 	if (!len)
@@ -586,28 +1024,38 @@ stm32_err_t stm32_read_memory(const stm32_t *stm, uint32_t address,
 	buf[2] = (address >> 8) & 0xFF;
 	buf[3] = address & 0xFF;
 	buf[4] = buf[0] ^ buf[1] ^ buf[2] ^ buf[3];
-	if (port->write(port, buf, 5) != PORT_ERR_OK)
+	if (stm32_port_write(stm, buf, 5) != PORT_ERR_OK)
 		return STM32_ERR_UNKNOWN;
 	if (stm32_get_ack(stm) != STM32_ERR_OK)
 		return STM32_ERR_UNKNOWN;
 
-	if (stm32_send_command(stm, len - 1) != STM32_ERR_OK)
+	if (stm32_send_byte_timeout(stm, len - 1, 0) != STM32_ERR_OK)
 		return STM32_ERR_UNKNOWN;
 
-	if (port->read(port, data, len) != PORT_ERR_OK)
+	if (stm32_port_read(stm, data, len) != PORT_ERR_OK)
 		return STM32_ERR_UNKNOWN;
 
 	return STM32_ERR_OK;
 }
 
-stm32_err_t stm32_write_memory(const stm32_t *stm, uint32_t address,
-			       const uint8_t data[], unsigned int len)
+/*
+ * Write the data in segments "data" to the device memory. The frame is
+ * sent with a scatter-gather write, so the payload is never copied.
+ */
+static stm32_err_t stm32_write_memory_iov(const stm32_t *stm, uint32_t address,
+					  const struct port_iov *data, int cnt)
 {
 	struct port_interface *port = stm->port;
-	uint8_t cs, buf[256 + 2];
-	unsigned int i, aligned_len;
+	uint8_t cs, buf[5], pad[3] = { 0xFF, 0xFF, 0xFF };
+	struct port_iov iov[cnt + 3];
+	unsigned int i, j, len, aligned_len;
+	const uint8_t *p;
 	stm32_err_t s_err;
 
+	len = 0;
+	for (i = 0; i < (unsigned int)cnt; i++)
+		len += data[i].len;
+
 	if (!len)
 		return STM32_ERR_OK;
 
@@ -636,7 +1084,7 @@ stm32_err_t stm32_write_memory(const stm32_t *stm, uint32_t address,
 	buf[2] = (address >> 8) & 0xFF;
 	buf[3] = address & 0xFF;
 	buf[4] = buf[0] ^ buf[1] ^ buf[2] ^ buf[3];
-	if (port->write(port, buf, 5) != PORT_ERR_OK)
+	if (stm32_port_write(stm, buf, 5) != PORT_ERR_OK)
 		return STM32_ERR_UNKNOWN;
 	if (stm32_get_ack(stm) != STM32_ERR_OK)
 		return STM32_ERR_UNKNOWN;
@@ -644,20 +1092,26 @@ stm32_err_t stm32_write_memory(const stm32_t *stm, uint32_t address,
 	aligned_len = (len + 3) & ~3;
 	cs = aligned_len - 1;
 	buf[0] = aligned_len - 1;
-	for (i = 0; i < len; i++) {
-		cs ^= data[i];
-		buf[i + 1] = data[i];
+	iov[0].buf = buf;
+	iov[0].len = 1;
+	for (i = 0; i < (unsigned int)cnt; i++) {
+		p = data[i].buf;
+		for (j = 0; j < data[i].len; j++)
+			cs ^= p[j];
+		iov[i + 1] = data[i];
 	}
 	/* padding data */
-	for (i = len; i < aligned_len; i++) {
+	for (i = len; i < aligned_len; i++)
 		cs ^= 0xFF;
-		buf[i + 1] = 0xFF;
-	}
-	buf[aligned_len + 1] = cs;
-	if (port->write(port, buf, aligned_len + 2) != PORT_ERR_OK)
+	iov[cnt + 1].buf = pad;
+	iov[cnt + 1].len = aligned_len - len;
+	buf[1] = cs;
+	iov[cnt + 2].buf = buf + 1;
+	iov[cnt + 2].len = 1;
+	if (stm32_port_writev(stm, iov, cnt + 3) != PORT_ERR_OK)
 		return STM32_ERR_UNKNOWN;
 
-	s_err = stm32_get_ack_timeout(stm, STM32_BLKWRITE_TIMEOUT);
+	s_err = stm32_get_ack_tmo(stm, STM32_TMO_WRITE, 1);
 	if (s_err != STM32_ERR_OK) {
 		if ((port->flags & PORT_STRETCH_W)
 		    && stm->cmd->wm != STM32_CMD_WM_NS)
@@ -667,6 +1121,14 @@ stm32_err_t stm32_write_memory(const stm32_t *stm, uint32_t address,
 	return STM32_ERR_OK;
 }
 
+stm32_err_t stm32_write_memory(const stm32_t *stm, uint32_t address,
+			       const uint8_t data[], unsigned int len)
+{
+	struct port_iov iov = { data, len };
+
+	return stm32_write_memory_iov(stm, address, &iov, 1);
+}
+
 stm32_err_t stm32_wunprot_memory(const stm32_t *stm)
 {
 	struct port_interface *port = stm->port;
@@ -680,7 +1142,7 @@ stm32_err_t stm32_wunprot_memory(const stm32_t *stm)
 	if (stm32_send_command(stm, stm->cmd->uw) != STM32_ERR_OK)
 		return STM32_ERR_UNKNOWN;
 
-	s_err = stm32_get_ack_timeout(stm, STM32_WUNPROT_TIMEOUT);
+	s_err = stm32_get_ack_tmo(stm, STM32_TMO_PROTECT, 1);
 	if (s_err == STM32_ERR_NACK) {
 		fprintf(stderr, "Error: Failed to WRITE UNPROTECT\n");
 		return STM32_ERR_UNKNOWN;
@@ -707,7 +1169,7 @@ stm32_err_t stm32_wprot_memory(const stm32_t *stm)
 	if (stm32_send_command(stm, stm->cmd->wp) != STM32_ERR_OK)
 		return STM32_ERR_UNKNOWN;
 
-	s_err = stm32_get_ack_timeout(stm, STM32_WPROT_TIMEOUT);
+	s_err = stm32_get_ack_tmo(stm, STM32_TMO_PROTECT, 1);
 	if (s_err == STM32_ERR_NACK) {
 		fprintf(stderr, "Error: Failed to WRITE PROTECT\n");
 		return STM32_ERR_UNKNOWN;
@@ -734,7 +1196,7 @@ stm32_err_t stm32_runprot_memory(const stm32_t *stm)
 	if (stm32_send_command(stm, stm->cmd->ur) != STM32_ERR_OK)
 		return STM32_ERR_UNKNOWN;
 
-	s_err = stm32_get_ack_timeout(stm, STM32_MASSERASE_TIMEOUT);
+	s_err = stm32_get_ack_tmo(stm, STM32_TMO_MASS_ERASE, 1);
 	if (s_err == STM32_ERR_NACK) {
 		fprintf(stderr, "Error: Failed to READOUT UNPROTECT\n");
 		return STM32_ERR_UNKNOWN;
@@ -761,7 +1223,7 @@ stm32_err_t stm32_readprot_memory(const stm32_t *stm)
 	if (stm32_send_command(stm, stm->cmd->rp) != STM32_ERR_OK)
 		return STM32_ERR_UNKNOWN;
 
-	s_err = stm32_get_ack_timeout(stm, STM32_RPROT_TIMEOUT);
+	s_err = stm32_get_ack_tmo(stm, STM32_TMO_PROTECT, 1);
 	if (s_err == STM32_ERR_NACK) {
 		fprintf(stderr, "Error: Failed to READOUT PROTECT\n");
 		return STM32_ERR_UNKNOWN;
@@ -788,7 +1250,8 @@ static stm32_err_t stm32_mass_erase(const stm32_t *stm)
 
 	/* regular erase (0x43) */
 	if (stm->cmd->er == STM32_CMD_ER) {
-		s_err = stm32_send_command_timeout(stm, 0xFF, STM32_MASSERASE_TIMEOUT);
+		s_err = stm32_send_byte_timeout(stm, 0xFF,
+				stm32_timeout(stm, STM32_TMO_MASS_ERASE, 1));
 		if (s_err != STM32_ERR_OK) {
 			if (port->flags & PORT_STRETCH_W)
 				stm32_warn_stretching("mass erase");
@@ -801,11 +1264,11 @@ static stm32_err_t stm32_mass_erase(const stm32_t *stm)
 	buf[0] = 0xFF;	/* 0xFFFF the magic number for mass erase */
 	buf[1] = 0xFF;
 	buf[2] = 0x00;  /* checksum */
-	if (port->write(port, buf, 3) != PORT_ERR_OK) {
+	if (stm32_port_write(stm, buf, 3) != PORT_ERR_OK) {
 		fprintf(stderr, "Mass erase error.\n");
 		return STM32_ERR_UNKNOWN;
 	}
-	s_err = stm32_get_ack_timeout(stm, STM32_MASSERASE_TIMEOUT);
+	s_err = stm32_get_ack_tmo(stm, STM32_TMO_MASS_ERASE, 1);
 	if (s_err != STM32_ERR_OK) {
 		fprintf(stderr, "Mass erase failed. Try specifying the number of pages to be erased.\n");
 		if ((port->flags & PORT_STRETCH_W)
@@ -816,6 +1279,70 @@ static stm32_err_t stm32_mass_erase(const stm32_t *stm)
 	return STM32_ERR_OK;
 }
 
+/* returns the flash page that contains address "addr" */
+int stm32_addr_to_page_floor(const stm32_t *stm, uint32_t addr)
+{
+	int page;
+	uint32_t *psize;
+
+	if (!(addr >= stm->dev->fl_start && addr < stm->dev->fl_end))
+		return 0;
+
+	page = 0;
+	addr -= stm->dev->fl_start;
+	psize = stm->dev->fl_ps;
+
+	while (addr >= psize[0]) {
+		addr -= psize[0];
+		page++;
+		if (psize[1])
+			psize++;
+	}
+
+	return page;
+}
+
+/* returns the first flash page whose start addr is >= "addr" */
+int stm32_addr_to_page_ceil(const stm32_t *stm, uint32_t addr)
+{
+	int page;
+	uint32_t *psize;
+
+	if (!(addr >= stm->dev->fl_start && addr <= stm->dev->fl_end))
+		return 0;
+
+	page = 0;
+	addr -= stm->dev->fl_start;
+	psize = stm->dev->fl_ps;
+
+	while (addr >= psize[0]) {
+		addr -= psize[0];
+		page++;
+		if (psize[1])
+			psize++;
+	}
+
+	return addr ? page + 1 : page;
+}
+
+/* returns the lower address of flash page "page" */
+uint32_t stm32_page_to_addr(const stm32_t *stm, int page)
+{
+	int i;
+	uint32_t addr, *psize;
+
+	addr = stm->dev->fl_start;
+	psize = stm->dev->fl_ps;
+
+	for (i = 0; i < page; i++) {
+		addr += psize[0];
+		if (psize[1])
+			psize++;
+	}
+
+	return addr;
+}
+
 static stm32_err_t stm32_pages_erase(const stm32_t *stm, uint32_t spage, uint32_t pages)
 {
 	struct port_interface *port = stm->port;
@@ -848,13 +1375,13 @@ static stm32_err_t stm32_pages_erase(const stm32_t *stm, uint32_t spage, uint32_
 			cs ^= pg_num;
 		}
 		buf[i++] = cs;
-		p_err = port->write(port, buf, i);
+		p_err = stm32_port_write(stm, buf, i);
 		free(buf);
 		if (p_err != PORT_ERR_OK) {
 			fprintf(stderr, "Erase failed.\n");
 			return STM32_ERR_UNKNOWN;
 		}
-		s_err = stm32_get_ack_timeout(stm, pages * STM32_PAGEERASE_TIMEOUT);
+		s_err = stm32_get_ack_tmo(stm, STM32_TMO_PAGE_ERASE, pages);
 		if (s_err != STM32_ERR_OK) {
 			if (port->flags & PORT_STRETCH_W)
 				stm32_warn_stretching("erase");
@@ -885,14 +1412,14 @@ static stm32_err_t stm32_pages_erase(const stm32_t *stm, uint32_t spage, uint32_
 		buf[i++] = pg_byte;
 	}
 	buf[i++] = cs;
-	p_err = port->write(port, buf, i);
+	p_err = stm32_port_write(stm, buf, i);
 	free(buf);
 	if (p_err != PORT_ERR_OK) {
 		fprintf(stderr, "Page-by-page erase error.\n");
 		return STM32_ERR_UNKNOWN;
 	}
 
-	s_err = stm32_get_ack_timeout(stm, pages * STM32_PAGEERASE_TIMEOUT);
+	s_err = stm32_get_ack_tmo(stm, STM32_TMO_PAGE_ERASE, pages);
 	if (s_err != STM32_ERR_OK) {
 		fprintf(stderr, "Page-by-page erase failed. Check the maximum pages your device supports.\n");
 		if ((port->flags & PORT_STRETCH_W)
@@ -932,7 +1459,7 @@ stm32_err_t stm32_erase_memory(const stm32_t *stm, uint32_t spage, uint32_t page
 		if (!(stm->dev->flags & F_NO_ME))
 			return stm32_mass_erase(stm);
 
-		pages = flash_addr_to_page_ceil(stm->dev->fl_end);
+		pages = stm32_addr_to_page_ceil(stm, stm->dev->fl_end);
 	}
 
 	/*
@@ -954,11 +1481,10 @@ static stm32_err_t stm32_run_raw_code(const stm32_t *stm,
 				      uint32_t target_address,
 				      const uint8_t *code, uint32_t code_size)
 {
-	uint32_t stack_le = le_u32(0x20002000);
-	uint32_t code_address_le = le_u32(target_address + 8 + 1); // thumb mode address (!)
-	uint32_t length = code_size + 8;
-	uint8_t *mem, *pos;
-	uint32_t address, w;
+	uint32_t vectors[2];
+	struct port_iov iov[2];
+	uint32_t address, end, w;
+	int n;
 
 	/* Must be 32-bit aligned */
 	if (target_address & 0x3) {
@@ -966,35 +1492,40 @@ static stm32_err_t stm32_run_raw_code(const stm32_t *stm,
 		return STM32_ERR_UNKNOWN;
 	}
 
-	mem = malloc(length);
-	if (!mem)
-		return STM32_ERR_UNKNOWN;
-
-	memcpy(mem, &stack_le, sizeof(uint32_t));
-	memcpy(mem + 4, &code_address_le, sizeof(uint32_t));
-	memcpy(mem + 8, code, code_size);
+	/* stack pointer and thumb mode (!) reset vector, ahead of the code */
+	vectors[0] = le_u32(0x20002000);
+	vectors[1] = le_u32(target_address + 8 + 1);
 
-	pos = mem;
 	address = target_address;
-	while (length > 0) {
-		w = length > 256 ? 256 : length;
-		if (stm32_write_memory(stm, address, pos, w) != STM32_ERR_OK) {
-			free(mem);
-			return STM32_ERR_UNKNOWN;
+	end = target_address + sizeof(vectors) + code_size;
+	while (address < end) {
+		n = 0;
+		w = 256;
+		if (address == target_address) {
+			iov[n].buf = vectors;
+			iov[n].len = sizeof(vectors);
+			w -= sizeof(vectors);
+			n++;
 		}
+		if (w > code_size)
+			w = code_size;
+		iov[n].buf = code;
+		iov[n].len = w;
+		n++;
+
+		if (stm32_write_memory_iov(stm, address, iov, n) != STM32_ERR_OK)
+			return STM32_ERR_UNKNOWN;
 
-		address += w;
-		pos += w;
-		length -= w;
+		address += (n == 2 ? sizeof(vectors) : 0) + w;
+		code += w;
+		code_size -= w;
 	}
 
-	free(mem);
 	return stm32_go(stm, target_address);
 }
 
 stm32_err_t stm32_go(const stm32_t *stm, uint32_t address)
 {
-	struct port_interface *port = stm->port;
 	uint8_t buf[5];
 
 	if (stm->cmd->go == STM32_CMD_ERR) {
@@ -1010,7 +1541,7 @@ stm32_err_t stm32_go(const stm32_t *stm, uint32_t address)
 	buf[2] = (address >> 8) & 0xFF;
 	buf[3] = address & 0xFF;
 	buf[4] = buf[0] ^ buf[1] ^ buf[2] ^ buf[3];
-	if (port->write(port, buf, 5) != PORT_ERR_OK)
+	if (stm32_port_write(stm, buf, 5) != PORT_ERR_OK)
 		return STM32_ERR_UNKNOWN;
 
 	if (stm32_get_ack(stm) != STM32_ERR_OK)
@@ -1036,7 +1567,6 @@ stm32_err_t stm32_reset_device(const stm32_t *stm)
 stm32_err_t stm32_crc_memory(const stm32_t *stm, uint32_t address,
 			     uint32_t length, uint32_t *crc)
 {
-	struct port_interface *port = stm->port;
 	uint8_t buf[5];
 
 	if ((address & 0x3) || (length & 0x3)) {
@@ -1057,7 +1587,7 @@ stm32_err_t stm32_crc_memory(const stm32_t *stm, uint32_t address,
 	buf[2] = (address >> 8) & 0xFF;
 	buf[3] = address & 0xFF;
 	buf[4] = buf[0] ^ buf[1] ^ buf[2] ^ buf[3];
-	if (port->write(port, buf, 5) != PORT_ERR_OK)
+	if (stm32_port_write(stm, buf, 5) != PORT_ERR_OK)
 		return STM32_ERR_UNKNOWN;
 
 	if (stm32_get_ack(stm) != STM32_ERR_OK)
@@ -1068,7 +1598,7 @@ stm32_err_t stm32_crc_memory(const stm32_t *stm, uint32_t address,
 	buf[2] = (length >> 8) & 0xFF;
 	buf[3] = length & 0xFF;
 	buf[4] = buf[0] ^ buf[1] ^ buf[2] ^ buf[3];
-	if (port->write(port, buf, 5) != PORT_ERR_OK)
+	if (stm32_port_write(stm, buf, 5) != PORT_ERR_OK)
 		return STM32_ERR_UNKNOWN;
 
 	if (stm32_get_ack(stm) != STM32_ERR_OK)
@@ -1077,7 +1607,7 @@ stm32_err_t stm32_crc_memory(const stm32_t *stm, uint32_t address,
 	if (stm32_get_ack(stm) != STM32_ERR_OK)
 		return STM32_ERR_UNKNOWN;
 
-	if (port->read(port, buf, 5) != PORT_ERR_OK)
+	if (stm32_port_read(stm, buf, 5) != PORT_ERR_OK)
 		return STM32_ERR_UNKNOWN;
 
 	if (buf[4] != (buf[0] ^ buf[1] ^ buf[2] ^ buf[3]))
@@ -1087,43 +1617,19 @@ stm32_err_t stm32_crc_memory(const stm32_t *stm, uint32_t address,
 	return STM32_ERR_OK;
 }
 
-/*
- * CRC computed by STM32 is similar to the standard crc32_be()
- * implemented, for example, in Linux kernel in ./lib/crc32.c
- * But STM32 computes it on units of 32 bits word and swaps the
- * bytes of the word before the computation.
- * Due to byte swap, I cannot use any CRC available in existing
- * libraries, so here is a simple not optimized implementation.
- */
-#define CRCPOLY_BE	0x04c11db7
-#define CRC_MSBMASK	0x80000000
-#define CRC_INIT_VALUE	0xFFFFFFFF
 uint32_t stm32_sw_crc(uint32_t crc, uint8_t *buf, unsigned int len)
 {
-	int i;
-	uint32_t data;
-
 	if (len & 0x3) {
 		fprintf(stderr, "Buffer length must be multiple of 4 bytes\n");
 		return 0;
 	}
 
-	while (len) {
-		data = *buf++;
-		data |= *buf++ << 8;
-		data |= *buf++ << 16;
-		data |= *buf++ << 24;
-		len -= 4;
-
-		crc ^= data;
+	return crc_stm32(crc, buf, len);
+}
 
-		for (i = 0; i < 32; i++)
-			if (crc & CRC_MSBMASK)
-				crc = (crc << 1) ^ CRCPOLY_BE;
-			else
-				crc = (crc << 1);
-	}
-	return crc;
+int stm32_has_crc(const stm32_t *stm)
+{
+	return stm->cmd->crc != STM32_CMD_ERR;
 }
 
 stm32_err_t stm32_crc_wrapper(const stm32_t *stm, uint32_t address,
@@ -1142,7 +1648,7 @@ stm32_err_t stm32_crc_wrapper(const stm32_t *stm, uint32_t address,
 
 	start = address;
 	total_len = length;
-	current_crc = CRC_INIT_VALUE;
+	current_crc = STM32_CRC_INIT;
 	while (length) {
 		len = length > 256 ? 256 : length;
 		if (stm32_read_memory(stm, address, buf, len) != STM32_ERR_OK) {
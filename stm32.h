@@ -22,6 +22,7 @@
 #define _STM32_H
 
 #include <stdint.h>
+#include <stdio.h>
 #include "serial.h"
 
 #define STM32_MAX_RX_FRAME	256	/* cmd read memory */
@@ -30,6 +31,8 @@
 #define STM32_MAX_PAGES		0x0000ffff
 #define STM32_MASS_ERASE	0x00100000 /* > 2 x max_pages */
 
+#define STM32_CRC_INIT		0xFFFFFFFF /* initial value for stm32_sw_crc() */
+
 typedef enum {
 	STM32_ERR_OK = 0,
 	STM32_ERR_UNKNOWN,	/* Generic error */
@@ -43,6 +46,39 @@ typedef enum {
 	F_PEMPTY = 1 << 2,	/* clear PEMPTY bit required */
 } flags_t;
 
+/* class of commands sharing the same ACK timeout */
+typedef enum {
+	STM32_TMO_WRITE = 0,	/* write memory, per block */
+	STM32_TMO_PAGE_ERASE,	/* erase, per page */
+	STM32_TMO_MASS_ERASE,	/* mass erase and readout unprotect */
+	STM32_TMO_PROTECT,	/* write (un)protect, readout protect */
+	STM32_TMO_NUM
+} stm32_tmo_t;
+
+/* phases of a session, for statistics */
+typedef enum {
+	STM32_PHASE_INIT = 0,
+	STM32_PHASE_ERASE,
+	STM32_PHASE_WRITE,
+	STM32_PHASE_VERIFY,
+	STM32_PHASE_READ,
+	STM32_PHASE_CRC,
+	STM32_PHASE_OTHER,
+	STM32_PHASE_NUM
+} stm32_phase_t;
+
+/*
+ * What the discovery of stm32_init() learns about a bootloader, to skip it
+ * in a later session with the same device.
+ */
+struct stm32_profile {
+	int		valid;
+	uint8_t		version;		/* from GVR */
+	uint8_t		option1, option2;
+	uint16_t	pid;			/* from GID */
+	uint8_t		get[32];		/* reply of GET, length first */
+};
+
 typedef struct stm32		stm32_t;
 typedef struct stm32_cmd	stm32_cmd_t;
 typedef struct stm32_dev	stm32_dev_t;
@@ -56,6 +92,9 @@ struct stm32 {
 	uint16_t		pid;
 	stm32_cmd_t		*cmd;
 	const stm32_dev_t	*dev;
+	unsigned int		timeout[STM32_TMO_NUM];	/* ms */
+	struct stm32_ack_stat	*ack_stat;	/* NULL if not adaptive */
+	struct stm32_stats	*stats;
 };
 
 struct stm32_dev {
@@ -71,6 +110,8 @@ struct stm32_dev {
 };
 
 stm32_t *stm32_init(struct port_interface *port, const char init);
+stm32_t *stm32_init_profile(struct port_interface *port, const char init,
+			    struct stm32_profile *prof);
 void stm32_close(stm32_t *stm);
 stm32_err_t stm32_read_memory(const stm32_t *stm, uint32_t address,
 			      uint8_t data[], unsigned int len);
@@ -89,6 +130,14 @@ stm32_err_t stm32_crc_memory(const stm32_t *stm, uint32_t address,
 stm32_err_t stm32_crc_wrapper(const stm32_t *stm, uint32_t address,
 			      uint32_t length, uint32_t *crc);
 uint32_t stm32_sw_crc(uint32_t crc, uint8_t *buf, unsigned int len);
+int stm32_has_crc(const stm32_t *stm);
+int stm32_addr_to_page_floor(const stm32_t *stm, uint32_t addr);
+int stm32_addr_to_page_ceil(const stm32_t *stm, uint32_t addr);
+uint32_t stm32_page_to_addr(const stm32_t *stm, int page);
+void stm32_set_timeout(stm32_t *stm, stm32_tmo_t tmo, unsigned int ms);
+int stm32_set_adaptive_timeout(stm32_t *stm, int enable);
+void stm32_stats_phase(const stm32_t *stm, stm32_phase_t phase);
+void stm32_stats_print(const stm32_t *stm, FILE *f, int json);
 
 #endif
 
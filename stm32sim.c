@@ -0,0 +1,148 @@
+/*
+  stm32flash - Open Source ST STM32 flash program for *nix
+  Copyright (C) 2026 The stm32flash contributors
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+ * Expose the bootloader simulator on a pseudo terminal, to exercise the
+ * real serial code path:
+ *	stm32sim 0x413,crc &
+ *	stm32flash -m 8n1 -w file.bin /dev/pts/N
+ * A pty cannot emulate the parity bit, hence "-m 8n1".
+ */
+
+#define _XOPEN_SOURCE 600
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "compiler.h"
+#include "sim.h"
+#include "utils.h"
+
+static volatile sig_atomic_t quit;
+
+static void sig_handler(int __unused sig)
+{
+	quit = 1;
+}
+
+static int write_all(int fd, const uint8_t *buf, size_t len)
+{
+	ssize_t r;
+
+	while (len) {
+		r = write(fd, buf, len);
+		if (r < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			return -1;
+		}
+		buf += r;
+		len -= r;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct pollfd pfd;
+	uint8_t buf[4096];
+	uint64_t t0_ms, t0_us, virt_ms, now_ms;
+	sim_t *sim;
+	ssize_t r;
+	size_t n;
+	int master, slave;
+	char *name;
+
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s <device_id>[,options]\n"
+			"	Options as for stm32flash device \"sim:...\"\n",
+			argv[0]);
+		return 1;
+	}
+
+	sim = sim_new(argv[1], SERIAL_BAUD_115200);
+	if (!sim)
+		return 1;
+
+	master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (master < 0 || grantpt(master) || unlockpt(master)) {
+		perror("posix_openpt");
+		sim_free(sim);
+		return 1;
+	}
+	name = ptsname(master);
+	/* keep the slave open, so the master does not get EIO between runs */
+	slave = open(name, O_RDWR | O_NOCTTY);
+	if (slave < 0) {
+		perror(name);
+		sim_free(sim);
+		return 1;
+	}
+	printf("%s\n", name);
+	fflush(stdout);
+
+	signal(SIGINT, sig_handler);
+	signal(SIGTERM, sig_handler);
+
+	t0_ms = get_time_ms();
+	t0_us = sim_time_us(sim);
+	pfd.fd = master;
+	pfd.events = POLLIN;
+	while (!quit) {
+		if (poll(&pfd, 1, 100) <= 0)
+			continue;
+		r = read(master, buf, sizeof(buf));
+		if (r < 0) {
+			if (errno == EINTR || errno == EAGAIN || errno == EIO)
+				continue;
+			perror("read");
+			break;
+		}
+		if (sim_input(sim, buf, r)) {
+			fprintf(stderr, "Out of memory\n");
+			break;
+		}
+
+		if (sim_realtime(sim)) {
+			virt_ms = (sim_time_us(sim) - t0_us) / 1000;
+			now_ms = get_time_ms() - t0_ms;
+			if (virt_ms > now_ms)
+				usleep((virt_ms - now_ms) * 1000);
+		}
+
+		while ((n = sim_output(sim, buf, sizeof(buf))))
+			if (write_all(master, buf, n)) {
+				perror("write");
+				quit = 1;
+				break;
+			}
+	}
+
+	close(slave);
+	close(master);
+	sim_free(sim);
+	return 0;
+}
@@ -0,0 +1,628 @@
+/*
+  stm32flash - Open Source ST STM32 flash program for *nix
+  Copyright (C) 2026 The stm32flash contributors
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compiler.h"
+#include "serial.h"
+#include "port.h"
+#include "trace.h"
+#include "utils.h"
+
+#define TRACE_MAGIC	"STM32TRC"
+#define TRACE_VERSION	1
+
+#define TRACE_READ	'R'
+#define TRACE_WRITE	'W'
+#define TRACE_FLUSH	'F'
+#define TRACE_GPIO	'G'
+
+/* ------------------------------------------------------------------ */
+/* recorder                                                           */
+/* ------------------------------------------------------------------ */
+
+struct trace {
+	struct port_interface *inner;
+	struct port_interface port;	/* the wrapper */
+	FILE *f;
+	char *filename;
+	uint64_t t0;
+	int dumped;
+
+	/* flight recorder */
+	uint8_t *ring;
+	size_t ring_size, head, used;
+};
+
+static unsigned int put_varint(uint8_t *buf, uint64_t v)
+{
+	unsigned int n = 0;
+
+	do {
+		buf[n] = v & 0x7f;
+		v >>= 7;
+		if (v)
+			buf[n] |= 0x80;
+		n++;
+	} while (v);
+	return n;
+}
+
+static uint8_t ring_get(const struct trace *t, size_t offset)
+{
+	return t->ring[(t->head + offset) % t->ring_size];
+}
+
+/* drop the oldest record from the ring */
+static void ring_drop(struct trace *t)
+{
+	size_t off = 2;	/* type, status */
+	uint64_t len;
+	int i, shift;
+
+	for (i = 0; i < 2; i++) {	/* time, length */
+		len = 0;
+		shift = 0;
+		do {
+			len |= (uint64_t)(ring_get(t, off) & 0x7f) << shift;
+			shift += 7;
+		} while (ring_get(t, off++) & 0x80);
+	}
+	off += len;
+	t->head = (t->head + off) % t->ring_size;
+	t->used -= off;
+}
+
+static void ring_put(struct trace *t, const uint8_t *buf, size_t len)
+{
+	size_t tail;
+
+	while (len--) {
+		tail = (t->head + t->used) % t->ring_size;
+		t->ring[tail] = *buf++;
+		t->used++;
+	}
+}
+
+static void trace_out(struct trace *t, const uint8_t *buf, size_t len)
+{
+	if (t->ring)
+		ring_put(t, buf, len);
+	else
+		fwrite(buf, 1, len, t->f);
+}
+
+static void trace_header(struct trace *t)
+{
+	uint8_t buf[16];
+	const char *cfg, *name = t->inner->name;
+
+	cfg = t->inner->get_cfg_str ? t->inner->get_cfg_str(t->inner) : "";
+	fwrite(TRACE_MAGIC, 1, strlen(TRACE_MAGIC), t->f);
+	buf[0] = TRACE_VERSION;
+	fwrite(buf, 1, 1, t->f);
+	fwrite(buf, 1, put_varint(buf, t->inner->flags), t->f);
+	fwrite(buf, 1, put_varint(buf, strlen(name)), t->f);
+	fwrite(name, 1, strlen(name), t->f);
+	fwrite(buf, 1, put_varint(buf, strlen(cfg)), t->f);
+	fwrite(cfg, 1, strlen(cfg), t->f);
+}
+
+static void trace_record(struct trace *t, uint8_t type, port_err_t status,
+			 const struct port_iov *iov, int iovcnt)
+{
+	uint8_t hdr[2 + 10 + 10];
+	size_t len = 0, rec_len;
+	unsigned int n;
+	int i;
+
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].len;
+
+	hdr[0] = type;
+	hdr[1] = status;
+	n = 2;
+	n += put_varint(hdr + n, get_time_us() - t->t0);
+	n += put_varint(hdr + n, len);
+
+	if (t->ring) {
+		rec_len = n + len;
+		if (rec_len > t->ring_size)
+			return;
+		while (t->used + rec_len > t->ring_size)
+			ring_drop(t);
+	}
+	trace_out(t, hdr, n);
+	for (i = 0; i < iovcnt; i++)
+		trace_out(t, iov[i].buf, iov[i].len);
+}
+
+static void trace_record_buf(struct trace *t, uint8_t type, port_err_t status,
+			     const void *buf, size_t len)
+{
+	struct port_iov iov = { buf, len };
+
+	trace_record(t, type, status, &iov, 1);
+}
+
+static port_err_t trace_port_close(struct port_interface *port);
+
+/* the session failed: write the content of the flight recorder */
+void trace_error(struct port_interface *port)
+{
+	struct trace *t = port->private;
+	size_t first;
+
+	/* not a trace port, trace_wrap() failed */
+	if (port->close != trace_port_close || !t->ring)
+		return;
+
+	trace_header(t);
+	first = t->ring_size - t->head;
+	if (first > t->used)
+		first = t->used;
+	fwrite(t->ring + t->head, 1, first, t->f);
+	fwrite(t->ring, 1, t->used - first, t->f);
+	fflush(t->f);
+	free(t->ring);
+	t->ring = NULL;
+	t->dumped = 1;
+}
+
+static port_err_t trace_port_open(struct port_interface __unused *port,
+				  struct port_options __unused *ops)
+{
+	/* the inner port is already open */
+	return PORT_ERR_OK;
+}
+
+static port_err_t trace_port_close(struct port_interface *port)
+{
+	struct trace *t = port->private;
+	port_err_t ret;
+
+	ret = t->inner->close(t->inner);
+	if (fclose(t->f))
+		perror(t->filename);
+	/* flight recorder without errors, nothing to keep */
+	if (t->ring && !t->dumped)
+		remove(t->filename);
+	free(t->ring);
+	free(t->filename);
+	free(t);
+	return ret;
+}
+
+static port_err_t trace_port_flush(struct port_interface *port)
+{
+	struct trace *t = port->private;
+	port_err_t ret;
+
+	ret = t->inner->flush(t->inner);
+	trace_record(t, TRACE_FLUSH, ret, NULL, 0);
+	return ret;
+}
+
+static port_err_t trace_port_read(struct port_interface *port, void *buf,
+				  size_t nbyte)
+{
+	struct trace *t = port->private;
+	port_err_t ret;
+
+	ret = t->inner->read(t->inner, buf, nbyte);
+	trace_record_buf(t, TRACE_READ, ret, buf, ret == PORT_ERR_OK ? nbyte : 0);
+	port->stats = t->inner->stats;
+	return ret;
+}
+
+static port_err_t trace_port_read_deadline(struct port_interface *port,
+					   void *buf, size_t nbyte,
+					   uint64_t deadline)
+{
+	struct trace *t = port->private;
+	port_err_t ret;
+
+	ret = port_read_deadline(t->inner, buf, nbyte, deadline);
+	trace_record_buf(t, TRACE_READ, ret, buf, ret == PORT_ERR_OK ? nbyte : 0);
+	port->stats = t->inner->stats;
+	return ret;
+}
+
+static port_err_t trace_port_write(struct port_interface *port, void *buf,
+				   size_t nbyte)
+{
+	struct trace *t = port->private;
+	port_err_t ret;
+
+	ret = t->inner->write(t->inner, buf, nbyte);
+	trace_record_buf(t, TRACE_WRITE, ret, buf, nbyte);
+	return ret;
+}
+
+static port_err_t trace_port_writev(struct port_interface *port,
+				    const struct port_iov *iov, int iovcnt)
+{
+	struct trace *t = port->private;
+	port_err_t ret;
+
+	ret = port_writev(t->inner, iov, iovcnt);
+	trace_record(t, TRACE_WRITE, ret, iov, iovcnt);
+	return ret;
+}
+
+static port_err_t trace_port_gpio(struct port_interface *port,
+				  serial_gpio_t n, int level)
+{
+	struct trace *t = port->private;
+	uint8_t buf[2] = { n, level };
+	port_err_t ret;
+
+	ret = t->inner->gpio(t->inner, n, level);
+	trace_record_buf(t, TRACE_GPIO, ret, buf, 2);
+	return ret;
+}
+
+static const char *trace_port_get_cfg_str(struct port_interface *port)
+{
+	struct trace *t = port->private;
+
+	return t->inner->get_cfg_str(t->inner);
+}
+
+/*
+ * Return a port that forwards every call to the open "port" and records
+ * it in "filename". Closing the returned port closes "port" too.
+ * On error, "port" is returned unchanged.
+ */
+struct port_interface *trace_wrap(struct port_interface *port,
+				  const char *filename, size_t ring_size)
+{
+	struct trace *t;
+
+	t = calloc(1, sizeof(*t));
+	if (!t) {
+		fprintf(stderr, "Out of memory\n");
+		return port;
+	}
+	t->f = fopen(filename, "wb");
+	if (!t->f) {
+		perror(filename);
+		free(t);
+		return port;
+	}
+	t->filename = strdup(filename);
+	if (ring_size) {
+		t->ring = malloc(ring_size);
+		if (!t->ring) {
+			fprintf(stderr, "Out of memory\n");
+			fclose(t->f);
+			free(t->filename);
+			free(t);
+			return port;
+		}
+		t->ring_size = ring_size;
+	}
+
+	t->inner = port;
+	t->t0 = get_time_us();
+	t->port.name		= port->name;
+	t->port.flags		= port->flags;
+	t->port.open		= trace_port_open;
+	t->port.close		= trace_port_close;
+	t->port.flush		= trace_port_flush;
+	t->port.read		= trace_port_read;
+	t->port.read_deadline	= trace_port_read_deadline;
+	t->port.write		= trace_port_write;
+	t->port.writev		= trace_port_writev;
+	t->port.gpio		= trace_port_gpio;
+	t->port.get_cfg_str	= trace_port_get_cfg_str;
+	t->port.cmd_get_reply	= port->cmd_get_reply;
+	t->port.private		= t;
+
+	if (!t->ring)
+		trace_header(t);
+	return &t->port;
+}
+
+/* ------------------------------------------------------------------ */
+/* replay port, for device names "replay:<file>"                      */
+/* ------------------------------------------------------------------ */
+
+struct replay_rec {
+	uint8_t type;
+	uint8_t status;
+	uint64_t time;
+	size_t len;
+	const uint8_t *data;
+};
+
+struct replay {
+	uint8_t *file;
+	struct replay_rec *rec;
+	size_t nrec;
+	size_t cur;		/* current record */
+	size_t pos;		/* bytes of current record already used */
+	unsigned long long tx_bytes;
+	char *cfg;
+};
+
+static int get_varint(const uint8_t **p, const uint8_t *end, uint64_t *v)
+{
+	int shift = 0;
+
+	*v = 0;
+	do {
+		if (*p >= end || shift > 63)
+			return -1;
+		*v |= (uint64_t)(**p & 0x7f) << shift;
+		shift += 7;
+	} while (*(*p)++ & 0x80);
+	return 0;
+}
+
+static int replay_load(struct replay *r, const char *filename,
+		       unsigned int *flags)
+{
+	const uint8_t *p, *end;
+	uint64_t v, len;
+	size_t size = 0, n, alloc = 0;
+	FILE *f;
+
+	f = fopen(filename, "rb");
+	if (!f) {
+		perror(filename);
+		return -1;
+	}
+	do {
+		if (size == alloc) {
+			alloc = alloc ? alloc * 2 : 65536;
+			r->file = realloc(r->file, alloc);
+			if (!r->file) {
+				fclose(f);
+				return -1;
+			}
+		}
+		n = fread(r->file + size, 1, alloc - size, f);
+		size += n;
+	} while (n);
+	fclose(f);
+
+	p = r->file;
+	end = r->file + size;
+	if (size < strlen(TRACE_MAGIC) + 1
+	    || memcmp(p, TRACE_MAGIC, strlen(TRACE_MAGIC))
+	    || p[strlen(TRACE_MAGIC)] != TRACE_VERSION)
+		goto bad;
+	p += strlen(TRACE_MAGIC) + 1;
+	if (get_varint(&p, end, &v))
+		goto bad;
+	*flags = v;
+	if (get_varint(&p, end, &len) || len > (uint64_t)(end - p))
+		goto bad;
+	p += len;	/* name of the recorded port */
+	if (get_varint(&p, end, &len) || len > (uint64_t)(end - p))
+		goto bad;
+	r->cfg = malloc(len + 1);
+	if (!r->cfg)
+		return -1;
+	memcpy(r->cfg, p, len);
+	r->cfg[len] = '\0';
+	p += len;
+
+	alloc = 0;
+	while (p < end) {
+		if (r->nrec == alloc) {
+			alloc = alloc ? alloc * 2 : 1024;
+			r->rec = realloc(r->rec, alloc * sizeof(*r->rec));
+			if (!r->rec)
+				return -1;
+		}
+		if (end - p < 2)
+			goto bad;
+		r->rec[r->nrec].type = *p++;
+		r->rec[r->nrec].status = *p++;
+		if (get_varint(&p, end, &r->rec[r->nrec].time)
+		    || get_varint(&p, end, &len) || len > (uint64_t)(end - p))
+			goto bad;
+		r->rec[r->nrec].len = len;
+		r->rec[r->nrec].data = p;
+		p += len;
+		r->nrec++;
+	}
+	return 0;
+
+bad:
+	fprintf(stderr, "replay: invalid trace file %s\n", filename);
+	return -1;
+}
+
+static port_err_t replay_open(struct port_interface *port,
+			      struct port_options *ops)
+{
+	struct replay *r;
+	unsigned int flags;
+
+	if (strncmp(ops->device, "replay:", strlen("replay:")))
+		return PORT_ERR_NODEV;
+
+	r = calloc(1, sizeof(*r));
+	if (!r)
+		return PORT_ERR_UNKNOWN;
+	if (replay_load(r, ops->device + strlen("replay:"), &flags)) {
+		free(r->file);
+		free(r->rec);
+		free(r->cfg);
+		free(r);
+		return PORT_ERR_UNKNOWN;
+	}
+	port->flags = flags;
+	port->private = r;
+	return PORT_ERR_OK;
+}
+
+/* skip records not relevant to the current call, and exhausted records */
+static struct replay_rec *replay_next(struct replay *r)
+{
+	struct replay_rec *rec;
+
+	while (r->cur < r->nrec) {
+		rec = &r->rec[r->cur];
+		if ((rec->type == TRACE_READ || rec->type == TRACE_WRITE)
+		    && (r->pos < rec->len || rec->status != PORT_ERR_OK))
+			return rec;
+		r->cur++;
+		r->pos = 0;
+	}
+	return NULL;
+}
+
+static port_err_t replay_close(struct port_interface *port)
+{
+	struct replay *r = port->private;
+
+	if (r == NULL)
+		return PORT_ERR_UNKNOWN;
+	replay_next(r);
+	if (r->cur < r->nrec)
+		fprintf(stderr, "replay: %lu of %lu records not replayed\n",
+			(unsigned long)(r->nrec - r->cur),
+			(unsigned long)r->nrec);
+	free(r->file);
+	free(r->rec);
+	free(r->cfg);
+	free(r);
+	port->private = NULL;
+	return PORT_ERR_OK;
+}
+
+static port_err_t replay_flush(struct port_interface *port)
+{
+	struct replay *r = port->private;
+	struct replay_rec *rec;
+
+	/* discard data received but not read */
+	while ((rec = replay_next(r)) && rec->type == TRACE_READ) {
+		r->cur++;
+		r->pos = 0;
+	}
+	return PORT_ERR_OK;
+}
+
+static port_err_t replay_read(struct port_interface *port, void *buf,
+			      size_t nbyte)
+{
+	struct replay *r = port->private;
+	struct replay_rec *rec;
+	uint8_t *p = buf;
+	size_t n;
+
+	port->stats.rx_calls++;
+	while (nbyte) {
+		rec = replay_next(r);
+		/* nothing was received at this point of the session */
+		if (!rec || rec->type != TRACE_READ)
+			return PORT_ERR_TIMEDOUT;
+		if (rec->status != PORT_ERR_OK) {
+			r->cur++;
+			r->pos = 0;
+			return rec->status;
+		}
+		n = rec->len - r->pos;
+		n = n < nbyte ? n : nbyte;
+		memcpy(p, rec->data + r->pos, n);
+		r->pos += n;
+		p += n;
+		nbyte -= n;
+	}
+	return PORT_ERR_OK;
+}
+
+static port_err_t replay_read_deadline(struct port_interface *port,
+				       void *buf, size_t nbyte,
+				       uint64_t __unused deadline)
+{
+	return replay_read(port, buf, nbyte);
+}
+
+static port_err_t replay_write(struct port_interface *port, void *buf,
+			       size_t nbyte)
+{
+	struct replay *r = port->private;
+	struct replay_rec *rec;
+	const uint8_t *p = buf;
+	size_t n;
+
+	/* data received and never read is lost, as on a real line */
+	replay_flush(port);
+	while (nbyte) {
+		rec = replay_next(r);
+		if (!rec || rec->type != TRACE_WRITE) {
+			fprintf(stderr, "replay: unexpected write at TX byte %llu\n",
+				r->tx_bytes);
+			return PORT_ERR_UNKNOWN;
+		}
+		if (rec->status != PORT_ERR_OK) {
+			r->cur++;
+			r->pos = 0;
+			return rec->status;
+		}
+		n = rec->len - r->pos;
+		n = n < nbyte ? n : nbyte;
+		if (memcmp(p, rec->data + r->pos, n)) {
+			fprintf(stderr, "replay: session diverges at TX byte %llu\n",
+				r->tx_bytes);
+			return PORT_ERR_UNKNOWN;
+		}
+		r->pos += n;
+		r->tx_bytes += n;
+		p += n;
+		nbyte -= n;
+	}
+	return PORT_ERR_OK;
+}
+
+static port_err_t replay_gpio(struct port_interface __unused *port,
+			      serial_gpio_t __unused n,
+			      int __unused level)
+{
+	return PORT_ERR_OK;
+}
+
+static const char *replay_get_cfg_str(struct port_interface *port)
+{
+	struct replay *r = port->private;
+
+	return r ? r->cfg : "INVALID";
+}
+
+struct port_interface port_replay = {
+	.name	= "replay",
+	.flags	= 0,
+	.open	= replay_open,
+	.close	= replay_close,
+	.flush	= replay_flush,
+	.read	= replay_read,
+	.read_deadline	= replay_read_deadline,
+	.write	= replay_write,
+	.gpio	= replay_gpio,
+	.get_cfg_str	= replay_get_cfg_str,
+};
@@ -0,0 +1,47 @@
+/*
+  stm32flash - Open Source ST STM32 flash program for *nix
+  Copyright (C) 2026 The stm32flash contributors
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+
+#ifndef _H_TRACE
+#define _H_TRACE
+
+#include <stddef.h>
+
+#include "port.h"
+
+/*
+ * Wire trace of a session: every read, write, flush and GPIO call on the
+ * port, with its status and a timestamp.
+ *
+ * File format, integers as LEB128 varint unless noted:
+ *	header:	"STM32TRC", version (byte), port flags, port name length,
+ *		port name, configuration length, configuration string
+ *	record:	type (byte 'R', 'W', 'F' or 'G'), status (byte port_err_t),
+ *		time in us since open, data length, data
+ * Data of 'R' are the bytes received, of 'W' the bytes sent, of 'G' the
+ * GPIO number and level as two bytes.
+ *
+ * With ring_size not zero, the records are kept in a ring buffer of that
+ * many bytes and written to the file only by trace_error().
+ */
+struct port_interface *trace_wrap(struct port_interface *port,
+				  const char *filename, size_t ring_size);
+void trace_error(struct port_interface *port);
+
+#endif
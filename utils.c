@@ -18,8 +18,13 @@
 */
 
 #include <stdint.h>
+#include <time.h>
 #include "utils.h"
 
+#if defined(__WIN32__) || defined(__CYGWIN__)
+#include <windows.h>
+#endif
+
 /* detect CPU endian */
 char cpu_le() {
 	const uint32_t cpu_le_test = 0x12345678;
@@ -50,3 +55,34 @@ void printStatus(FILE *fd, int condition){
 	else
 		fprintf(fd, "OK\n");
 }
+
+/* monotonic time in milliseconds, from an unspecified starting point */
+uint64_t get_time_ms(void)
+{
+#if defined(__WIN32__) || defined(__CYGWIN__)
+	return GetTickCount64();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
+/* monotonic time in us, for statistics */
+uint64_t get_time_us(void)
+{
+#if defined(__WIN32__) || defined(__CYGWIN__)
+	LARGE_INTEGER count, freq;
+
+	QueryPerformanceCounter(&count);
+	QueryPerformanceFrequency(&freq);
+	return count.QuadPart / freq.QuadPart * 1000000
+	       + count.QuadPart % freq.QuadPart * 1000000 / freq.QuadPart;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
@@ -30,4 +30,7 @@ uint32_t le_u32(const uint32_t v);
 
 void printStatus(FILE *fd, int condition);
 
+uint64_t get_time_ms(void);
+uint64_t get_time_us(void);
+
 #endif